@@ -484,6 +484,7 @@ void ConsoleView_CmdShowHelp(const ConsoleCommandParams& /*params*/)
             _T("  t          Tracing on/off to trace.log file\r\n")
             _T("  tXXXXXX    Set tracing flags\r\n")
             _T("  tc         Clear trace.log file\r\n")
+            _T("  l          Lockstep check of translated code on/off\r\n")
 #endif
                      );
 }
@@ -731,6 +732,12 @@ void ConsoleView_CmdTraceLogOnOff(const ConsoleCommandParams& /*params*/)
     DWORD dwTrace = (g_pBoard->GetTrace() == TRACE_NONE ? TRACE_ALL : TRACE_NONE);
     ConsoleView_TraceLog(dwTrace);
 }
+void ConsoleView_CmdLockstepOnOff(const ConsoleCommandParams& /*params*/)
+{
+    CProcessor* pProc = ConsoleView_GetCurrentProcessor();
+    pProc->SetLockstep(!pProc->IsLockstep());
+    ConsoleView_Print(pProc->IsLockstep() ? _T("  Lockstep check ON.\r\n") : _T("  Lockstep check OFF.\r\n"));
+}
 #endif
 
 
@@ -789,6 +796,7 @@ static ConsoleCommands[] =
     { _T("t%ho"), ARGINFO_OCT, ConsoleView_CmdTraceLogWithMask },
     { _T("t"), ARGINFO_NONE, ConsoleView_CmdTraceLogOnOff },
     { _T("tc"), ARGINFO_NONE, ConsoleView_CmdClearTraceLog },
+    { _T("l"), ARGINFO_NONE, ConsoleView_CmdLockstepOnOff },
 #endif
 };
 const size_t ConsoleCommandsCount = sizeof(ConsoleCommands) / sizeof(ConsoleCommands[0]);
@@ -17,6 +17,7 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 #include "Emulator.h"
 #include "Views.h"
 #include "emubase\Emubase.h"
+#include "util/FramePacer.h"
 #include "SoundGen.h"
 
 //////////////////////////////////////////////////////////////////////
@@ -34,6 +35,13 @@ uint16_t m_EmulatorWatches[MAX_BREAKPOINTCOUNT + 1];
 
 bool m_okEmulatorSound = false;
 uint16_t m_wEmulatorSoundSpeed = 100;
+int m_nEmulatorSpeedPercent = 100;  // 0 = maximum speed
+bool m_okEmulatorAutoWarp = false;  // Maximum speed while the floppy motor is on
+int m_nEmulatorAutoWarpFrames = 25;  // Frames to stay in warp after the motor stops
+int m_nEmulatorWarpCountdown = -1;  // Frames left to the warp end; -1 = no warp
+long m_nEmulatorWarpFrames = 0;  // Frames emulated in the current warp
+int64_t m_nEmulatorWarpStartTime = 0;  // FramePacer_GetTime() at the warp start, microseconds
+double m_dEmulatorWarpTimeSaved = 0.0;  // Wall-clock seconds saved by all the warps
 bool m_okEmulatorCovox = false;
 int m_nEmulatorSoundChanges = 0;
 
@@ -54,8 +62,6 @@ uint16_t g_wEmulatorCpuPC = 0177777;      // Current PC value
 uint16_t g_wEmulatorPrevCpuPC = 0177777;  // Previous PC value
 
 
-void CALLBACK Emulator_SoundGenCallback(uint16_t value);
-
 //////////////////////////////////////////////////////////////////////
 //Прототип функции преобразования экрана
 // Input:
@@ -114,8 +120,6 @@ bool Emulator_Init()
 {
     ASSERT(g_pBoard == nullptr);
 
-    CProcessor::Init();
-
     m_wEmulatorCPUBpsCount = 0;
     for (int i = 0; i <= MAX_BREAKPOINTCOUNT; i++)
     {
@@ -136,11 +140,13 @@ bool Emulator_Init()
     g_pEmulatorChangedRam = static_cast<uint8_t*>(::calloc(128 * 1024, 1));
 
     g_pBoard->Reset();
+    g_pBoard->SetFloppyTurbo(Settings_GetFloppyTurbo() != FALSE);
+    Emulator_SetAutoWarp(Settings_GetAutoWarp() != FALSE, Settings_GetAutoWarpFrames());
 
     if (m_okEmulatorSound)
     {
         SoundGen_Initialize(Settings_GetSoundVolume());
-        g_pBoard->SetSoundGenCallback(Emulator_SoundGenCallback);
+        g_pBoard->SetSoundSampleRate(SOUNDSAMPLERATE);
     }
 
     return true;
@@ -154,9 +160,7 @@ void Emulator_Done()
     for (int i = 0; i < MAX_BREAKPOINTCOUNT; i++)
         Settings_SetDebugBreakpoint(i, i < m_wEmulatorCPUBpsCount ? m_EmulatorCPUBps[i] : 0177777);
 
-    CProcessor::Done();
-
-    g_pBoard->SetSoundGenCallback(nullptr);
+    g_pBoard->SetSoundSampleRate(0);
     SoundGen_Finalize();
 
     g_pBoard->SetSerialCallbacks(nullptr, nullptr);
@@ -242,6 +246,8 @@ void Emulator_Stop()
 {
     g_okEmulatorRunning = false;
 
+    Emulator_EndWarp();  // Don't count the pause as warp time
+
     Emulator_SetTempCPUBreakpoint(0177777);
 
     if (m_fpEmulatorParallelOut != nullptr)
@@ -409,6 +415,8 @@ void Emulator_RemoveAllWatches()
 
 void Emulator_SetSpeed(uint16_t realspeed)
 {
+    Emulator_EndWarp();  // Warp time is counted against the old speed
+
     uint16_t speedpercent = 100;
     switch (realspeed)
     {
@@ -420,11 +428,82 @@ void Emulator_SetSpeed(uint16_t realspeed)
     default: speedpercent = 100; break;
     }
     m_wEmulatorSoundSpeed = speedpercent;
+    m_nEmulatorSpeedPercent = (realspeed == 0) ? 0 : speedpercent;
 
     if (m_okEmulatorSound)
         SoundGen_SetSpeed(m_wEmulatorSoundSpeed);
 }
 
+int Emulator_GetSpeedPercent()
+{
+    return Emulator_IsWarping() ? 0 : m_nEmulatorSpeedPercent;
+}
+
+void Emulator_SetAutoWarp(bool okAutoWarp, int frames)
+{
+    if (!okAutoWarp)
+        Emulator_EndWarp();
+    m_okEmulatorAutoWarp = okAutoWarp;
+    m_nEmulatorAutoWarpFrames = (frames < 0) ? 0 : frames;
+}
+
+bool Emulator_IsWarping()
+{
+    return m_nEmulatorWarpCountdown >= 0;
+}
+
+double Emulator_GetWarpTimeSaved()
+{
+    return m_dEmulatorWarpTimeSaved;
+}
+
+// Auto-warp: start on the floppy motor on, end the given number of frames after the motor is off
+static void Emulator_UpdateWarp()
+{
+    if (!m_okEmulatorAutoWarp || m_nEmulatorSpeedPercent == 0)
+        return;
+
+    if (g_pBoard->IsFloppyEngineOn())
+    {
+        bool okStart = !Emulator_IsWarping();
+        m_nEmulatorWarpCountdown = m_nEmulatorAutoWarpFrames;
+        if (okStart)  // Count the frames from now on, the same interval as the time
+        {
+            m_nEmulatorWarpFrames = 0;
+            m_nEmulatorWarpStartTime = FramePacer_GetTime();
+            return;
+        }
+    }
+    if (!Emulator_IsWarping())
+        return;
+
+    m_nEmulatorWarpFrames++;
+    if (m_nEmulatorWarpCountdown == 0)
+        Emulator_EndWarp();
+    else if (!g_pBoard->IsFloppyEngineOn())
+        m_nEmulatorWarpCountdown--;
+}
+
+void Emulator_EndWarp()
+{
+    if (!Emulator_IsWarping())
+        return;
+    m_nEmulatorWarpCountdown = -1;
+    if (m_nEmulatorSpeedPercent == 0)
+        return;
+
+    // Compare with the time the frames take at the selected speed, 40 ms per frame at 100%
+    int64_t nElapsed = FramePacer_GetTime() - m_nEmulatorWarpStartTime;
+    double dSaved = (m_nEmulatorWarpFrames * 40000.0 * 100 / m_nEmulatorSpeedPercent - nElapsed) / 1000000.0;
+    if (dSaved <= 0)
+        return;
+    m_dEmulatorWarpTimeSaved += dSaved;
+
+    TCHAR buffer[64];
+    _sntprintf(buffer, sizeof(buffer) / sizeof(TCHAR) - 1, _T("Auto-warp saved %.1f s, total %.1f s"), dSaved, m_dEmulatorWarpTimeSaved);
+    MainWindow_SetStatusbarText(StatusbarPartMessage, buffer);
+}
+
 void Emulator_SetSound(bool soundOnOff)
 {
     if (m_okEmulatorSound != soundOnOff)
@@ -433,11 +512,11 @@ void Emulator_SetSound(bool soundOnOff)
         {
             SoundGen_Initialize(Settings_GetSoundVolume());
             SoundGen_SetSpeed(m_wEmulatorSoundSpeed);
-            g_pBoard->SetSoundGenCallback(Emulator_SoundGenCallback);
+            g_pBoard->SetSoundSampleRate(SOUNDSAMPLERATE);
         }
         else
         {
-            g_pBoard->SetSoundGenCallback(nullptr);
+            g_pBoard->SetSoundSampleRate(0);
             SoundGen_Finalize();
         }
     }
@@ -577,6 +656,19 @@ bool Emulator_SystemFrame()
     if (!g_pBoard->SystemFrame())
         return false;
 
+    if (m_okEmulatorSound)
+    {
+        int16_t samples[SOUNDSAMPLERATE / 25];
+        int count;
+        while ((count = g_pBoard->GetSoundSamples(samples, sizeof(samples) / sizeof(int16_t))) > 0)
+        {
+            if (!Emulator_IsWarping())  // No sound in warp
+                SoundGen_FeedSamples(samples, count);
+        }
+    }
+
+    Emulator_UpdateWarp();
+
     // Calculate frames per second
     m_nFrameCount++;
     uint32_t dwCurrentTicks = GetTickCount();
@@ -585,8 +677,11 @@ bool Emulator_SystemFrame()
     {
         double dFramesPerSecond = m_nFrameCount * 1000.0 / nTicksElapsed;
         double dSpeed = dFramesPerSecond / 25.0 * 100;
-        TCHAR buffer[16];
-        _sntprintf(buffer, sizeof(buffer) / sizeof(TCHAR) - 1, _T("%03.f%%"), dSpeed);
+        TCHAR buffer[24];
+        if (Emulator_GetSpeedPercent() == 0)  // Maximum speed, show the real CPU clock; 7.5 MHz at 100%
+            _sntprintf(buffer, sizeof(buffer) / sizeof(TCHAR) - 1, _T("%03.f%% %.1f MHz"), dSpeed, dSpeed * 7.5 / 100);
+        else
+            _sntprintf(buffer, sizeof(buffer) / sizeof(TCHAR) - 1, _T("%03.f%%"), dSpeed);
         MainWindow_SetStatusbarText(StatusbarPartFPS, buffer);
 
         bool floppyEngine = g_pBoard->IsFloppyEngineOn();
@@ -625,11 +720,6 @@ bool Emulator_SystemFrame()
     return true;
 }
 
-void CALLBACK Emulator_SoundGenCallback(uint16_t value)
-{
-    SoundGen_FeedDAC(value);
-}
-
 // Update cached values after Run or Step
 void Emulator_OnUpdate()
 {
@@ -67,6 +67,11 @@ void Emulator_Stop();
 void Emulator_Reset();
 bool Emulator_SystemFrame();
 void Emulator_SetSpeed(uint16_t realspeed);
+int  Emulator_GetSpeedPercent();  // 0 means maximum speed
+void Emulator_SetAutoWarp(bool okAutoWarp, int frames);  // Maximum speed while the floppy motor is on, and frames after
+bool Emulator_IsWarping();
+void Emulator_EndWarp();
+double Emulator_GetWarpTimeSaved();  // Wall-clock seconds saved by auto-warp
 
 void Emulator_GetScreenSize(int scrmode, int* pwid, int* phei);
 const uint32_t * Emulator_GetPalette();
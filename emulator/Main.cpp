@@ -23,6 +23,8 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 #include "Emulator.h"
 #include "Views.h"
 #include "util/BitmapFile.h"
+#include "util/FramePacer.h"
+#include "SoundGen.h"
 
 
 //////////////////////////////////////////////////////////////////////
@@ -61,9 +63,6 @@ int APIENTRY _tWinMain(
 
     g_hInst = hInstance; // Store instance handle in our global variable
 
-    LARGE_INTEGER nFrameStartTime;
-    nFrameStartTime.QuadPart = 0;
-
     // Initialize global strings
     LoadString(g_hInst, IDS_APP_TITLE, g_szTitle, MAX_LOADSTRING);
     LoadString(g_hInst, IDC_APPLICATION, g_szWindowClass, MAX_LOADSTRING);
@@ -75,17 +74,18 @@ int APIENTRY _tWinMain(
 
     HACCEL hAccelTable = ::LoadAccelerators(hInstance, MAKEINTRESOURCE(IDC_APPLICATION));
 
-    LARGE_INTEGER nPerformanceFrequency;
-    ::QueryPerformanceFrequency(&nPerformanceFrequency);
+    CFramePacer pacer(1000000 / 25);  // 25 frames per second
+    ::timeBeginPeriod(1);  // Sleep() with 1 ms precision
 
     // Main message loop
     MSG msg;
     for (;;)
     {
-        ::QueryPerformanceCounter(&nFrameStartTime);
-
         if (!g_okEmulatorRunning)
+        {
             ::Sleep(1);
+            pacer.Reset();
+        }
         else
         {
             if (!Emulator_SystemFrame())  // Breakpoint hit
@@ -112,30 +112,15 @@ int APIENTRY _tWinMain(
             ::DispatchMessage(&msg);
         }
 
-        if (g_okEmulatorRunning && !Settings_GetSound())
+        if (g_okEmulatorRunning)
         {
-            if (Settings_GetRealSpeed() == 0)
-                ::Sleep(1);  // We should not consume 100% of CPU
-            else
-            {
-                // Slow down to 25 frames per second
-                LARGE_INTEGER nFrameFinishTime;  // Frame start time
-                ::QueryPerformanceCounter(&nFrameFinishTime);
-                LONGLONG nTimeElapsed = (nFrameFinishTime.QuadPart - nFrameStartTime.QuadPart)
-                        * 1000 / nPerformanceFrequency.QuadPart;
-                LONGLONG nFrameDelay = 1000 / 25 - 1;  // 1000 millisec / 25 = 40 millisec
-                if (Settings_GetRealSpeed() == 0x7ffe)  // Speed 25%
-                    nFrameDelay = 1000 / 25 * 4 - 1;
-                else if (Settings_GetRealSpeed() == 0x7fff)  // Speed 50%
-                    nFrameDelay = 1000 / 25 * 2 - 1;
-                else if (Settings_GetRealSpeed() == 2)  // Speed 200%
-                    nFrameDelay = 1000 / 25 / 2 - 1;
-                if (nTimeElapsed > 0 && nTimeElapsed < nFrameDelay)
-                {
-                    LONG nTimeToSleep = (LONG)(nFrameDelay - nTimeElapsed);
-                    ::Sleep((DWORD)nTimeToSleep);
-                }
-            }
+            // Keep the frame rate; with sound on, keep the sound ring half-full by small speed changes
+            pacer.SetSpeed(Emulator_GetSpeedPercent());
+            if (Settings_GetSound() && !Emulator_IsWarping())
+                pacer.SetSoundFillLevel(SoundGen_GetFillLevel(), RING_SIZE / 2);
+            LONGLONG nTimeToWait = pacer.FrameDone(FramePacer_GetTime());
+            if (nTimeToWait >= 1000)
+                ::Sleep((DWORD)(nTimeToWait / 1000));  // Oversleep is taken into account for the next frame
         }
 
         //// Time bomb for perfomance analysis
@@ -143,6 +128,7 @@ int APIENTRY _tWinMain(
         //    ::PostQuitMessage(0);
     }
 endprog:
+    ::timeEndPeriod(1);
 
     DoneInstance();
 
@@ -245,6 +231,22 @@ void ParseCommandLine()
         {
             Settings_SetSound(FALSE);
         }
+        else if (_tcscmp(arg, _T("/turbofloppy")) == 0)
+        {
+            Settings_SetFloppyTurbo(TRUE);
+        }
+        else if (_tcscmp(arg, _T("/noturbofloppy")) == 0)
+        {
+            Settings_SetFloppyTurbo(FALSE);
+        }
+        else if (_tcscmp(arg, _T("/autowarp")) == 0)
+        {
+            Settings_SetAutoWarp(TRUE);
+        }
+        else if (_tcscmp(arg, _T("/noautowarp")) == 0)
+        {
+            Settings_SetAutoWarp(FALSE);
+        }
         else if (_tcslen(arg) > 7 && _tcsncmp(arg, _T("/disk"), 5) == 0)  // "/diskN:filePath", N=0..3
         {
             if (arg[5] >= _T('0') && arg[5] <= _T('3') && arg[6] == ':')
@@ -160,6 +160,12 @@ void Settings_SetToolbar(BOOL flag);
 BOOL Settings_GetToolbar();
 void Settings_SetKeyboard(BOOL flag);
 BOOL Settings_GetKeyboard();
+void Settings_SetFloppyTurbo(BOOL flag);
+BOOL Settings_GetFloppyTurbo();
+void Settings_SetAutoWarp(BOOL flag);
+BOOL Settings_GetAutoWarp();
+void Settings_SetAutoWarpFrames(WORD frames);
+WORD Settings_GetAutoWarpFrames();
 void Settings_SetTape(BOOL flag);
 BOOL Settings_GetTape();
 WORD Settings_GetSpriteAddress();
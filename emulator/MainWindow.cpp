@@ -1086,7 +1086,8 @@ void MainWindow_DoEmulatorFloppy(int slot)
     BOOL okImageAttached = g_pBoard->IsFloppyImageAttached(slot);
     if (okImageAttached)
     {
-        g_pBoard->DetachFloppyImage(slot);
+        if (!g_pBoard->DetachFloppyImage(slot))
+            AlertWarning(_T("Failed to save the changes to the floppy image file."));
         Settings_SetFloppyFilePath(slot, NULL);
     }
     else
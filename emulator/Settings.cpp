@@ -360,6 +360,10 @@ SETTINGS_GETSET_DWORD(SoundVolume, _T("SoundVolume"), WORD, 0x3fff);
 
 SETTINGS_GETSET_DWORD(Keyboard, _T("Keyboard"), BOOL, TRUE);
 
+SETTINGS_GETSET_DWORD(FloppyTurbo, _T("FloppyTurbo"), BOOL, FALSE);
+SETTINGS_GETSET_DWORD(AutoWarp, _T("AutoWarp"), BOOL, FALSE);
+SETTINGS_GETSET_DWORD(AutoWarpFrames, _T("AutoWarpFrames"), WORD, 25);
+
 SETTINGS_GETSET_DWORD(Tape, _T("Tape"), BOOL, FALSE);
 
 SETTINGS_GETSET_DWORD(SpriteAddress, _T("SpriteAddress"), WORD, 0);
@@ -13,71 +13,73 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 #include "StdAfx.h"
 #include "emubase\Emubase.h"
 #include "SoundGen.h"
+#include "util\SoundRing.h"
 #include "Mmsystem.h"
 
 //////////////////////////////////////////////////////////////////////
 
 
-static void CALLBACK waveOutProc(HWAVEOUT, UINT, DWORD, DWORD, DWORD);
-
-static CRITICAL_SECTION waveCriticalSection;
-static WAVEHDR*         waveBlocks;
-static volatile int     waveFreeBlockCount;
-static int              waveCurrentBlock;
+// waveOut device, blocks are refilled from the audio thread
+class CSoundWaveOutSink : public CSoundSink
+{
+public:
+    HWAVEOUT    m_hWaveOut;
+private:
+    HANDLE      m_hEvent;  // Signaled by waveOut when a block is done
+    WAVEHDR*    m_pBlocks;
+    int         m_nCurrentBlock;
+public:
+    CSoundWaveOutSink();
+    virtual ~CSoundWaveOutSink();
+    bool        Open();
+    virtual int WaitBlock(int timeoutms);
+    virtual void WriteBlock(const int16_t* pSamples, int count);
+};
+
+static CSoundRing*   m_pSoundRing = nullptr;
+static CSoundSink*   m_pSoundSink = nullptr;
+static CSoundPlayer* m_pSoundPlayer = nullptr;
+static HWAVEOUT hWaveOut = NULL;  // NULL when we have no waveOut device
 
 static bool m_SoundGenInitialized = false;
 
-HWAVEOUT hWaveOut;
-
-WAVEFORMATEX wfx;
-char buffer[BUFSIZE];
-
-int bufcurpos;
-
 
 //////////////////////////////////////////////////////////////////////
 
 
-static void CALLBACK WaveCallback(HWAVEOUT /*hwo*/, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR /*dwParam1*/, DWORD_PTR /*dwParam2*/)
+CSoundWaveOutSink::CSoundWaveOutSink()
 {
-    int* freeBlockCounter = (int*)dwInstance;
-    if (uMsg != WOM_DONE)
-        return;
-
-    EnterCriticalSection(&waveCriticalSection);
-    (*freeBlockCounter)++;
-
-    LeaveCriticalSection(&waveCriticalSection);
-}
-
-void SoundGen_Initialize(WORD volume)
-{
-    if (m_SoundGenInitialized)
-        return;
-
-    DWORD totalBufferSize = (BLOCK_SIZE + sizeof(WAVEHDR)) * BLOCK_COUNT;
-
-    unsigned char* mbuffer = (unsigned char*)HeapAlloc(
-            GetProcessHeap(),
-            HEAP_ZERO_MEMORY,
-            totalBufferSize);
-    if (mbuffer == NULL)
+    m_hWaveOut = NULL;
+    m_hEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_pBlocks = (WAVEHDR*) ::calloc(BLOCK_COUNT, sizeof(WAVEHDR) + BLOCK_SIZE);
+    uint8_t* pData = (uint8_t*)(m_pBlocks + BLOCK_COUNT);
+    for (int i = 0; i < BLOCK_COUNT; i++)
     {
-        return;
+        m_pBlocks[i].lpData = (LPSTR)(pData + i * BLOCK_SIZE);
+        m_pBlocks[i].dwBufferLength = BLOCK_SIZE;
     }
+    m_nCurrentBlock = 0;
+}
 
-    waveBlocks = (WAVEHDR*)mbuffer;
-    mbuffer += sizeof(WAVEHDR) * BLOCK_COUNT;
-    for (int i = 0; i < BLOCK_COUNT; i++)
+CSoundWaveOutSink::~CSoundWaveOutSink()
+{
+    if (m_hWaveOut != NULL)
     {
-        waveBlocks[i].dwBufferLength = BLOCK_SIZE;
-        waveBlocks[i].lpData = (LPSTR)mbuffer;
-        mbuffer += BLOCK_SIZE;
+        waveOutReset(m_hWaveOut);
+        for (int i = 0; i < BLOCK_COUNT; i++)
+        {
+            if (m_pBlocks[i].dwFlags & WHDR_PREPARED)
+                waveOutUnprepareHeader(m_hWaveOut, &m_pBlocks[i], sizeof(WAVEHDR));
+        }
+        waveOutClose(m_hWaveOut);
     }
+    ::free(m_pBlocks);
+    ::CloseHandle(m_hEvent);
+}
 
-    waveFreeBlockCount = BLOCK_COUNT;
-    waveCurrentBlock   = 0;
-
+bool CSoundWaveOutSink::Open()
+{
+    WAVEFORMATEX wfx;
     wfx.nSamplesPerSec  = SOUNDSAMPLERATE;
     wfx.wBitsPerSample  = 16;
     wfx.nChannels       = 1;
@@ -87,46 +89,92 @@ void SoundGen_Initialize(WORD volume)
     wfx.nAvgBytesPerSec = wfx.nBlockAlign * wfx.nSamplesPerSec;
 
     MMRESULT result = waveOutOpen(
-            &hWaveOut, WAVE_MAPPER, &wfx, (DWORD_PTR)WaveCallback, (DWORD_PTR)&waveFreeBlockCount, CALLBACK_FUNCTION);
+            &m_hWaveOut, WAVE_MAPPER, &wfx, (DWORD_PTR)m_hEvent, 0, CALLBACK_EVENT);
     if (result != MMSYSERR_NOERROR)
     {
-        return;
+        m_hWaveOut = NULL;
+        return false;
     }
+    return true;
+}
 
-    waveOutSetVolume(hWaveOut, ((DWORD)volume << 16) | ((DWORD)volume));
+int CSoundWaveOutSink::WaitBlock(int timeoutms)
+{
+    WAVEHDR* current = &m_pBlocks[m_nCurrentBlock];
+    if ((current->dwFlags & WHDR_PREPARED) && !(current->dwFlags & WHDR_DONE))
+    {
+        ::WaitForSingleObject(m_hEvent, timeoutms);
+        if (!(current->dwFlags & WHDR_DONE))
+            return 0;
+    }
+    return BLOCK_SIZE / sizeof(int16_t);
+}
 
-    InitializeCriticalSection(&waveCriticalSection);
-    bufcurpos = 0;
+void CSoundWaveOutSink::WriteBlock(const int16_t* pSamples, int count)
+{
+    WAVEHDR* current = &m_pBlocks[m_nCurrentBlock];
 
-    m_SoundGenInitialized = true;
+    if (current->dwFlags & WHDR_PREPARED)
+        waveOutUnprepareHeader(m_hWaveOut, current, sizeof(WAVEHDR));
+
+    memcpy(current->lpData, pSamples, count * sizeof(int16_t));
+    current->dwBufferLength = count * sizeof(int16_t);
+
+    waveOutPrepareHeader(m_hWaveOut, current, sizeof(WAVEHDR));
+    waveOutWrite(m_hWaveOut, current, sizeof(WAVEHDR));
+
+    m_nCurrentBlock++;
+    if (m_nCurrentBlock >= BLOCK_COUNT)
+        m_nCurrentBlock = 0;
 }
 
-void SoundGen_Finalize()
+
+//////////////////////////////////////////////////////////////////////
+
+
+void SoundGen_Initialize(WORD volume)
 {
-    if (!m_SoundGenInitialized)
+    if (m_SoundGenInitialized)
         return;
 
-    while (waveFreeBlockCount < BLOCK_COUNT)
-        Sleep(1);
-
-    for (int i = 0; i < waveFreeBlockCount; i++)
+    CSoundWaveOutSink* pWaveOutSink = new CSoundWaveOutSink();
+    if (pWaveOutSink->Open())
+    {
+        hWaveOut = pWaveOutSink->m_hWaveOut;
+        waveOutSetVolume(hWaveOut, ((DWORD)volume << 16) | ((DWORD)volume));
+        m_pSoundSink = pWaveOutSink;
+    }
+    else  // No sound device, consume the samples anyway
     {
-        if (waveBlocks[i].dwFlags & WHDR_PREPARED)
-            waveOutUnprepareHeader(hWaveOut, &waveBlocks[i], sizeof(WAVEHDR));
+        delete pWaveOutSink;
+        m_pSoundSink = new CSoundFileSink(SOUNDSAMPLERATE, BLOCK_SIZE / sizeof(int16_t), nullptr);
     }
 
-    DeleteCriticalSection(&waveCriticalSection);
-    waveOutClose(hWaveOut);
+    m_pSoundRing = new CSoundRing(RING_SIZE);
+    m_pSoundPlayer = new CSoundPlayer(m_pSoundRing, m_pSoundSink);
 
-    HeapFree(GetProcessHeap(), 0, waveBlocks);
-    waveBlocks = NULL;
+    m_SoundGenInitialized = true;
+}
+
+void SoundGen_Finalize()
+{
+    if (!m_SoundGenInitialized)
+        return;
+
+    delete m_pSoundPlayer;  // Stops the audio thread
+    m_pSoundPlayer = nullptr;
+    delete m_pSoundSink;
+    m_pSoundSink = nullptr;
+    hWaveOut = NULL;
+    delete m_pSoundRing;
+    m_pSoundRing = nullptr;
 
     m_SoundGenInitialized = false;
 }
 
 void SoundGen_SetVolume(WORD volume)
 {
-    if (!m_SoundGenInitialized)
+    if (!m_SoundGenInitialized || hWaveOut == NULL)
         return;
 
     waveOutSetVolume(hWaveOut, ((DWORD)volume << 16) | ((DWORD)volume));
@@ -134,6 +182,9 @@ void SoundGen_SetVolume(WORD volume)
 
 void SoundGen_SetSpeed(WORD speedpercent)
 {
+    if (!m_SoundGenInitialized || hWaveOut == NULL)
+        return;
+
     DWORD dwRate = 0x00010000;
     if (speedpercent > 0 && speedpercent < 1000)
         dwRate = (((DWORD)speedpercent / 100) << 16) | ((speedpercent % 100) * 0x00010000 / 100);
@@ -141,40 +192,34 @@ void SoundGen_SetSpeed(WORD speedpercent)
     waveOutSetPlaybackRate(hWaveOut, dwRate);
 }
 
-void CALLBACK SoundGen_FeedDAC(WORD value)
+// Put samples to the ring; never waits, samples that do not fit are lost
+void SoundGen_FeedSamples(const int16_t* pSamples, int count)
 {
     if (!m_SoundGenInitialized)
         return;
 
-    memcpy(&buffer[bufcurpos], &value, 2);
-    bufcurpos += 2;
-
-    if (bufcurpos >= BUFSIZE)
-    {
-        WAVEHDR* current = &waveBlocks[waveCurrentBlock];
-
-        if (current->dwFlags & WHDR_PREPARED)
-            waveOutUnprepareHeader(hWaveOut, current, sizeof(WAVEHDR));
-
-        memcpy(current->lpData, buffer, BUFSIZE);
-        current->dwBufferLength = BLOCK_SIZE;
-
-        waveOutPrepareHeader(hWaveOut, current, sizeof(WAVEHDR));
-        waveOutWrite(hWaveOut, current, sizeof(WAVEHDR));
-
-        EnterCriticalSection(&waveCriticalSection);
-        waveFreeBlockCount--;
-        LeaveCriticalSection(&waveCriticalSection);
+    m_pSoundRing->Write(pSamples, count);
+}
 
-        while (!waveFreeBlockCount)
-            Sleep(1);
+int SoundGen_GetFillLevel()
+{
+    if (!m_SoundGenInitialized)
+        return 0;
+    return m_pSoundRing->GetFillLevel();
+}
 
-        waveCurrentBlock++;
-        if (waveCurrentBlock >= BLOCK_COUNT)
-            waveCurrentBlock = 0;
+uint32_t SoundGen_GetUnderrunCount()
+{
+    if (!m_SoundGenInitialized)
+        return 0;
+    return m_pSoundRing->GetUnderrunCount();
+}
 
-        bufcurpos = 0;
-    }
+uint32_t SoundGen_GetOverrunCount()
+{
+    if (!m_SoundGenInitialized)
+        return 0;
+    return m_pSoundRing->GetOverrunCount();
 }
 
 
@@ -16,14 +16,18 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 
 
 #define BUFSIZE     ((SOUNDSAMPLERATE / 25) * 2)
-#define BLOCK_COUNT 8
+#define BLOCK_COUNT 4
 #define BLOCK_SIZE  BUFSIZE
+#define RING_SIZE   (SOUNDSAMPLERATE / 25 * BLOCK_COUNT)  // Samples, rounded up to a power of two
 
 void SoundGen_Initialize(WORD volume);
 void SoundGen_Finalize();
 void SoundGen_SetVolume(WORD volume);
 void SoundGen_SetSpeed(WORD speedpercent);
-void CALLBACK SoundGen_FeedDAC(WORD value);
+void SoundGen_FeedSamples(const int16_t* pSamples, int count);
+int  SoundGen_GetFillLevel();  // Samples waiting in the ring
+uint32_t SoundGen_GetUnderrunCount();
+uint32_t SoundGen_GetOverrunCount();
 
 
 //////////////////////////////////////////////////////////////////////
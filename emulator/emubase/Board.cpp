@@ -17,6 +17,30 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 void TraceInstruction(CProcessor* pProc, CMotherboard* pBoard, uint16_t address, DWORD dwTrace);
 
 
+//////////////////////////////////////////////////////////////////////
+
+const uint64_t EVENT_NEVER = ~0ULL;
+
+const int FRAMETICK_CPU_TICKS = 15;  // 1 frame tick = 2 uS = 15 CPU ticks
+const int FRAME_CPU_TICKS = 20000 * FRAMETICK_CPU_TICKS;  // 1 frame = 40 ms
+const int CPU_TICKS_PER_SECOND = FRAME_CPU_TICKS * 25;  // 7.5 MHz
+const int SOUND_LEVEL = 0x1fff;  // Speaker signal step
+
+// Periods of the device events in CPU ticks; every device event happens at the end of a frame tick
+const int VBLANK_PERIOD = 10000 * FRAMETICK_CPU_TICKS;
+const int FLOPPY_PERIOD = 32 * FRAMETICK_CPU_TICKS;
+const int KEYBOARD_SKIP_FRAMETICKS = 20000 / (4950 / 25);  // Keyboard skips every 101st frame tick
+
+// Find the nearest time not less than the given one, for the event with the given period
+static uint64_t GetNextEventTime(uint64_t time, int period)
+{
+    if (time <= FRAMETICK_CPU_TICKS)
+        return FRAMETICK_CPU_TICKS;
+    uint64_t periods = (time - FRAMETICK_CPU_TICKS + period - 1) / period;
+    return FRAMETICK_CPU_TICKS + periods * period;
+}
+
+
 //////////////////////////////////////////////////////////////////////
 
 CMotherboard::CMotherboard ()
@@ -24,22 +48,33 @@ CMotherboard::CMotherboard ()
     // Create devices
     m_pCPU = new CProcessor(this);
     m_pTimer = new CTimer8253();
+    m_pSoundSynth = new CSoundSynth();
     m_pFloppyCtl = NULL;
     m_pKeyboard = new CKeyboard();
 
     m_CPUbps = nullptr;
     m_dwTrace = TRACE_NONE;
-    m_SoundGenCallback = nullptr;
-    m_SoundPrevValue = 0;
+    m_SlowAccessCount = 0;
+    m_SoundLevel = 0;
+    m_SoundChanges = 0;
+    m_SoundFrameStart = 0;
     m_SerialInCallback = NULL;
     m_SerialOutCallback = NULL;
     m_ParallelOutCallback = NULL;
     m_okTimer50OnOff = false;
     m_okSoundOnOff = false;
+    m_CPUTicks = 0;
+    m_FrameStart = 0;
+    m_keyboardTxCount = 0;
+    m_EventTime[EVENT_VBLANK] = GetNextEventTime(0, VBLANK_PERIOD);
+    m_EventTime[EVENT_FLOPPY] = m_FloppyNextTick = GetNextEventTime(0, FLOPPY_PERIOD);
+    m_EventTime[EVENT_KEYBOARD] = EVENT_NEVER;
 
     // Allocate memory for RAM and ROM
     m_pRAM = (uint8_t*) ::calloc(128 * 1024, 1);
     m_pROM = (uint8_t*) ::calloc(16 * 1024, 1);
+    ::memset(m_pMapRead, 0, sizeof(m_pMapRead));
+    ::memset(m_pMapWrite, 0, sizeof(m_pMapWrite));
 
     SetConfiguration(0);  // Default configuration
 
@@ -51,6 +86,7 @@ CMotherboard::~CMotherboard ()
     // Delete devices
     delete m_pCPU;
     delete m_pTimer;
+    delete m_pSoundSynth;
     if (m_pFloppyCtl != NULL)
         delete m_pFloppyCtl;
     delete m_pKeyboard;
@@ -67,6 +103,7 @@ void CMotherboard::SetConfiguration(uint16_t conf)
     // Clean RAM/ROM
     ::memset(m_pRAM, 0, 128 * 1024);
     ::memset(m_pROM, 0, 16 * 1024);
+    m_pCPU->FlushDecodeCache();
 
     //// Pre-fill RAM with "uninitialized" values
     //uint16_t * pMemory = (uint16_t *) m_pRAM;
@@ -108,7 +145,11 @@ void CMotherboard::Reset ()
     m_Port177442r = 0201;
     m_Port177600 = 0; //TODO
     m_Port177604 = 0; //TODO
+    UpdateSoundGate();
     //TODO
+    UpdateMemoryMap();
+
+    m_keyboardTxCount = 0;
 
     ResetDevices();
 
@@ -119,6 +160,7 @@ void CMotherboard::Reset ()
 void CMotherboard::LoadROM(const uint8_t* pBuffer)
 {
     ::memcpy(m_pROM, pBuffer, 16384);
+    m_pCPU->FlushDecodeCache();
 }
 
 void CMotherboard::LoadRAM(int startbank, const uint8_t* pBuffer, int length)
@@ -128,6 +170,7 @@ void CMotherboard::LoadRAM(int startbank, const uint8_t* pBuffer, int length)
     int address = 8192 * startbank;
     ASSERT(address + length <= 128 * 1024);
     ::memcpy(m_pRAM + address, pBuffer, length);
+    m_pCPU->FlushDecodeCache();
 }
 
 
@@ -157,12 +200,44 @@ bool CMotherboard::AttachFloppyImage(int slot, LPCTSTR sFileName)
     return m_pFloppyCtl->AttachImage(slot, sFileName);
 }
 
-void CMotherboard::DetachFloppyImage(int slot)
+bool CMotherboard::AttachFloppyOverlayImage(int slot, LPCTSTR sFileName, LPCTSTR sDeltaFileName)
 {
     ASSERT(slot >= 0 && slot < 4);
     if (m_pFloppyCtl == NULL)
-        return;
-    m_pFloppyCtl->DetachImage(slot);
+        return false;
+    return m_pFloppyCtl->AttachOverlayImage(slot, sFileName, sDeltaFileName);
+}
+
+bool CMotherboard::DetachFloppyImage(int slot)
+{
+    ASSERT(slot >= 0 && slot < 4);
+    if (m_pFloppyCtl == NULL)
+        return true;
+    return m_pFloppyCtl->DetachImage(slot);
+}
+
+bool CMotherboard::IsFloppyOverlay(int slot) const
+{
+    ASSERT(slot >= 0 && slot < 4);
+    if (m_pFloppyCtl == NULL)
+        return false;
+    return m_pFloppyCtl->IsOverlay(slot);
+}
+
+bool CMotherboard::CommitFloppyOverlay(int slot)
+{
+    ASSERT(slot >= 0 && slot < 4);
+    if (m_pFloppyCtl == NULL)
+        return false;
+    return m_pFloppyCtl->CommitOverlay(slot);
+}
+
+bool CMotherboard::DiscardFloppyOverlay(int slot)
+{
+    ASSERT(slot >= 0 && slot < 4);
+    if (m_pFloppyCtl == NULL)
+        return false;
+    return m_pFloppyCtl->DiscardOverlay(slot);
 }
 
 bool CMotherboard::IsFloppyEngineOn() const
@@ -170,6 +245,12 @@ bool CMotherboard::IsFloppyEngineOn() const
     return m_pFloppyCtl->IsEngineOn();
 }
 
+void CMotherboard::SetFloppyTurbo(bool okTurbo)
+{
+    if (m_pFloppyCtl != NULL)
+        m_pFloppyCtl->SetTurbo(okTurbo);
+}
+
 
 // Работа с памятью //////////////////////////////////////////////////
 
@@ -260,6 +341,7 @@ void CMotherboard::ResetDevices()
         m_pFloppyCtl->Reset();
 
     m_pKeyboard->Reset();
+    WakeKeyboard();
 
     // Reset ports
     //TODO
@@ -289,6 +371,62 @@ void CMotherboard::ExecuteCPU()
     m_pCPU->Execute();
 }
 
+bool CMotherboard::ExecuteCPUTicks(int ticks)
+{
+    bool okTrace = false;
+#if !defined(PRODUCT)
+    okTrace = (m_dwTrace & TRACE_CPU) != 0;
+#endif
+    if (m_CPUbps == nullptr && !okTrace)
+    {
+        m_CPUTicks += ticks;
+        m_pCPU->ExecuteCycles(ticks);  // Fast path: no need to stop between instructions
+        if (m_pCPU->IsDiverged())  // Lockstep check failed, stop as on breakpoint
+        {
+            m_CPUTicks -= m_pCPU->GetCyclesLeft();
+            m_pCPU->ClearDiverged();
+            return false;
+        }
+        return true;
+    }
+
+    while (ticks > 0)
+    {
+        // An event scheduled while the CPU was running: stop there, as ReduceCyclesLeft() does on the fast path
+        uint64_t eventTime = m_EventTime[GetNearestEvent()];
+        if (eventTime <= m_CPUTicks)
+            return true;
+        if (eventTime - m_CPUTicks < (uint64_t)ticks)
+            ticks = (int)(eventTime - m_CPUTicks);
+
+        int internalTick = m_pCPU->GetInternalTick();
+        int count = 1;  // Stop right after the next instruction start
+        if (internalTick > 0)
+            count = (internalTick < ticks) ? internalTick : ticks;
+#if !defined(PRODUCT)
+        else if (okTrace)
+            TraceInstruction(m_pCPU, this, m_pCPU->GetPC(), m_dwTrace);
+#endif
+        m_CPUTicks += count;
+        m_pCPU->ExecuteCycles(count);
+        ticks -= count;
+        if (m_pCPU->IsDiverged())  // Lockstep check failed, stop as on breakpoint
+        {
+            m_CPUTicks -= m_pCPU->GetCyclesLeft();
+            m_pCPU->ClearDiverged();
+            return false;
+        }
+
+        if (m_CPUbps != nullptr)  // Check for breakpoints
+        {
+            const uint16_t* pbps = m_CPUbps;
+            while (*pbps != 0177777) { if (m_pCPU->GetPC() == *pbps++) return false; }
+        }
+    }
+
+    return true;
+}
+
 /*
 Каждый фрейм равен 1/25 секунды = 40 мс
 Фрейм делим на 20000 тиков, 1 тик = 2 мкс
@@ -301,129 +439,218 @@ void CMotherboard::ExecuteCPU()
 */
 bool CMotherboard::SystemFrame()
 {
-    const int frameProcTicks = 15;
-    const int audioticks = 20286 / (SOUNDSAMPLERATE / 25);
     m_SoundChanges = 0;
-    const int floppyTicks = 32;
-    //const int serialOutTicks = 20000 / (9600 / 25);
-    //int serialTxCount = 0;
-    const int keyboardTicks = 20000 / (4950 / 25);
-    int keyboardTxCount = 0;
+    m_SoundFrameStart = m_CPUTicks;
+
+    // Keyboard ticks count from the frame start, and the transmitter countdown restarts every frame
+    m_FrameStart = m_CPUTicks;
+    m_keyboardTxCount = 0;
+    if (m_EventTime[EVENT_KEYBOARD] != EVENT_NEVER)
+        m_EventTime[EVENT_KEYBOARD] = GetNextKeyboardTime(m_CPUTicks);
 
-    for (int frameticks = 0; frameticks < 20000; frameticks++)
+    uint64_t frameEnd = m_CPUTicks + FRAME_CPU_TICKS;
+    for (;;)
     {
-        for (int procticks = 0; procticks < frameProcTicks; procticks++)  // CPU ticks
-        {
-#if !defined(PRODUCT)
-            if ((m_dwTrace & TRACE_CPU) && m_pCPU->GetInternalTick() == 0)
-                TraceInstruction(m_pCPU, this, m_pCPU->GetPC(), m_dwTrace);
-#endif
-            m_pCPU->Execute();
-            if (m_CPUbps != nullptr)  // Check for breakpoints
-            {
-                const uint16_t* pbps = m_CPUbps;
-                while (*pbps != 0177777) { if (m_pCPU->GetPC() == *pbps++) return false; }
-            }
-
-            if (procticks % 4 == 0)  // on procticks: 0, 4, 8, 12
-                m_pTimer->ClockTick();
-        }
+        int event = GetNearestEvent();
+        uint64_t time = m_EventTime[event];
 
-        if (frameticks == 0 || frameticks == 10000)
+        // Run CPU until the event; events at the end of the frame belong to this frame
+        uint64_t runTo = (time < frameEnd) ? time : frameEnd;
+        if (runTo > m_CPUTicks && !ExecuteCPUTicks((int)(runTo - m_CPUTicks)))
         {
-            Tick50();  // Vblank tick
+            EndSoundFrame();
+            return false;
         }
+        if (m_CPUTicks < runTo)
+            continue;  // Some event was scheduled earlier while the CPU was running
+        if (time > frameEnd)
+            break;
 
-        if (frameticks % floppyTicks == 0)  // FDD tick, every 64 uS
-        {
-            if (m_pFloppyCtl != NULL)
-                m_pFloppyCtl->Periodic();
-        }
+        ProcessEvent(event, time);
+    }
 
-        if (frameticks % audioticks == 0)  // AUDIO tick
-            DoSound();
+    EndSoundFrame();
 
-        if (frameticks % keyboardTicks)
-        {
-            m_pKeyboard->Periodic();
-            if ((m_Port177442r & 2) == 0 && m_pKeyboard->HasByteReady())
-            {
-                m_Port177440 = m_pKeyboard->ReceiveByte();
-
-                if (m_dwTrace & TRACE_KEYBOARD) DebugLogFormat(_T("Keyboard received %03o\r\n"), m_Port177440);
-
-                m_Port177442r |= 2;  // Установка флага "готовность приёмника"
-                m_pCPU->FireIRQ5();
-            }
-            if (keyboardTxCount > 0)
-            {
-                keyboardTxCount--;
-                if (keyboardTxCount == 0)
-                {
-                    m_pKeyboard->SendByte(m_Port177460 & 0xff);
-                    m_Port177442r |= 1;  // Установка флага "готовность передатчика"
-                }
-            }
-            else if ((m_Port177442r & 1) == 0)  // Ready is 0?
-            {
-                keyboardTxCount = 8;  // Start translation countdown
-            }
-        }
+    //if (m_SerialInCallback != NULL && frameticks % 52 == 0)
+    //{
+    //    uint8_t b;
+    //    if (m_SerialInCallback(&b))
+    //    {
+    //        if (m_Port176500 & 0200)  // Ready?
+    //            m_Port176500 |= 010000;  // Set Overflow flag
+    //        else
+    //        {
+    //            m_Port176502 = (uint16_t)b;
+    //            m_Port176500 |= 0200;  // Set Ready flag
+    //            if (m_Port176500 & 0100)  // Interrupt?
+    //                m_pCPU->InterruptVIRQ(7, 0300);
+    //        }
+    //    }
+    //}
+    //if (m_SerialOutCallback != NULL && frameticks % 52 == 0)
+    //{
+    //    if (serialTxCount > 0)
+    //    {
+    //        serialTxCount--;
+    //        if (serialTxCount == 0)  // Translation countdown finished - the byte translated
+    //        {
+    //            (*m_SerialOutCallback)((uint8_t)(m_Port176506 & 0xff));
+    //            m_Port176504 |= 0200;  // Set Ready flag
+    //            if (m_Port176504 & 0100)  // Interrupt?
+    //                m_pCPU->InterruptVIRQ(8, 0304);
+    //        }
+    //    }
+    //    else if ((m_Port176504 & 0200) == 0)  // Ready is 0?
+    //    {
+    //        serialTxCount = 8;  // Start translation countdown
+    //    }
+    //}
 
-        //if (m_SerialInCallback != NULL && frameticks % 52 == 0)
+    if (m_ParallelOutCallback != NULL)
+    {
+        //if ((m_Port177514 & 0240) == 040)
         //{
-        //    uint8_t b;
-        //    if (m_SerialInCallback(&b))
-        //    {
-        //        if (m_Port176500 & 0200)  // Ready?
-        //            m_Port176500 |= 010000;  // Set Overflow flag
-        //        else
-        //        {
-        //            m_Port176502 = (uint16_t)b;
-        //            m_Port176500 |= 0200;  // Set Ready flag
-        //            if (m_Port176500 & 0100)  // Interrupt?
-        //                m_pCPU->InterruptVIRQ(7, 0300);
-        //        }
-        //    }
+        //    m_Port177514 |= 0200;  // Set TR flag
+        //    // Now printer waits for a next byte
+        //    if (m_Port177514 & 0100)
+        //        m_pCPU->InterruptVIRQ(5, 0200);
         //}
-        //if (m_SerialOutCallback != NULL && frameticks % 52 == 0)
+        //else if ((m_Port177514 & 0240) == 0)
         //{
-        //    if (serialTxCount > 0)
-        //    {
-        //        serialTxCount--;
-        //        if (serialTxCount == 0)  // Translation countdown finished - the byte translated
-        //        {
-        //            (*m_SerialOutCallback)((uint8_t)(m_Port176506 & 0xff));
-        //            m_Port176504 |= 0200;  // Set Ready flag
-        //            if (m_Port176504 & 0100)  // Interrupt?
-        //                m_pCPU->InterruptVIRQ(8, 0304);
-        //        }
-        //    }
-        //    else if ((m_Port176504 & 0200) == 0)  // Ready is 0?
-        //    {
-        //        serialTxCount = 8;  // Start translation countdown
-        //    }
+        //    // Byte is ready, print it
+        //    (*m_ParallelOutCallback)((uint8_t)(m_Port177516 & 0xff));
+        //    m_Port177514 |= 040;  // Set Printer Acknowledge
         //}
+    }
+
+    return true;
+}
+
+// Linear search is fine for so few events; ties go in the enum order
+int CMotherboard::GetNearestEvent() const
+{
+    int event = 0;
+    for (int i = 1; i < EVENT_COUNT; i++)
+    {
+        if (m_EventTime[i] < m_EventTime[event])
+            event = i;
+    }
+    return event;
+}
 
-        if (m_ParallelOutCallback != NULL)
+void CMotherboard::ProcessEvent(int event, uint64_t time)
+{
+    switch (event)
+    {
+    case EVENT_VBLANK:
+        Tick50();
+        m_EventTime[EVENT_VBLANK] = time + VBLANK_PERIOD;
+        break;
+    case EVENT_FLOPPY:  // FDD tick, every 64 uS
+        m_FloppyNextTick = time + FLOPPY_PERIOD;
+        if (m_pFloppyCtl != NULL)
+            m_pFloppyCtl->Periodic();
+        m_EventTime[EVENT_FLOPPY] = (m_pFloppyCtl != NULL && m_pFloppyCtl->IsIdle()) ? EVENT_NEVER : m_FloppyNextTick;
+        break;
+    case EVENT_KEYBOARD:
+        DoKeyboard();
+        m_EventTime[EVENT_KEYBOARD] = IsKeyboardIdle() ? EVENT_NEVER : GetNextKeyboardTime(time + 1);
+        break;
+    }
+}
+
+// Timer clock ticks go after CPU ticks 0, 4, 8, 12 of every frame tick, 2 MHz
+void CMotherboard::SyncTimer(uint64_t time)
+{
+    uint64_t clock = time / FRAMETICK_CPU_TICKS * 4 + (time % FRAMETICK_CPU_TICKS + 3) / 4;
+    m_pTimer->Advance(clock);
+}
+
+uint64_t CMotherboard::GetCPUTicks() const
+{
+    return m_CPUTicks - m_pCPU->GetCyclesLeft();
+}
+
+void CMotherboard::ScheduleEvent(int event, uint64_t time)
+{
+    ASSERT(time >= GetCPUTicks());
+    m_EventTime[event] = time;
+
+    if (time < m_CPUTicks)  // CPU is running past the event, make it stop earlier
+    {
+        m_pCPU->ReduceCyclesLeft((int)(m_CPUTicks - time));
+        m_CPUTicks = time;
+    }
+}
+
+void CMotherboard::DoKeyboard()
+{
+    m_pKeyboard->Periodic();
+    if ((m_Port177442r & 2) == 0 && m_pKeyboard->HasByteReady())
+    {
+        m_Port177440 = m_pKeyboard->ReceiveByte();
+
+        if (m_dwTrace & TRACE_KEYBOARD) DebugLogFormat(_T("Keyboard received %03o\r\n"), m_Port177440);
+
+        m_Port177442r |= 2;  // Установка флага "готовность приёмника"
+        m_pCPU->FireIRQ5();
+    }
+    if (m_keyboardTxCount > 0)
+    {
+        m_keyboardTxCount--;
+        if (m_keyboardTxCount == 0)
         {
-            //if ((m_Port177514 & 0240) == 040)
-            //{
-            //    m_Port177514 |= 0200;  // Set TR flag
-            //    // Now printer waits for a next byte
-            //    if (m_Port177514 & 0100)
-            //        m_pCPU->InterruptVIRQ(5, 0200);
-            //}
-            //else if ((m_Port177514 & 0240) == 0)
-            //{
-            //    // Byte is ready, print it
-            //    (*m_ParallelOutCallback)((uint8_t)(m_Port177516 & 0xff));
-            //    m_Port177514 |= 040;  // Set Printer Acknowledge
-            //}
+            m_pKeyboard->SendByte(m_Port177460 & 0xff);
+            m_Port177442r |= 1;  // Установка флага "готовность передатчика"
         }
     }
+    else if ((m_Port177442r & 1) == 0)  // Ready is 0?
+    {
+        m_keyboardTxCount = 8;  // Start translation countdown
+    }
+}
 
-    return true;
+// Keyboard event does nothing until the keyboard gets a key or the CPU accesses the keyboard ports
+bool CMotherboard::IsKeyboardIdle() const
+{
+    return m_pKeyboard->IsIdle((m_Port177442r & 2) == 0) &&
+           m_keyboardTxCount == 0 && (m_Port177442r & 1) != 0;
+}
+
+void CMotherboard::WakeKeyboard()
+{
+    if (m_EventTime[EVENT_KEYBOARD] == EVENT_NEVER)
+        ScheduleEvent(EVENT_KEYBOARD, GetNextKeyboardTime(GetCPUTicks()));
+}
+
+// Keyboard ticks at the end of every frame tick except every 101st one, counting from the frame start;
+// find the nearest keyboard tick not earlier than the given time
+uint64_t CMotherboard::GetNextKeyboardTime(uint64_t time) const
+{
+    uint64_t frameticks = (time > m_FrameStart) ? (time - m_FrameStart + FRAMETICK_CPU_TICKS - 1) / FRAMETICK_CPU_TICKS : 1;
+    if ((frameticks - 1) % KEYBOARD_SKIP_FRAMETICKS == 0)
+        frameticks++;
+    return m_FrameStart + frameticks * FRAMETICK_CPU_TICKS;
+}
+
+// FDD event is not scheduled while the controller is idle; the skipped ticks only rotate the disks,
+// so they are counted at once when the CPU accesses the controller
+void CMotherboard::SyncFloppy()
+{
+    if (m_EventTime[EVENT_FLOPPY] != EVENT_NEVER)
+        return;
+    uint64_t time = GetCPUTicks();
+    if (time <= m_FloppyNextTick)  // Tick at the current time comes after the current instruction
+        return;
+    uint64_t count = (time - m_FloppyNextTick - 1) / FLOPPY_PERIOD + 1;
+    m_pFloppyCtl->SkipPeriods(count);
+    m_FloppyNextTick += count * FLOPPY_PERIOD;
+}
+
+void CMotherboard::WakeFloppy()
+{
+    if (m_EventTime[EVENT_FLOPPY] == EVENT_NEVER && !m_pFloppyCtl->IsIdle())
+        ScheduleEvent(EVENT_FLOPPY, m_FloppyNextTick);
 }
 
 // Key pressed or released
@@ -432,6 +659,7 @@ void CMotherboard::KeyboardEvent(uint8_t scancode, bool okPressed)
     if (okPressed)  // Key released
     {
         m_pKeyboard->KeyPressed(scancode);
+        WakeKeyboard();
 
         if (m_dwTrace & TRACE_KEYBOARD)
         {
@@ -477,8 +705,9 @@ uint16_t CMotherboard::GetWordView(uint16_t address, bool okExec, int* pAddrType
     return 0;
 }
 
-uint16_t CMotherboard::GetWord(uint16_t address, bool okExec)
+uint16_t CMotherboard::GetWordSlow(uint16_t address, bool okExec)
 {
+    m_SlowAccessCount++;
     uint16_t offset;
     int addrtype = TranslateAddress(address, okExec, &offset);
 
@@ -504,8 +733,9 @@ uint16_t CMotherboard::GetWord(uint16_t address, bool okExec)
     return 0;
 }
 
-uint8_t CMotherboard::GetByte(uint16_t address)
+uint8_t CMotherboard::GetByteSlow(uint16_t address)
 {
+    m_SlowAccessCount++;
     uint16_t offset;
     int addrtype = TranslateAddress(address, false, &offset);
 
@@ -531,8 +761,9 @@ uint8_t CMotherboard::GetByte(uint16_t address)
     return 0;
 }
 
-void CMotherboard::SetWord(uint16_t address, uint16_t word)
+void CMotherboard::SetWordSlow(uint16_t address, uint16_t word)
 {
+    m_SlowAccessCount++;
     uint16_t offset;
 
     int addrtype = TranslateAddress(address, false, &offset);
@@ -562,8 +793,9 @@ void CMotherboard::SetWord(uint16_t address, uint16_t word)
     ASSERT(false);  // If we are here - then addrtype has invalid value
 }
 
-void CMotherboard::SetByte(uint16_t address, uint8_t byte)
+void CMotherboard::SetByteSlow(uint16_t address, uint8_t byte)
 {
+    m_SlowAccessCount++;
     uint16_t offset;
     int addrtype = TranslateAddress(address, false, &offset);
 
@@ -642,6 +874,35 @@ int CMotherboard::TranslateAddress(uint16_t address, bool /*okExec*/, uint16_t*
     return isprimary ? ADDRTYPE_RAM : ADDRTYPE_HIRAM;
 }
 
+void CMotherboard::UpdateMemoryMap()
+{
+    for (int window = 0; window < 8; window++)
+    {
+        uint16_t address = (uint16_t)(window << 13);
+        uint16_t offset;
+        int addrtype = TranslateAddress(address, false, &offset);
+
+        uint8_t* p = nullptr;
+        uint32_t codeaddress = 0;  // Physical address for the CPU translated code: RAM, then ROM at 0400000
+        switch (addrtype & ADDRTYPE_MASK)
+        {
+        case ADDRTYPE_RAM:
+            p = m_pRAM + offset;  codeaddress = offset;  break;
+        case ADDRTYPE_HIRAM:
+            p = m_pRAM + 0160000 + offset;  codeaddress = 0160000 + offset;  break;
+        case ADDRTYPE_VRAM:
+            p = m_pRAM + 0340000 + offset;  codeaddress = 0340000 + offset;  break;
+        case ADDRTYPE_ROM:
+            p = m_pROM + offset;  codeaddress = 0400000 + offset;  break;
+        }
+
+        if (m_pMapRead[window] != p)  // The CPU keeps translated code of the old mapping, no need to flush it
+            m_pCPU->SetCodeWindow(window, codeaddress);
+        m_pMapRead[window] = p;
+        m_pMapWrite[window] = ((addrtype & ADDRTYPE_MASK) == ADDRTYPE_ROM) ? nullptr : p;
+    }
+}
+
 uint8_t CMotherboard::GetPortByte(uint16_t address)
 {
     if (address & 1)
@@ -666,6 +927,7 @@ uint16_t CMotherboard::GetPortWord(uint16_t address)
 
     case 0177440:  // Клавиатура: буфер данных приёмника, READ ONLY
         m_Port177442r &= ~2;  // Reset Ready flag
+        WakeKeyboard();
 //        if (m_dwTrace & TRACE_KEYBOARD) DebugLogFormat(_T("Keyboard 177440 read %06o\r\n"), m_Port177442r);
         return m_Port177440;
     case 0177442: // Клавиатура: регистр состояния порта, READ
@@ -678,18 +940,21 @@ uint16_t CMotherboard::GetPortWord(uint16_t address)
 
     case 0177500:  // Таймер
         {
+            SyncTimer(GetCPUTicks() - 1);  // Timer state before the current CPU tick
             uint8_t value = m_pTimer->Read(0);
             if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer 177500 read %02x\r\n"), value);
             return (uint16_t)value;
         }
     case 0177502:  // Таймер
         {
+            SyncTimer(GetCPUTicks() - 1);  // Timer state before the current CPU tick
             uint8_t value = m_pTimer->Read(1);
             if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer 177502 read %02x\r\n"), value);
             return (uint16_t)value;
         }
     case 0177504:  // Таймер
         {
+            SyncTimer(GetCPUTicks() - 1);  // Timer state before the current CPU tick
             uint8_t value = m_pTimer->Read(2);
             if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer 177504 read %02x\r\n"), value);
             return (uint16_t)value;
@@ -727,15 +992,19 @@ uint16_t CMotherboard::GetPortWord(uint16_t address)
 
     case 0177640:  // НГМД: регистр состояния
         if (m_pFloppyCtl == NULL) return 0;
+        SyncFloppy();
         return m_pFloppyCtl->GetStatus();
     case 0177642:  // НГМД: регистр дорожки
         if (m_pFloppyCtl == NULL) return 0;
+        SyncFloppy();
         return m_pFloppyCtl->GetTrack();
     case 0177644:  // НГМД: регистр сектора
         if (m_pFloppyCtl == NULL) return 0;
+        SyncFloppy();
         return m_pFloppyCtl->GetSector();
     case 0177646:  // НГМД: регистр данных
         if (m_pFloppyCtl == NULL) return 0;
+        SyncFloppy();
         return m_pFloppyCtl->GetData();
 
     case 0177700:  // Стык С2
@@ -806,6 +1075,7 @@ void CMotherboard::SetPortWord(uint16_t address, uint16_t word)
                 m_pCPU->FireIRQ2();
 
             m_Port177400 = word;
+            UpdateMemoryMap();
             return;
         }
 
@@ -822,6 +1092,7 @@ void CMotherboard::SetPortWord(uint16_t address, uint16_t word)
     case 0177460:
         m_Port177460 = word;
         m_Port177442r &= ~1;  // Reset Ready flag
+        WakeKeyboard();
         if (m_dwTrace & TRACE_KEYBOARD) DebugLogFormat(_T("Keyboard %06o -> 177460\r\n"), word);
         return; //STUB
 
@@ -835,18 +1106,22 @@ void CMotherboard::SetPortWord(uint16_t address, uint16_t word)
         return; //STUB
     case 0177520:  // Таймер канал 0 запись
         if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer %02x -> 177520 at %06o\r\n"), word, m_pCPU->GetInstructionPC());
+        SyncTimer(GetCPUTicks() - 1);
         m_pTimer->Write(0, (uint8_t)(word & 255));
         return;
     case 0177522:  // Таймер канал 1 запись
         if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer %02x -> 177522 at %06o\r\n"), word, m_pCPU->GetInstructionPC());
+        SyncTimer(GetCPUTicks() - 1);
         m_pTimer->Write(1, (uint8_t)(word & 255));
         return;
     case 0177524:  // Таймер канал 2 запись
         if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer %02x -> 177524 at %06o\r\n"), word, m_pCPU->GetInstructionPC());
+        SyncTimer(GetCPUTicks() - 1);
         m_pTimer->Write(2, (uint8_t)(word & 255));
         return;
     case 0177526:  // Таймер упр.слово запись
         if (m_dwTrace & TRACE_TIMER) DebugLogFormat(_T("Timer %02x -> 177526 at %06o\r\n"), word, m_pCPU->GetInstructionPC());
+        SyncTimer(GetCPUTicks() - 1);
         m_pTimer->WriteCommand((uint8_t)(word & 255));
         return;
 
@@ -857,13 +1132,19 @@ void CMotherboard::SetPortWord(uint16_t address, uint16_t word)
     case 0177600:  // Системный регистр A
         DebugLogFormat(_T("SysRegA %06o -> 177600\r\n"), word);
         m_Port177600 = word;
+        UpdateMemoryMap();
         if (m_pFloppyCtl != NULL)
+        {
+            SyncFloppy();
             m_pFloppyCtl->SetControl(word & 017);
+        }
         return;
     case 0177602:  // Системный регистр B
         return; //STUB
     case 0177604:  // Системный регистр C
+        SyncTimer(GetCPUTicks() - 1);  // Deliver timer edges that happened before the gate change
         m_Port177604 = word;
+        UpdateSoundGate();
         return;
     case 0177606:
         return; //STUB
@@ -871,22 +1152,38 @@ void CMotherboard::SetPortWord(uint16_t address, uint16_t word)
     case 0177640:  // НГМД: регистр команд
 //        if (m_dwTrace & TRACE_FLOPPY) DebugLogFormat(_T("Floppy %06o -> 177640\r\n"), word);
         if (m_pFloppyCtl != NULL)
+        {
+            SyncFloppy();
             m_pFloppyCtl->SetCommand(word & 0xff);
+            WakeFloppy();
+        }
         return;
     case 0177642:  // НГМД: регистр дорожки
         if (m_dwTrace & TRACE_FLOPPY) DebugLogFormat(_T("Floppy SET TRACK %d\r\n"), (int)word);
         if (m_pFloppyCtl != NULL)
+        {
+            SyncFloppy();
             m_pFloppyCtl->SetTrack(word & 0xff);
+            WakeFloppy();
+        }
         return;
     case 0177644:  // НГМД: регистр сектора
         if (m_dwTrace & TRACE_FLOPPY) DebugLogFormat(_T("Floppy SET SECTOR %d\r\n"), (int)word);
         if (m_pFloppyCtl != NULL)
+        {
+            SyncFloppy();
             m_pFloppyCtl->SetSector(word & 0xff);
+            WakeFloppy();
+        }
         return;
     case 0177646:  // НГМД: регистр данных
         if (m_dwTrace & TRACE_FLOPPY) DebugLogFormat(_T("Floppy SET DATA %02X\r\n"), word);
         if (m_pFloppyCtl != NULL)
+        {
+            SyncFloppy();
             m_pFloppyCtl->WriteData(word);
+            WakeFloppy();
+        }
         return; //STUB
 
     case 0177700:
@@ -957,6 +1254,7 @@ void CMotherboard::LoadFromImage(const uint8_t* pImage)
     m_Port177600 = *pwImage++;
     pwImage++;  // Reserved for port 177602
     m_Port177604 = *pwImage++;
+    UpdateSoundGate();
     pwImage += 8;  // RESERVED
     pwImage++;
     pwImage++;
@@ -973,40 +1271,68 @@ void CMotherboard::LoadFromImage(const uint8_t* pImage)
     // RAM
     const uint8_t* pImageRam = pImage + 20480;
     memcpy(m_pRAM, pImageRam, 128 * 1024);
+
+    UpdateMemoryMap();
+    m_pCPU->FlushDecodeCache();
+    WakeKeyboard();
 }
 
 
 //////////////////////////////////////////////////////////////////////
 
-void CMotherboard::DoSound(void)
+// Speaker signal is timer channel 2 output gated by bit 6 of the system register C
+void CMotherboard::UpdateSoundGate()
 {
-    int soundValue = 0;
-
-    int soundon = (m_Port177604 >> 6) & 1;  // Бит 6 системного регистра
-    if (soundon != 0)
-        soundValue = m_pTimer->GetOutput(2);
+    bool okSoundOn = (m_Port177604 & 0100) != 0;  // Бит 6 системного регистра
+    m_pTimer->SetOutputCallback(2, okSoundOn ? TimerOutputCallback : nullptr, this);
+    SetSoundLevel(okSoundOn ? m_pTimer->GetOutput(2) : 0, GetCPUTicks());
+}
 
-    if (m_SoundPrevValue == 0 && soundValue != 0)
+void CMotherboard::SetSoundLevel(int level, uint64_t time)
+{
+    if (level == m_SoundLevel)
+        return;
+    if (level != 0)
         m_SoundChanges++;
-    m_SoundPrevValue = soundValue;
+    m_SoundLevel = level;
 
-    if (m_SoundGenCallback != nullptr)
+    if (m_pSoundSynth->GetSampleRate() != 0)
     {
-        uint16_t sound = soundValue ? 0x1fff : 0;
-        (*m_SoundGenCallback)(sound);
+        uint32_t frametime = (time > m_SoundFrameStart) ? (uint32_t)(time - m_SoundFrameStart) : 0;
+        m_pSoundSynth->AddDelta(frametime, level ? SOUND_LEVEL : -SOUND_LEVEL);
     }
 }
 
-void CMotherboard::SetSoundGenCallback(SOUNDGENCALLBACK callback)
+void CMotherboard::TimerOutputCallback(void* param, int channel, uint64_t clock, bool output)
 {
-    if (callback == NULL)  // Reset callback
-    {
-        m_SoundGenCallback = NULL;
-    }
-    else
-    {
-        m_SoundGenCallback = callback;
-    }
+    CMotherboard* pBoard = (CMotherboard*)param;
+    if (channel != 2)
+        return;
+    // Timer clock ticks go after CPU ticks 0, 4, 8, 12 of every frame tick, see SyncTimer()
+    uint64_t time = (clock - 1) / 4 * FRAMETICK_CPU_TICKS + (clock - 1) % 4 * 4 + 1;
+    pBoard->SetSoundLevel(output ? 1 : 0, time);
+}
+
+// Collect the speaker edges up to now, and make the samples of the frame
+void CMotherboard::EndSoundFrame()
+{
+    // The edges are collected even with the sound off, so they never go to a later frame
+    if ((m_Port177604 & 0100) != 0)
+        SyncTimer(m_CPUTicks);
+    if (m_pSoundSynth->GetSampleRate() != 0)
+        m_pSoundSynth->EndFrame((uint32_t)(m_CPUTicks - m_SoundFrameStart));
+    m_SoundFrameStart = m_CPUTicks;
+}
+
+void CMotherboard::SetSoundSampleRate(int samplerate)
+{
+    m_pSoundSynth->SetRates(CPU_TICKS_PER_SECOND, samplerate, FRAME_CPU_TICKS);
+    m_SoundFrameStart = m_CPUTicks;
+}
+
+int CMotherboard::GetSoundSamples(int16_t* pBuffer, int count)
+{
+    return m_pSoundSynth->ReadSamples(pBuffer, count);
 }
 
 void CMotherboard::SetSerialCallbacks(SERIALINCALLBACK incallback, SERIALOUTCALLBACK outcallback)
@@ -49,9 +49,6 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 
 //////////////////////////////////////////////////////////////////////
 
-// Sound generator callback function type
-typedef void (CALLBACK* SOUNDGENCALLBACK)(uint16_t value);
-
 // Serial port callback for receiving
 // Output:
 //   pbyte      Byte received
@@ -74,6 +71,7 @@ typedef bool (CALLBACK* PARALLELOUTCALLBACK)(uint8_t byte);
 
 class CProcessor;
 class CTimer8253;
+class CSoundSynth;
 class CFloppyController;
 class CKeyboard;
 
@@ -84,6 +82,7 @@ class CMotherboard  // MS0515 computer
 private:  // Devices
     CProcessor* m_pCPU;  // CPU device
     CTimer8253* m_pTimer;
+    CSoundSynth* m_pSoundSynth;  // Speaker sound
     CFloppyController*  m_pFloppyCtl;  // FDD control
     CKeyboard*  m_pKeyboard;
     bool        m_okTimer50OnOff;
@@ -131,14 +130,20 @@ public:
     bool        SystemFrame();  // Do one frame -- use for normal run
     void        KeyboardEvent(uint8_t scancode, bool okPressed);  // Key pressed or released
     int         GetSoundChanges() const { return m_SoundChanges; }  ///< Sound signal 0 to 1 changes since the beginning of the frame
+    void        SetSoundSampleRate(int samplerate);  // Turn on sound synthesis at the given rate; 0 turns it off
+    int         GetSoundSamples(int16_t* pBuffer, int count);  // Read sound samples made by SystemFrame(); returns number of samples
 public:  // Floppy
     bool        AttachFloppyImage(int slot, LPCTSTR sFileName);
-    void        DetachFloppyImage(int slot);
+    bool        AttachFloppyOverlayImage(int slot, LPCTSTR sFileName, LPCTSTR sDeltaFileName);
+    bool        DetachFloppyImage(int slot);  // false if the changes were not saved in full
+    bool        IsFloppyOverlay(int slot) const;
+    bool        CommitFloppyOverlay(int slot);
+    bool        DiscardFloppyOverlay(int slot);
     bool        IsFloppyImageAttached(int slot) const;
     bool        IsFloppyReadOnly(int slot) const;
     bool        IsFloppyEngineOn() const;
+    void        SetFloppyTurbo(bool okTurbo);  // Turbo floppy: no delays, no waiting for the disk rotation
 public:  // Callbacks
-    void        SetSoundGenCallback(SOUNDGENCALLBACK callback);
     void        SetSerialCallbacks(SERIALINCALLBACK incallback, SERIALOUTCALLBACK outcallback);
     void        SetParallelOutCallback(PARALLELOUTCALLBACK outcallback);
 public:  // Memory
@@ -160,11 +165,20 @@ public:  // Memory
     uint16_t GetPortView(uint16_t address);
     // Get video buffer address
     const uint8_t* GetVideoBuffer() const;
+    // Count of memory accesses through TranslateAddress: I/O ports, ROM writes, denied access; for CPU lockstep check
+    uint32_t GetSlowAccessCount() const { return m_SlowAccessCount; }
 private:
     // Determine memory type for given address - see ADDRTYPE_Xxx constants
     //   okExec - TRUE: read instruction for execution; FALSE: read memory
     //   pOffset - result - offset in memory plane
     int TranslateAddress(uint16_t address, bool okExec, uint16_t* pOffset) const;
+    // Rebuild the memory map tables, called when 177400 or 177600 changed
+    void UpdateMemoryMap();
+    // Memory access through TranslateAddress: I/O ports, ROM writes, denied access
+    uint16_t GetWordSlow(uint16_t address, bool okExec);
+    void SetWordSlow(uint16_t address, uint16_t word);
+    uint8_t GetByteSlow(uint16_t address);
+    void SetByteSlow(uint16_t address, uint8_t byte);
 private:  // Access to I/O ports
     uint16_t    GetPortWord(uint16_t address);
     void        SetPortWord(uint16_t address, uint16_t word);
@@ -180,20 +194,83 @@ private:  // Ports: implementation
     uint16_t    m_Port177460;       // Клавиатура: буфер данных передатчика
     uint16_t    m_Port177600;       // Системный регистр A
     uint16_t    m_Port177604;       // Системный регистр C
+private:  // Memory map: host memory for every 8 KB window, nullptr means use TranslateAddress
+    uint8_t*    m_pMapRead[8];   // Read and execute
+    uint8_t*    m_pMapWrite[8];  // Write; nullptr for ROM
+    uint32_t    m_SlowAccessCount;  // See GetSlowAccessCount()
 private:
     const uint16_t* m_CPUbps;  // CPU breakpoint list, ends with 177777 value
     uint32_t    m_dwTrace;  // Trace flags
     bool        m_okSoundOnOff;
-    int         m_SoundPrevValue;  ///< Previous value of the sound signal
+    int         m_SoundLevel;  ///< Current value of the sound signal, follows timer channel 2 output edges
     int         m_SoundChanges;  ///< Sound signal 0 to 1 changes since the beginning of the frame
+    uint64_t    m_SoundFrameStart;  // CPU ticks at the start of the sound frame
 private:
-    SOUNDGENCALLBACK m_SoundGenCallback;
     SERIALINCALLBACK    m_SerialInCallback;
     SERIALOUTCALLBACK   m_SerialOutCallback;
     PARALLELOUTCALLBACK m_ParallelOutCallback;
+private:  // Device events, see SystemFrame()
+    enum  // Events with equal time are processed in this order
+    {
+        EVENT_VBLANK = 0,   // Vblank, 50 Hz
+        EVENT_FLOPPY,       // FDD controller tick, not scheduled while the controller is idle
+        EVENT_KEYBOARD,     // Keyboard serial line tick, not scheduled while the keyboard is idle
+        EVENT_COUNT
+    };
+    uint64_t    m_CPUTicks;  // CPU ticks since Reset; while CPU is running -- ticks at the end of the run
+    uint64_t    m_FrameStart;  // CPU ticks at the start of the current SystemFrame() call
+    uint64_t    m_EventTime[EVENT_COUNT];  // Time of the next event in CPU ticks, EVENT_NEVER if not scheduled
+    uint64_t    m_FloppyNextTick;  // Time of the next FDD tick, to catch up on skipped ticks while idle
+    int         m_keyboardTxCount;  // Keyboard transmitter countdown
 private:
-    void        DoSound();
+    uint64_t    GetCPUTicks() const;  // Current time in CPU ticks, counting the executing instruction
+    void        ScheduleEvent(int event, uint64_t time);
+    int         GetNearestEvent() const;
+    void        ProcessEvent(int event, uint64_t time);
+    void        SyncTimer(uint64_t time);  // Simulate the timer up to the given CPU tick
+    bool        ExecuteCPUTicks(int ticks);  // Run CPU for the given number of ticks; false means breakpoint hit
+    void        UpdateSoundGate();  // Subscribe to timer channel 2 output while the speaker is on
+    void        SetSoundLevel(int level, uint64_t time);
+    void        EndSoundFrame();
+    static void TimerOutputCallback(void* param, int channel, uint64_t clock, bool output);
+    void        DoKeyboard();
+    bool        IsKeyboardIdle() const;
+    uint64_t    GetNextKeyboardTime(uint64_t time) const;
+    void        WakeKeyboard();  // Schedule keyboard event after keyboard or port state change
+    void        SyncFloppy();  // Deliver FDD ticks skipped while the controller was idle, before port access
+    void        WakeFloppy();  // Schedule FDD event after the controller got a command
 };
 
+inline uint16_t CMotherboard::GetWord(uint16_t address, bool okExec)
+{
+    const uint8_t* p = m_pMapRead[address >> 13];
+    if (p != nullptr && address < 0177400)
+        return *((const uint16_t*)(p + (address & 017776)));
+    return GetWordSlow(address, okExec);
+}
+inline void CMotherboard::SetWord(uint16_t address, uint16_t word)
+{
+    uint8_t* p = m_pMapWrite[address >> 13];
+    if (p != nullptr && address < 0177400)
+        *((uint16_t*)(p + (address & 017776))) = word;
+    else
+        SetWordSlow(address, word);
+}
+inline uint8_t CMotherboard::GetByte(uint16_t address)
+{
+    const uint8_t* p = m_pMapRead[address >> 13];
+    if (p != nullptr && address < 0177400)
+        return p[address & 017777];
+    return GetByteSlow(address);
+}
+inline void CMotherboard::SetByte(uint16_t address, uint8_t byte)
+{
+    uint8_t* p = m_pMapWrite[address >> 13];
+    if (p != nullptr && address < 0177400)
+        p[address & 017777] = byte;
+    else
+        SetByteSlow(address, byte);
+}
+
 
 //////////////////////////////////////////////////////////////////////
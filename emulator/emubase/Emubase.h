@@ -52,28 +52,84 @@ int Disasm_GetInstructionHint(
 // CFloppy
 
 #define FLOPPY_RAWTRACKSIZE             6250    // Track length, bytes
-#define FLOPPY_RAWMARKERSIZE            FLOPPY_RAWTRACKSIZE
+#define FLOPPY_RAWMARKERSIZE            (FLOPPY_RAWTRACKSIZE / 8 + 1)  // Marker bitset length, bytes
 #define FLOPPY_INDEXLENGTH              150     // Index mark length
 #define FLOPPY_TRACKSIZE                5120    // Logical track size, 10 sectors, 512 bytes each sector
+#define FLOPPY_SECTORSIZE               512     // Logical sector size
+#define FLOPPY_SECTORCOUNT              10      // Sectors per track
+#define FLOPPY_SECTORMASK               01777   // Bitmask of all the sectors of a track
+#define FLOPPY_TRACKCACHESIZE           16      // Default number of raw tracks cached for every drive
+#define FLOPPY_TRACKCACHE_FULL          87      // Track cache size to keep all the tracks the head can reach
+
+// Floppy image file access, see FloppyImage.cpp
+// Read() is called from the emulation thread, Write() and Flush() from the floppy writer thread,
+// Sync() when the writer is done with the image
+class CFloppyImage
+{
+public:
+    // Memory-mapped image if possible, stdio file otherwise; NULL on error
+    static CFloppyImage* Open(LPCTSTR sFileName, bool okReadOnly = false);
+    // Read-only base image with the changes kept in the overlay: in memory if sDeltaFileName is NULL,
+    // or in the delta file, created if not exists; NULL on error
+    static CFloppyImage* OpenOverlay(LPCTSTR sFileName, LPCTSTR sDeltaFileName);
+    virtual ~CFloppyImage() {}
+    bool IsReadOnly() const { return m_okReadOnly; }
+    // Zeroes for the data past the end of file; false on read error, the data not read are zeroes then
+    virtual bool Read(long offset, uint8_t* pData, int size) = 0;
+    virtual bool Write(long offset, const uint8_t* pData, int size) = 0;  // false on write error
+    virtual bool Flush() { return true; }  // Make the written data visible for Read(); false on write error
+    virtual bool Sync() { return Flush(); }  // Save the written data to the disk; false on write error
+    virtual bool IsOverlay() const { return false; }
+    // Write the overlay sectors into the base image and clear the overlay; false on error, the overlay is kept then
+    virtual bool CommitOverlay() { return false; }
+    virtual bool DiscardOverlay() { return false; }  // Clear the overlay; false on error, the overlay is kept then
+protected:
+    bool m_okReadOnly;
+};
+
+struct CFloppyTrackCache  // Raw track in the drive track cache
+{
+    uint16_t track;         // Track number; 0xffff for unused entry
+    bool     dirty;         // Track was changed but not saved into the file yet
+    uint32_t lastuse;       // Last use stamp, for LRU replacement
+    uint8_t  data[FLOPPY_RAWTRACKSIZE];
+    uint8_t  marker[FLOPPY_RAWMARKERSIZE];  // Marker bitset
+    uint8_t  disk[FLOPPY_TRACKSIZE];  // Decoded track as it is in the file, to skip writing unchanged sectors
+};
 
 struct CFloppyDrive
 {
-    FILE* fpFile;
+    CFloppyImage* pImage;   // Attached image; NULL if not attached
     bool okReadOnly;        // Write protection flag
-    uint16_t dataptr;       // Data offset within m_data - "head" position
+    uint16_t dataptr;       // Data offset within m_data - "head" position, as of the rotation value
+    uint32_t rotation;      // CFloppyController::m_rotation value when dataptr was updated
     uint16_t datatrack;     // Track number of data in m_data array
-    uint8_t data[FLOPPY_RAWTRACKSIZE];  // Raw track image for the current track
-    uint8_t marker[FLOPPY_RAWMARKERSIZE];  // Marker positions
+    uint8_t* data;          // Raw track image for the current track, FLOPPY_RAWTRACKSIZE bytes
+    uint8_t* marker;        // Marker positions, one bit per raw byte, FLOPPY_RAWMARKERSIZE bytes
+    CFloppyTrackCache* cache;  // Encoded tracks of the image, allocated while the image is attached
+    int cachesize;          // Number of entries in the cache
+    uint32_t cacheclock;    // Counter for CFloppyTrackCache::lastuse
 
 public:
     CFloppyDrive();
     void Reset();
+    // data and marker buffers exist only while the drive is attached or selected
+    void AllocateBuffers();
+    void FreeBuffers();
 
 public:
     uint8_t  GetCurrentByte() { return data[dataptr]; }
     void     SetCurrentByte(uint8_t b) { data[dataptr] = b; }
+    bool     IsCurrentMarker() const { return (marker[dataptr >> 3] & (1 << (dataptr & 7))) != 0; }
+    void     SetCurrentMarker(bool okMarker)
+    {
+        if (okMarker) marker[dataptr >> 3] |= (uint8_t)(1 << (dataptr & 7));
+        else marker[dataptr >> 3] &= (uint8_t)~(1 << (dataptr & 7));
+    }
 };
 
+class CFloppyWriter;
+
 class CFloppyController
 {
 protected:
@@ -81,6 +137,7 @@ protected:
     int m_drive;            // Drive number: from 0 to 7; -1 if not selected
     CFloppyDrive* m_pDrive; // Current drive; NULL if not selected
     bool m_motoron;         // Motor ON flag
+    uint32_t m_rotation;    // Disk rotation counter, in bytes; drive positions are brought up to it when needed
     int  m_opercount;       // Operation counter - countdown of current operation stage
     int  m_tshift;
     int  m_state;
@@ -101,6 +158,10 @@ protected:
     int  m_startcrc;
     bool m_trackchanged;    // TRUE = data was changed - need to save it into the file
     bool m_okTrace;         // Trace mode on/off
+    bool m_okTurbo;         // Turbo mode: no delays, no waiting for the disk rotation
+    bool m_turbodrq;        // Turbo mode: DRQ was set out of Periodic() call
+    int  m_trackcachesize;  // Track cache size for the images being attached
+    CFloppyWriter* m_pWriter;  // Background writer for the image files; created on first writable image
 
 public:
     CFloppyController();
@@ -109,8 +170,12 @@ public:
 
 public:
     bool AttachImage(int drive, LPCTSTR sFileName);
-    void DetachImage(int drive);
-    bool IsAttached(int drive) { return (m_drivedata[drive].fpFile != NULL); }
+    bool AttachOverlayImage(int drive, LPCTSTR sFileName, LPCTSTR sDeltaFileName);  // See CFloppyImage::OpenOverlay()
+    bool DetachImage(int drive);  // false if the changes were not saved in full
+    bool IsOverlay(int drive) { return m_drivedata[drive].pImage != NULL && m_drivedata[drive].pImage->IsOverlay(); }
+    bool CommitOverlay(int drive);  // Save changes of overlay image into the base image
+    bool DiscardOverlay(int drive);  // Forget changes of overlay image
+    bool IsAttached(int drive) { return (m_drivedata[drive].pImage != NULL); }
     bool IsReadOnly(int drive) { return m_drivedata[drive].okReadOnly; } // return (m_status & FLOPPY_STATUS_WRITEPROTECT) != 0; }
     bool IsEngineOn() const { return m_motoron; }
     uint16_t GetStatus();           // Reading status
@@ -125,12 +190,27 @@ public:
     void SetSector(uint8_t sector) { m_sector = sector; }
     void WriteData(uint16_t data);
     void Periodic();                // Rotate disk; call it each 64 us - 15625 times per second
+    bool IsIdle() const;            // No command in progress, Periodic() calls may be replaced with SkipPeriods()
+    void SkipPeriods(uint64_t count);  // Same as the number of Periodic() calls while idle
     void SetTrace(bool okTrace) { m_okTrace = okTrace; }  // Set trace mode on/off
+    void SetTurbo(bool okTurbo) { m_okTurbo = okTurbo; }  // Set turbo mode on/off
+    bool IsTurbo() const { return m_okTurbo; }
+    void SetTrackCacheSize(int tracks) { m_trackcachesize = tracks; }  // Raw tracks to cache per drive, for images attached later
 
 private:
+    bool AttachImage(int drive, CFloppyImage* pImage);
+    bool SaveChanges(int drive);  // Put all the changes of the drive into the image; returns when it's done, false on error
+    void ProcessState();
+    bool IsWaitingForDisk() const;
+    void RotateDisk();  // Rotate the current drive by one byte
+    void SyncRotation(CFloppyDrive* pDrive);  // Bring the drive head position up to m_rotation
+    void ProcessTurboByte();
+    int  GetDelay(int periods) const { return m_okTurbo ? 1 : periods; }  // Operation delay, in Periodic() calls
     void ReadFirstByte();
     void PrepareTrack();
-    void FlushChanges();  // If current track was changed - save it
+    void FlushChanges();  // If current track was changed - put it to the track cache
+    CFloppyTrackCache* GetCachedTrack(CFloppyDrive* pDrive, uint16_t track, bool okLoad);
+    void WriteCachedTrack(CFloppyDrive* pDrive, CFloppyTrackCache* pEntry);  // Queue changed sectors of dirty track for writing
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -153,12 +233,47 @@ public:
     bool HasByteReady() const;  // Do we have a byte to receive from the keyboard
     uint8_t ReceiveByte();      // Receive byte from the keyboard
     void Periodic();            // Time tick; call it around 4900 times per second
+    bool IsIdle(bool okCanReceive) const;  // Nothing to do in Periodic() and nothing to receive
     void KeyPressed(uint8_t scan);  // Key press event
 
 private:
     void PutByteToQueue(uint8_t);
 };
 
+//////////////////////////////////////////////////////////////////////
+// CSoundSynth
+
+#define SOUNDSYNTH_PHASES   32  // Number of edge positions between two samples
+#define SOUNDSYNTH_WIDTH    16  // Band-limited step length, samples
+
+class CSoundSynth  // Band-limited synthesizer for signals made of steps
+{
+private:
+    int         m_nClockRate;   // Input clock ticks per second
+    int         m_nSampleRate;  // Output samples per second, 0 = not initialized
+    uint64_t    m_factor;       // Output samples per input clock tick, 32.32 fixed point
+    uint64_t    m_offset;       // Frame start position after the available samples, 32.32 fixed point
+    int32_t*    m_pBuffer;      // Deltas of the output signal
+    int         m_nBufferSize;  // Buffer size, samples
+    int         m_nAvail;       // Number of samples ready to read
+    int32_t     m_integrator;   // Output signal level, 17.15 fixed point
+    int32_t     m_dc;           // DC level for the high-pass filter, 24.8 fixed point
+    int16_t     m_kernel[SOUNDSYNTH_PHASES][SOUNDSYNTH_WIDTH];  // Band-limited impulse for every edge position
+public:
+    CSoundSynth();
+    ~CSoundSynth();
+    // Set the rates and the longest frame length in clock ticks; clears the buffer
+    void        SetRates(int clockrate, int samplerate, int frameclocks);
+    int         GetSampleRate() const { return m_nSampleRate; }
+    void        Clear();
+    void        AddDelta(uint32_t time, int delta);  // Signal step at the given clock tick of the frame
+    void        EndFrame(uint32_t time);  // Frame ends at the given clock tick, its samples are ready to read
+    int         GetSamplesAvail() const { return m_nAvail; }
+    int         ReadSamples(int16_t* pBuffer, int count);  // Read and remove up to count samples
+private:
+    void        RemoveSamples(int count);  // Remove samples from the buffer start
+};
+
 //////////////////////////////////////////////////////////////////////
 // CTimer8253
 
@@ -179,10 +294,20 @@ struct CTimerChannel
     int         phase;
 };
 
+// Timer output change callback
+//   param      The parameter given to SetOutputCallback()
+//   channel    Timer channel 0..2
+//   clock      Number of the clock tick when the output changed, see CTimer8253::GetClock()
+//   output     New output value
+typedef void (*TIMEROUTPUTCALLBACK)(void* param, int channel, uint64_t clock, bool output);
+
 class CTimer8253
 {
 private:
     CTimerChannel m_timers[3];
+    uint64_t    m_clock;  // Number of clock ticks simulated
+    TIMEROUTPUTCALLBACK m_OutputCallback[3];
+    void*       m_OutputCallbackParam[3];
 public:
     CTimer8253();
 public:
@@ -193,7 +318,12 @@ public:
     uint8_t     Read(int channel);
     void        Write(int channel, uint8_t value);
     void        Reset();
-    void        ClockTick();
+    uint64_t    GetClock() const { return m_clock; }
+    void        Advance(uint64_t clock);  // Simulate clock ticks up to the given clock tick number
+    void        SetOutputCallback(int channel, TIMEROUTPUTCALLBACK callback, void* param);
+private:
+    void        AdvanceChannel(int channel, uint64_t clocks);
+    void        FireOutputCallback(int channel, uint64_t clock);
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -15,6 +15,10 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 #include "stdafx.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include "Emubase.h"
 
 
@@ -57,19 +61,406 @@ enum eRequest { R_NONE, R_DRQ = 0x40, R_INTRQ = 0x80 };
 const int MAX_PHYS_CYL = 86;    // don't seek over it
 
 static void EncodeTrackData(const uint8_t* pSrc, uint8_t* data, uint8_t* marker, uint16_t track, uint16_t side);
-static bool DecodeTrackData(const uint8_t* pRaw, uint8_t* pDest);
+static uint16_t DecodeTrackData(const uint8_t* pRaw, const uint8_t* pMarker, uint8_t* pDest);
+
+//////////////////////////////////////////////////////////////////////
+// CRC-16/CCITT: polynomial 0x1021, initial value 0xffff; ID and data fields are covered from the marker
+// byte, and the initial value includes three 0xa1 sync bytes before the marker
+
+const uint16_t CRC_PRESET = 0xcdb4;  // CRC of A1 A1 A1
+
+static const uint16_t CrcTable[256] =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static inline uint16_t UpdateCrc(uint16_t crc, uint8_t value)
+{
+    return (uint16_t)((crc << 8) ^ CrcTable[(crc >> 8) ^ value]);
+}
+
+// Tables for four bytes per step: CrcTableN[v] is the CRC of byte v followed by N zero bytes
+static const uint16_t CrcTable1[256] =
+{
+    0x0000, 0x3331, 0x6662, 0x5553, 0xccc4, 0xfff5, 0xaaa6, 0x9997,
+    0x89a9, 0xba98, 0xefcb, 0xdcfa, 0x456d, 0x765c, 0x230f, 0x103e,
+    0x0373, 0x3042, 0x6511, 0x5620, 0xcfb7, 0xfc86, 0xa9d5, 0x9ae4,
+    0x8ada, 0xb9eb, 0xecb8, 0xdf89, 0x461e, 0x752f, 0x207c, 0x134d,
+    0x06e6, 0x35d7, 0x6084, 0x53b5, 0xca22, 0xf913, 0xac40, 0x9f71,
+    0x8f4f, 0xbc7e, 0xe92d, 0xda1c, 0x438b, 0x70ba, 0x25e9, 0x16d8,
+    0x0595, 0x36a4, 0x63f7, 0x50c6, 0xc951, 0xfa60, 0xaf33, 0x9c02,
+    0x8c3c, 0xbf0d, 0xea5e, 0xd96f, 0x40f8, 0x73c9, 0x269a, 0x15ab,
+    0x0dcc, 0x3efd, 0x6bae, 0x589f, 0xc108, 0xf239, 0xa76a, 0x945b,
+    0x8465, 0xb754, 0xe207, 0xd136, 0x48a1, 0x7b90, 0x2ec3, 0x1df2,
+    0x0ebf, 0x3d8e, 0x68dd, 0x5bec, 0xc27b, 0xf14a, 0xa419, 0x9728,
+    0x8716, 0xb427, 0xe174, 0xd245, 0x4bd2, 0x78e3, 0x2db0, 0x1e81,
+    0x0b2a, 0x381b, 0x6d48, 0x5e79, 0xc7ee, 0xf4df, 0xa18c, 0x92bd,
+    0x8283, 0xb1b2, 0xe4e1, 0xd7d0, 0x4e47, 0x7d76, 0x2825, 0x1b14,
+    0x0859, 0x3b68, 0x6e3b, 0x5d0a, 0xc49d, 0xf7ac, 0xa2ff, 0x91ce,
+    0x81f0, 0xb2c1, 0xe792, 0xd4a3, 0x4d34, 0x7e05, 0x2b56, 0x1867,
+    0x1b98, 0x28a9, 0x7dfa, 0x4ecb, 0xd75c, 0xe46d, 0xb13e, 0x820f,
+    0x9231, 0xa100, 0xf453, 0xc762, 0x5ef5, 0x6dc4, 0x3897, 0x0ba6,
+    0x18eb, 0x2bda, 0x7e89, 0x4db8, 0xd42f, 0xe71e, 0xb24d, 0x817c,
+    0x9142, 0xa273, 0xf720, 0xc411, 0x5d86, 0x6eb7, 0x3be4, 0x08d5,
+    0x1d7e, 0x2e4f, 0x7b1c, 0x482d, 0xd1ba, 0xe28b, 0xb7d8, 0x84e9,
+    0x94d7, 0xa7e6, 0xf2b5, 0xc184, 0x5813, 0x6b22, 0x3e71, 0x0d40,
+    0x1e0d, 0x2d3c, 0x786f, 0x4b5e, 0xd2c9, 0xe1f8, 0xb4ab, 0x879a,
+    0x97a4, 0xa495, 0xf1c6, 0xc2f7, 0x5b60, 0x6851, 0x3d02, 0x0e33,
+    0x1654, 0x2565, 0x7036, 0x4307, 0xda90, 0xe9a1, 0xbcf2, 0x8fc3,
+    0x9ffd, 0xaccc, 0xf99f, 0xcaae, 0x5339, 0x6008, 0x355b, 0x066a,
+    0x1527, 0x2616, 0x7345, 0x4074, 0xd9e3, 0xead2, 0xbf81, 0x8cb0,
+    0x9c8e, 0xafbf, 0xfaec, 0xc9dd, 0x504a, 0x637b, 0x3628, 0x0519,
+    0x10b2, 0x2383, 0x76d0, 0x45e1, 0xdc76, 0xef47, 0xba14, 0x8925,
+    0x991b, 0xaa2a, 0xff79, 0xcc48, 0x55df, 0x66ee, 0x33bd, 0x008c,
+    0x13c1, 0x20f0, 0x75a3, 0x4692, 0xdf05, 0xec34, 0xb967, 0x8a56,
+    0x9a68, 0xa959, 0xfc0a, 0xcf3b, 0x56ac, 0x659d, 0x30ce, 0x03ff,
+};
+
+static const uint16_t CrcTable2[256] =
+{
+    0x0000, 0x3730, 0x6e60, 0x5950, 0xdcc0, 0xebf0, 0xb2a0, 0x8590,
+    0xa9a1, 0x9e91, 0xc7c1, 0xf0f1, 0x7561, 0x4251, 0x1b01, 0x2c31,
+    0x4363, 0x7453, 0x2d03, 0x1a33, 0x9fa3, 0xa893, 0xf1c3, 0xc6f3,
+    0xeac2, 0xddf2, 0x84a2, 0xb392, 0x3602, 0x0132, 0x5862, 0x6f52,
+    0x86c6, 0xb1f6, 0xe8a6, 0xdf96, 0x5a06, 0x6d36, 0x3466, 0x0356,
+    0x2f67, 0x1857, 0x4107, 0x7637, 0xf3a7, 0xc497, 0x9dc7, 0xaaf7,
+    0xc5a5, 0xf295, 0xabc5, 0x9cf5, 0x1965, 0x2e55, 0x7705, 0x4035,
+    0x6c04, 0x5b34, 0x0264, 0x3554, 0xb0c4, 0x87f4, 0xdea4, 0xe994,
+    0x1dad, 0x2a9d, 0x73cd, 0x44fd, 0xc16d, 0xf65d, 0xaf0d, 0x983d,
+    0xb40c, 0x833c, 0xda6c, 0xed5c, 0x68cc, 0x5ffc, 0x06ac, 0x319c,
+    0x5ece, 0x69fe, 0x30ae, 0x079e, 0x820e, 0xb53e, 0xec6e, 0xdb5e,
+    0xf76f, 0xc05f, 0x990f, 0xae3f, 0x2baf, 0x1c9f, 0x45cf, 0x72ff,
+    0x9b6b, 0xac5b, 0xf50b, 0xc23b, 0x47ab, 0x709b, 0x29cb, 0x1efb,
+    0x32ca, 0x05fa, 0x5caa, 0x6b9a, 0xee0a, 0xd93a, 0x806a, 0xb75a,
+    0xd808, 0xef38, 0xb668, 0x8158, 0x04c8, 0x33f8, 0x6aa8, 0x5d98,
+    0x71a9, 0x4699, 0x1fc9, 0x28f9, 0xad69, 0x9a59, 0xc309, 0xf439,
+    0x3b5a, 0x0c6a, 0x553a, 0x620a, 0xe79a, 0xd0aa, 0x89fa, 0xbeca,
+    0x92fb, 0xa5cb, 0xfc9b, 0xcbab, 0x4e3b, 0x790b, 0x205b, 0x176b,
+    0x7839, 0x4f09, 0x1659, 0x2169, 0xa4f9, 0x93c9, 0xca99, 0xfda9,
+    0xd198, 0xe6a8, 0xbff8, 0x88c8, 0x0d58, 0x3a68, 0x6338, 0x5408,
+    0xbd9c, 0x8aac, 0xd3fc, 0xe4cc, 0x615c, 0x566c, 0x0f3c, 0x380c,
+    0x143d, 0x230d, 0x7a5d, 0x4d6d, 0xc8fd, 0xffcd, 0xa69d, 0x91ad,
+    0xfeff, 0xc9cf, 0x909f, 0xa7af, 0x223f, 0x150f, 0x4c5f, 0x7b6f,
+    0x575e, 0x606e, 0x393e, 0x0e0e, 0x8b9e, 0xbcae, 0xe5fe, 0xd2ce,
+    0x26f7, 0x11c7, 0x4897, 0x7fa7, 0xfa37, 0xcd07, 0x9457, 0xa367,
+    0x8f56, 0xb866, 0xe136, 0xd606, 0x5396, 0x64a6, 0x3df6, 0x0ac6,
+    0x6594, 0x52a4, 0x0bf4, 0x3cc4, 0xb954, 0x8e64, 0xd734, 0xe004,
+    0xcc35, 0xfb05, 0xa255, 0x9565, 0x10f5, 0x27c5, 0x7e95, 0x49a5,
+    0xa031, 0x9701, 0xce51, 0xf961, 0x7cf1, 0x4bc1, 0x1291, 0x25a1,
+    0x0990, 0x3ea0, 0x67f0, 0x50c0, 0xd550, 0xe260, 0xbb30, 0x8c00,
+    0xe352, 0xd462, 0x8d32, 0xba02, 0x3f92, 0x08a2, 0x51f2, 0x66c2,
+    0x4af3, 0x7dc3, 0x2493, 0x13a3, 0x9633, 0xa103, 0xf853, 0xcf63,
+};
+
+static const uint16_t CrcTable3[256] =
+{
+    0x0000, 0x76b4, 0xed68, 0x9bdc, 0xcaf1, 0xbc45, 0x2799, 0x512d,
+    0x85c3, 0xf377, 0x68ab, 0x1e1f, 0x4f32, 0x3986, 0xa25a, 0xd4ee,
+    0x1ba7, 0x6d13, 0xf6cf, 0x807b, 0xd156, 0xa7e2, 0x3c3e, 0x4a8a,
+    0x9e64, 0xe8d0, 0x730c, 0x05b8, 0x5495, 0x2221, 0xb9fd, 0xcf49,
+    0x374e, 0x41fa, 0xda26, 0xac92, 0xfdbf, 0x8b0b, 0x10d7, 0x6663,
+    0xb28d, 0xc439, 0x5fe5, 0x2951, 0x787c, 0x0ec8, 0x9514, 0xe3a0,
+    0x2ce9, 0x5a5d, 0xc181, 0xb735, 0xe618, 0x90ac, 0x0b70, 0x7dc4,
+    0xa92a, 0xdf9e, 0x4442, 0x32f6, 0x63db, 0x156f, 0x8eb3, 0xf807,
+    0x6e9c, 0x1828, 0x83f4, 0xf540, 0xa46d, 0xd2d9, 0x4905, 0x3fb1,
+    0xeb5f, 0x9deb, 0x0637, 0x7083, 0x21ae, 0x571a, 0xccc6, 0xba72,
+    0x753b, 0x038f, 0x9853, 0xeee7, 0xbfca, 0xc97e, 0x52a2, 0x2416,
+    0xf0f8, 0x864c, 0x1d90, 0x6b24, 0x3a09, 0x4cbd, 0xd761, 0xa1d5,
+    0x59d2, 0x2f66, 0xb4ba, 0xc20e, 0x9323, 0xe597, 0x7e4b, 0x08ff,
+    0xdc11, 0xaaa5, 0x3179, 0x47cd, 0x16e0, 0x6054, 0xfb88, 0x8d3c,
+    0x4275, 0x34c1, 0xaf1d, 0xd9a9, 0x8884, 0xfe30, 0x65ec, 0x1358,
+    0xc7b6, 0xb102, 0x2ade, 0x5c6a, 0x0d47, 0x7bf3, 0xe02f, 0x969b,
+    0xdd38, 0xab8c, 0x3050, 0x46e4, 0x17c9, 0x617d, 0xfaa1, 0x8c15,
+    0x58fb, 0x2e4f, 0xb593, 0xc327, 0x920a, 0xe4be, 0x7f62, 0x09d6,
+    0xc69f, 0xb02b, 0x2bf7, 0x5d43, 0x0c6e, 0x7ada, 0xe106, 0x97b2,
+    0x435c, 0x35e8, 0xae34, 0xd880, 0x89ad, 0xff19, 0x64c5, 0x1271,
+    0xea76, 0x9cc2, 0x071e, 0x71aa, 0x2087, 0x5633, 0xcdef, 0xbb5b,
+    0x6fb5, 0x1901, 0x82dd, 0xf469, 0xa544, 0xd3f0, 0x482c, 0x3e98,
+    0xf1d1, 0x8765, 0x1cb9, 0x6a0d, 0x3b20, 0x4d94, 0xd648, 0xa0fc,
+    0x7412, 0x02a6, 0x997a, 0xefce, 0xbee3, 0xc857, 0x538b, 0x253f,
+    0xb3a4, 0xc510, 0x5ecc, 0x2878, 0x7955, 0x0fe1, 0x943d, 0xe289,
+    0x3667, 0x40d3, 0xdb0f, 0xadbb, 0xfc96, 0x8a22, 0x11fe, 0x674a,
+    0xa803, 0xdeb7, 0x456b, 0x33df, 0x62f2, 0x1446, 0x8f9a, 0xf92e,
+    0x2dc0, 0x5b74, 0xc0a8, 0xb61c, 0xe731, 0x9185, 0x0a59, 0x7ced,
+    0x84ea, 0xf25e, 0x6982, 0x1f36, 0x4e1b, 0x38af, 0xa373, 0xd5c7,
+    0x0129, 0x779d, 0xec41, 0x9af5, 0xcbd8, 0xbd6c, 0x26b0, 0x5004,
+    0x9f4d, 0xe9f9, 0x7225, 0x0491, 0x55bc, 0x2308, 0xb8d4, 0xce60,
+    0x1a8e, 0x6c3a, 0xf7e6, 0x8152, 0xd07f, 0xa6cb, 0x3d17, 0x4ba3,
+};
+
+static uint16_t CalculateCrc(uint16_t crc, const uint8_t* buffer, int length)
+{
+    while (length >= 4)
+    {
+        crc = (uint16_t)(CrcTable3[(crc >> 8) ^ buffer[0]] ^ CrcTable2[(crc & 0xff) ^ buffer[1]] ^
+                CrcTable1[buffer[2]] ^ CrcTable[buffer[3]]);
+        buffer += 4;  length -= 4;
+    }
+    while (length-- > 0)
+        crc = UpdateCrc(crc, *buffer++);
+    return crc;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+
+// Background writer for the floppy image files.
+// The emulation thread queues changed sectors; the writer thread saves them,
+// merging repeated writes to the same track while they wait in the queue.
+class CFloppyWriter
+{
+public:
+    CFloppyWriter();
+    ~CFloppyWriter();
+    void AttachImage(int drive, CFloppyImage* pImage);
+    // Wait for the queued writes, save the image to the disk, then forget it; false on write error
+    bool DetachImage(int drive);
+    // Wait until all the queued writes for the drive are saved; false if any write failed since the last call
+    bool WaitImage(int drive);
+    void QueueTrack(int drive, uint16_t track, uint16_t sectors, const uint8_t* pData);  // sectors = bitmap of changed sectors
+    // Read the track from the image, with queued but not yet saved sectors over it; false on read error
+    bool ReadTrack(int drive, uint16_t track, CFloppyImage* pImage, uint8_t* pData);
+
+private:
+    struct WriteRequest
+    {
+        uint16_t sectors;  // Bitmap of sectors to write
+        uint8_t data[FLOPPY_TRACKSIZE];
+    };
+    typedef std::map<uint32_t, WriteRequest> RequestMap;  // Key is drive and track, see MakeKey()
+
+    static uint32_t MakeKey(int drive, uint16_t track) { return ((uint32_t)drive << 16) | track; }
+    static void CopySectors(uint16_t sectors, const uint8_t* pSrc, uint8_t* pDest);
+    bool HasRequests(int drive) const;
+    void ThreadProc();
+    uint8_t WriteRequests();  // Returns bitmap of the drives with write errors
+
+private:
+    CFloppyImage* m_images[8];
+    uint8_t m_failed;       // Bitmap of the drives with write errors, see WaitImage()
+    RequestMap m_pending;   // Requests waiting for the writer thread
+    RequestMap m_writing;   // Requests being saved by the writer thread now
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;  // New requests or stop flag for the writer thread
+    std::condition_variable m_done;    // The writer thread finished saving m_writing
+    bool m_stop;
+    std::thread m_thread;
+};
+
+CFloppyWriter::CFloppyWriter()
+{
+    for (int drive = 0; drive < 8; drive++)
+        m_images[drive] = nullptr;
+    m_failed = 0;
+    m_stop = false;
+    m_thread = std::thread(&CFloppyWriter::ThreadProc, this);
+}
+
+CFloppyWriter::~CFloppyWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_one();
+    m_thread.join();  // The thread saves all the pending requests before exit
+}
+
+void CFloppyWriter::AttachImage(int drive, CFloppyImage* pImage)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_images[drive] = pImage;
+}
+
+bool CFloppyWriter::DetachImage(int drive)
+{
+    bool result = WaitImage(drive);
+
+    CFloppyImage* pImage;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pImage = m_images[drive];
+        m_images[drive] = nullptr;
+    }
+    if (pImage != nullptr && !pImage->Sync())  // The writer thread does not use the image anymore
+        result = false;
+    return result;
+}
+
+bool CFloppyWriter::WaitImage(int drive)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (HasRequests(drive))
+        m_done.wait(lock);
+
+    bool result = (m_failed & (1 << drive)) == 0;
+    m_failed &= ~(1 << drive);
+    return result;
+}
+
+void CFloppyWriter::QueueTrack(int drive, uint16_t track, uint16_t sectors, const uint8_t* pData)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint32_t key = MakeKey(drive, track);
+        RequestMap::iterator it = m_pending.find(key);
+        if (it == m_pending.end())
+        {
+            it = m_pending.insert(RequestMap::value_type(key, WriteRequest())).first;
+            it->second.sectors = 0;
+        }
+        it->second.sectors |= sectors;
+        CopySectors(sectors, pData, it->second.data);
+    }
+    m_wakeup.notify_one();
+}
+
+// The lock is held while reading, so the writer thread can't finish the requests in between:
+// the sectors it is writing now come from m_writing, not from the half-written file
+bool CFloppyWriter::ReadTrack(int drive, uint16_t track, CFloppyImage* pImage, uint8_t* pData)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool result = pImage->Read((long)track * FLOPPY_TRACKSIZE, pData, FLOPPY_TRACKSIZE);
+
+    uint32_t key = MakeKey(drive, track);
+    RequestMap::const_iterator it = m_writing.find(key);
+    if (it != m_writing.end())
+        CopySectors(it->second.sectors, it->second.data, pData);
+    it = m_pending.find(key);  // Pending requests are newer than the ones being written
+    if (it != m_pending.end())
+        CopySectors(it->second.sectors, it->second.data, pData);
+    return result;
+}
+
+void CFloppyWriter::CopySectors(uint16_t sectors, const uint8_t* pSrc, uint8_t* pDest)
+{
+    for (int sector = 0; sector < FLOPPY_SECTORCOUNT; sector++)
+    {
+        if (sectors & (1 << sector))
+            memcpy(pDest + sector * FLOPPY_SECTORSIZE, pSrc + sector * FLOPPY_SECTORSIZE, FLOPPY_SECTORSIZE);
+    }
+}
+
+bool CFloppyWriter::HasRequests(int drive) const
+{
+    uint32_t keyfirst = MakeKey(drive, 0);
+    uint32_t keylast = MakeKey(drive + 1, 0);
+    RequestMap::const_iterator it = m_pending.lower_bound(keyfirst);
+    if (it != m_pending.end() && it->first < keylast)
+        return true;
+    it = m_writing.lower_bound(keyfirst);
+    return (it != m_writing.end() && it->first < keylast);
+}
+
+void CFloppyWriter::ThreadProc()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        while (!m_stop && m_pending.empty())
+            m_wakeup.wait(lock);
+        if (m_pending.empty())
+            break;  // Stop requested and nothing left to save
+
+        // Take all the pending requests; m_writing is not changed until the lock is taken again
+        m_writing.swap(m_pending);
+        lock.unlock();
+        uint8_t failed = WriteRequests();
+        lock.lock();
+
+        m_failed |= failed;
+        m_writing.clear();
+        m_done.notify_all();
+    }
+}
+
+// Save m_writing requests into the files, every run of adjacent changed sectors with one write call
+uint8_t CFloppyWriter::WriteRequests()
+{
+    uint8_t failed = 0;
+    bool flush[8] = { false };
+    for (RequestMap::const_iterator it = m_writing.begin(); it != m_writing.end(); ++it)
+    {
+        int drive = (int)(it->first >> 16);
+        uint16_t track = (uint16_t)(it->first & 0xffff);
+        CFloppyImage* pImage = m_images[drive];
+        if (pImage == nullptr)
+            continue;
+
+        const WriteRequest& request = it->second;
+        int sector = 0;
+        while (sector < FLOPPY_SECTORCOUNT)
+        {
+            if ((request.sectors & (1 << sector)) == 0)
+            {
+                sector++;
+                continue;
+            }
+            int first = sector;
+            while (sector < FLOPPY_SECTORCOUNT && (request.sectors & (1 << sector)) != 0)
+                sector++;
+
+            long foffset = track * FLOPPY_TRACKSIZE + first * FLOPPY_SECTORSIZE;
+            if (!pImage->Write(foffset, request.data + first * FLOPPY_SECTORSIZE, (sector - first) * FLOPPY_SECTORSIZE))
+                failed |= (uint8_t)(1 << drive);
+        }
+        flush[drive] = true;
+    }
+
+    for (int drive = 0; drive < 8; drive++)
+    {
+        if (flush[drive] && !m_images[drive]->Flush())
+            failed |= (uint8_t)(1 << drive);
+    }
+    return failed;
+}
+
 
 //////////////////////////////////////////////////////////////////////
 
 
 CFloppyDrive::CFloppyDrive()
 {
-    fpFile = nullptr;
+    pImage = nullptr;
     okReadOnly = false;
     datatrack = 0;
     dataptr = 0;
-    memset(data, 0, sizeof(data));
-    memset(marker, 0, sizeof(marker));
+    rotation = 0;
+    data = marker = nullptr;
+    cache = nullptr;
+    cachesize = 0;
+    cacheclock = 0;
 }
 
 void CFloppyDrive::Reset()
@@ -78,6 +469,20 @@ void CFloppyDrive::Reset()
     dataptr = 0;
 }
 
+void CFloppyDrive::AllocateBuffers()
+{
+    if (data != nullptr) return;
+
+    data = (uint8_t*) ::calloc(1, FLOPPY_RAWTRACKSIZE + FLOPPY_RAWMARKERSIZE);
+    marker = data + FLOPPY_RAWTRACKSIZE;
+}
+
+void CFloppyDrive::FreeBuffers()
+{
+    ::free(data);
+    data = marker = nullptr;
+}
+
 
 //////////////////////////////////////////////////////////////////////
 
@@ -86,9 +491,13 @@ CFloppyController::CFloppyController()
 {
     m_drive = -1;  m_pDrive = nullptr;
     m_motoron = false;
+    m_rotation = 0;
     m_okTrace = false;
     m_opercount = 0;
     m_trackchanged = false;
+    m_trackcachesize = FLOPPY_TRACKCACHESIZE;
+    m_okTurbo = m_turbodrq = false;
+    m_pWriter = nullptr;
     m_status = 0;
     m_tshift = 0;
     m_data = m_cmd = 0;
@@ -104,7 +513,12 @@ CFloppyController::CFloppyController()
 CFloppyController::~CFloppyController()
 {
     for (int drive = 0; drive < 8; drive++)
+    {
         DetachImage(drive);
+        m_drivedata[drive].FreeBuffers();
+    }
+
+    delete m_pWriter;
 }
 
 void CFloppyController::Reset()
@@ -113,11 +527,14 @@ void CFloppyController::Reset()
 
     FlushChanges();
 
+    if (m_drive >= 0 && !IsAttached(m_drive))
+        m_pDrive->FreeBuffers();
     m_drive = -1;  m_pDrive = nullptr;
     m_track = 0;
     m_opercount = 0;
     m_data = 0;
     m_trackchanged = false;
+    m_turbodrq = false;
     m_status = 0;
 }
 
@@ -126,22 +543,57 @@ bool CFloppyController::AttachImage(int drive, LPCTSTR sFileName)
     ASSERT(sFileName != nullptr);
 
     // If image attached - detach one first
-    if (m_drivedata[drive].fpFile != nullptr)
+    if (m_drivedata[drive].pImage != nullptr)
         DetachImage(drive);
 
     // Open file
-    m_drivedata[drive].okReadOnly = false;
-    m_drivedata[drive].fpFile = ::_tfopen(sFileName, _T("r+b"));
-    if (m_drivedata[drive].fpFile == nullptr)
+    CFloppyImage* pImage = CFloppyImage::Open(sFileName);
+    if (pImage == nullptr)
+        return false;
+
+    return AttachImage(drive, pImage);
+}
+
+bool CFloppyController::AttachOverlayImage(int drive, LPCTSTR sFileName, LPCTSTR sDeltaFileName)
+{
+    ASSERT(sFileName != nullptr);
+
+    // If image attached - detach one first
+    if (m_drivedata[drive].pImage != nullptr)
+        DetachImage(drive);
+
+    CFloppyImage* pImage = CFloppyImage::OpenOverlay(sFileName, sDeltaFileName);
+    if (pImage == nullptr)
+        return false;
+
+    return AttachImage(drive, pImage);
+}
+
+bool CFloppyController::AttachImage(int drive, CFloppyImage* pImage)
+{
+    m_drivedata[drive].pImage = pImage;
+    m_drivedata[drive].okReadOnly = pImage->IsReadOnly();
+    m_drivedata[drive].AllocateBuffers();
+
+    // Changes are saved by the writer thread
+    if (!m_drivedata[drive].okReadOnly)
     {
-        m_drivedata[drive].okReadOnly = true;
-        m_drivedata[drive].fpFile = ::_tfopen(sFileName, _T("rb"));
+        if (m_pWriter == nullptr)
+            m_pWriter = new CFloppyWriter();
+        m_pWriter->AttachImage(drive, pImage);
     }
-    if (m_drivedata[drive].fpFile == nullptr)
-        return false;
+
+    // Allocate the track cache
+    int cachesize = (m_trackcachesize > 0) ? m_trackcachesize : 1;
+    m_drivedata[drive].cache = (CFloppyTrackCache*) ::calloc(cachesize, sizeof(CFloppyTrackCache));
+    for (int i = 0; i < cachesize; i++)
+        m_drivedata[drive].cache[i].track = 0xffff;
+    m_drivedata[drive].cachesize = cachesize;
+    m_drivedata[drive].cacheclock = 0;
 
     m_track = m_drivedata[drive].datatrack = 0;
     m_drivedata[drive].dataptr = 0;
+    m_drivedata[drive].rotation = m_rotation;
     m_data = 0;
     m_trackchanged = false;
     m_status = 0;
@@ -152,16 +604,80 @@ bool CFloppyController::AttachImage(int drive, LPCTSTR sFileName)
     return true;
 }
 
-void CFloppyController::DetachImage(int drive)
+bool CFloppyController::DetachImage(int drive)
 {
-    if (m_drivedata[drive].fpFile == nullptr) return;
+    if (m_drivedata[drive].pImage == nullptr) return true;
 
-    FlushChanges();
+    bool result = SaveChanges(drive);
 
-    ::fclose(m_drivedata[drive].fpFile);
-    m_drivedata[drive].fpFile = nullptr;
+    CFloppyDrive* pDrive = m_drivedata + drive;
+    ::free(pDrive->cache);
+    pDrive->cache = nullptr;
+    pDrive->cachesize = 0;
+    if (m_pWriter != nullptr && !m_pWriter->DetachImage(drive))
+        result = false;
+    if (!result)
+        DebugLogFormat(_T("Floppy%d WRITE FAILED, the image file may miss the changes\r\n"), drive);
+
+    delete m_drivedata[drive].pImage;
+    m_drivedata[drive].pImage = nullptr;
     m_drivedata[drive].okReadOnly = false;
     m_drivedata[drive].Reset();
+    m_drivedata[drive].rotation = m_rotation;
+    if (m_pDrive != pDrive)  // The selected drive keeps its buffers
+        pDrive->FreeBuffers();
+    return result;
+}
+
+bool CFloppyController::CommitOverlay(int drive)
+{
+    if (!IsOverlay(drive)) return false;
+
+    if (!SaveChanges(drive))
+        return false;  // The overlay misses some changes
+
+    return m_drivedata[drive].pImage->CommitOverlay();
+}
+
+bool CFloppyController::DiscardOverlay(int drive)
+{
+    if (!IsOverlay(drive)) return false;
+
+    CFloppyDrive* pDrive = m_drivedata + drive;
+    if (m_pWriter != nullptr)
+        m_pWriter->WaitImage(drive);  // Write errors don't matter, the changes are discarded
+
+    if (!pDrive->pImage->DiscardOverlay())
+        return false;  // The changes are still there, keep the cached tracks too
+
+    // Forget all the cached tracks, and reload the current one from the base image
+    if (m_pDrive == pDrive)
+        m_trackchanged = false;
+    for (int i = 0; i < pDrive->cachesize; i++)
+    {
+        pDrive->cache[i].track = 0xffff;
+        pDrive->cache[i].dirty = false;
+    }
+    if (m_pDrive == pDrive)
+        PrepareTrack();
+    return true;
+}
+
+bool CFloppyController::SaveChanges(int drive)
+{
+    FlushChanges();
+
+    // Save all the changed tracks
+    CFloppyDrive* pDrive = m_drivedata + drive;
+    for (int i = 0; i < pDrive->cachesize; i++)
+    {
+        if (pDrive->cache[i].dirty)
+            WriteCachedTrack(pDrive, pDrive->cache + i);
+    }
+
+    if (m_pWriter != nullptr)
+        return m_pWriter->WaitImage(drive);
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -198,8 +714,15 @@ void CFloppyController::SetControl(uint8_t data)
     if (m_drive != newdrive)
     {
         FlushChanges();
+        if (m_drive >= 0 && !IsAttached(m_drive))
+            m_pDrive->FreeBuffers();
         m_drive = newdrive;
         m_pDrive = (newdrive < 0) ? nullptr : m_drivedata + m_drive;
+        if (m_pDrive != nullptr)
+        {
+            m_pDrive->AllocateBuffers();
+            SyncRotation(m_pDrive);
+        }
         okPrepareTrack = true;
 
         if (m_okTrace) DebugLogFormat(_T("Floppy CURRENT DRIVE %d\r\n"), newdrive);
@@ -216,6 +739,7 @@ void CFloppyController::SetCommand(uint8_t cmd)
     if (m_okTrace) DebugLogFormat(_T("Floppy%d SET COMMAND %02X =====\r\n"), m_drive, cmd);
 
     m_opercount = -1;
+    m_turbodrq = false;
 
     if ((cmd & 0xF0) == 0xD0)  // D0..DF -- Force Interrupt
     {
@@ -241,7 +765,7 @@ void CFloppyController::SetCommand(uint8_t cmd)
             return;
         }
         m_state = S_DELAY_BEFORE_CMD;
-        m_opercount = 235;  // 15ms delay before a read/write operation; 15 ms = 234.375 periodic calls
+        m_opercount = GetDelay(235);  // 15ms delay before a read/write operation; 15 ms = 234.375 periodic calls
         m_statenext = S_CMD_RW;
         m_startcrc = -1;
         return;
@@ -258,7 +782,12 @@ uint16_t CFloppyController::GetData(void)
 
     m_status &= ~ST_DRQ;
     m_rqs &= ~R_DRQ;
-    return m_data;
+    uint8_t data = m_data;
+
+    if (m_okTurbo && m_state == S_READ && m_rwlen > 0)  // Turbo: the next byte is ready right away
+        ProcessTurboByte();
+
+    return data;
 }
 
 void CFloppyController::WriteData(uint16_t data)
@@ -270,20 +799,26 @@ void CFloppyController::WriteData(uint16_t data)
     m_rqs &= ~R_DRQ;
     m_status &= ~ST_DRQ;
     m_data = data & 0xff;
+
+    if (m_okTurbo && (m_state == S_WRITE || m_state == S_WR_TRACK_DATA))  // Turbo: write the byte right away
+        ProcessTurboByte();
 }
 
 static int FloppyLastState = 0;//DEBUG
 void CFloppyController::Periodic()
 {
+    if (m_turbodrq)  // Turbo: the byte was requested after the last call, give the guest a whole period for it
+    {
+        m_turbodrq = false;
+        return;
+    }
+
     if (IsEngineOn())  // Вращаем дискеты только если включен мотор
     {
-        // Вращаем дискеты во всех драйвах сразу
-        for (int drive = 0; drive < 8; drive++)
-        {
-            m_drivedata[drive].dataptr++;
-            if (m_drivedata[drive].dataptr >= FLOPPY_RAWTRACKSIZE)
-                m_drivedata[drive].dataptr = 0;
-        }
+        // Все дискеты вращаются вместе; положение в остальных драйвах вычисляется при их выборе
+        m_rotation++;
+        if (m_pDrive != nullptr)
+            SyncRotation(m_pDrive);
     }
 
     if (m_opercount > 0)  // Уменьшаем счётчик текущей операции
@@ -305,6 +840,45 @@ void CFloppyController::Periodic()
             m_status |= ST_INDEX;
     }
 
+    ProcessState();
+
+    // Turbo: rotate the disk right to the byte the current state waits for, instead of byte per call
+    if (m_okTurbo)
+    {
+        for (int count = 0; count < FLOPPY_RAWTRACKSIZE && IsWaitingForDisk(); count++)
+        {
+            RotateDisk();
+            ProcessState();
+        }
+    }
+}
+
+bool CFloppyController::IsIdle() const
+{
+    return m_state == S_IDLE && !m_turbodrq;
+}
+
+void CFloppyController::SkipPeriods(uint64_t count)
+{
+    ASSERT(IsIdle());
+    if (count == 0)
+        return;
+
+    // Nothing happens while idle but the rotation, so all the periods except the last one are just counted
+    count--;
+    if (IsEngineOn())
+    {
+        m_rotation += (uint32_t)count;
+        if (m_pDrive != nullptr)
+            SyncRotation(m_pDrive);
+    }
+    m_opercount = (m_opercount > (int64_t)count) ? m_opercount - (int)count : 0;
+
+    Periodic();
+}
+
+void CFloppyController::ProcessState()
+{
     if (m_okTrace && m_state != FloppyLastState)
     {
         DebugLogFormat(_T("Floppy state changed %d -> %d\r\n"), (int)FloppyLastState, (int)m_state);
@@ -351,10 +925,12 @@ void CFloppyController::Periodic()
             {
                 if (m_startcrc < 0)
                 {
-                    if (!m_pDrive->marker[m_pDrive->dataptr] || m_pDrive->data[m_pDrive->dataptr] != 0xfe)
+                    if (!m_pDrive->IsCurrentMarker() || m_pDrive->GetCurrentByte() != 0xfe)
                         break;  // Wait for ID marker
                     // Marker found
                     m_startcrc = m_pDrive->dataptr;  // Start reading 6-byte sector header
+                    m_crc = UpdateCrc(CRC_PRESET, 0xfe);
+                    break;
                 }
                 if (m_startcrc >= 0)
                 {
@@ -362,11 +938,24 @@ void CFloppyController::Periodic()
                     //m_rqs = R_DRQ;
                     //m_status |= ST_DRQ;
                     int readlen = m_pDrive->dataptr - m_startcrc;  if (readlen < 0) readlen += FLOPPY_RAWTRACKSIZE;
+                    if (readlen <= 4)  // Track, side, sector, size
+                        m_crc = UpdateCrc(m_crc, m_pDrive->GetCurrentByte());
                     if (readlen == 3 && m_pDrive->data[m_pDrive->dataptr] != m_sector && (m_cmd & 0xf8) != 0xc0)  // Wrong sector, wait for next one
                     {
                         m_startcrc = -1;
                         break;
                     }
+                    if (readlen == 6)  // Check the header CRC
+                    {
+                        uint16_t prevptr = (m_pDrive->dataptr == 0) ? FLOPPY_RAWTRACKSIZE - 1 : m_pDrive->dataptr - 1;
+                        uint16_t crc = (uint16_t)((m_pDrive->data[prevptr] << 8) | m_pDrive->GetCurrentByte());
+                        if (crc != m_crc)  // Header is broken, look for the next one
+                        {
+                            m_status |= ST_CRCERR;
+                            m_startcrc = -1;
+                            break;
+                        }
+                    }
                     if (readlen >= 6 && (m_cmd & 0xf8) == 0xc0)  // Read Address
                     {
                         // При выполнении команды "Чтение адреса" содержиморе регистра дорожки пересылается в регистр сектора
@@ -382,10 +971,11 @@ void CFloppyController::Periodic()
                         m_state = S_WRSEC;
                         break;
                     }
-                    if (!m_pDrive->marker[m_pDrive->dataptr] || m_pDrive->data[m_pDrive->dataptr] != 0xfb)  // Data marker
+                    if (!m_pDrive->IsCurrentMarker() || m_pDrive->GetCurrentByte() != 0xfb)  // Data marker
                         break;
                     // Finished reading the current sector header
                     m_startcrc = -1;
+                    m_crc = UpdateCrc(CRC_PRESET, 0xfb);
                     m_status &= ~ST_CRCERR;
                     if ((m_cmd & 0xe0) == 0x80)  // Read Sector
                     {
@@ -434,13 +1024,19 @@ void CFloppyController::Periodic()
                 m_status |= ST_LOST;
             m_data = m_pDrive->GetCurrentByte();  // Read next byte
             m_rwlen--;
-            //TODO: Update m_crc
+            m_crc = UpdateCrc(m_crc, m_data);
             m_rqs = R_DRQ;
             m_status |= ST_DRQ;
         }
         else
         {
-            //TODO
+            if ((m_cmd & 0xe0) == 0x80)  // Read Sector: check the data CRC, head is on its first byte
+            {
+                uint16_t nextptr = (m_pDrive->dataptr + 1 < FLOPPY_RAWTRACKSIZE) ? m_pDrive->dataptr + 1 : 0;
+                uint16_t crc = (uint16_t)((m_pDrive->GetCurrentByte() << 8) | m_pDrive->data[nextptr]);
+                if (crc != m_crc)
+                    m_status |= ST_CRCERR;
+            }
             m_state = S_IDLE;
         }
         break;
@@ -469,6 +1065,7 @@ void CFloppyController::Periodic()
             break;
         }
         m_pDrive->SetCurrentByte(0xfb);
+        m_crc = UpdateCrc(CRC_PRESET, 0xfb);
         m_rwlen = 512;
         m_state = S_WRITE;
         break;
@@ -483,12 +1080,16 @@ void CFloppyController::Periodic()
             m_pDrive->SetCurrentByte(m_data);
             m_trackchanged = true;
             m_rwlen--;
-            //TODO: Update m_crc
+            m_crc = UpdateCrc(m_crc, m_data);
             m_rqs = R_DRQ;
             m_status |= ST_DRQ;
         }
         else
         {
+            // Write the data CRC
+            uint16_t nextptr = (m_pDrive->dataptr + 1 < FLOPPY_RAWTRACKSIZE) ? m_pDrive->dataptr + 1 : 0;
+            m_pDrive->SetCurrentByte((uint8_t)(m_crc >> 8));
+            m_pDrive->data[nextptr] = (uint8_t)(m_crc & 0xff);
             //TODO: if (m_cmd & CB_MULTIPLE)
             m_state = S_IDLE;
         }
@@ -519,7 +1120,7 @@ void CFloppyController::Periodic()
         if (m_pDrive->dataptr == FLOPPY_RAWTRACKSIZE - 1)  // Index found, finished writing the track
         {
             m_pDrive->SetCurrentByte(m_data);
-            m_pDrive->marker[m_pDrive->dataptr] = false;
+            m_pDrive->SetCurrentMarker(false);
             m_state = S_IDLE;
             break;
         }
@@ -529,11 +1130,12 @@ void CFloppyController::Periodic()
             m_data = 0;
         }
         m_trackchanged = true;
-        m_pDrive->marker[m_pDrive->dataptr] = false;
+        m_pDrive->SetCurrentMarker(false);
         if (m_data == 0xf5)
         {
             m_pDrive->SetCurrentByte(0xa1);
             m_startcrc = m_pDrive->dataptr + 1;
+            m_crc = CRC_PRESET;
         }
         else if (m_data == 0xf6)
         {
@@ -541,23 +1143,24 @@ void CFloppyController::Periodic()
         }
         else if (m_data == 0xf7 && m_rwlen == 0)
         {
-            m_pDrive->SetCurrentByte(0x12);  // Fake CRC, first byte
+            m_pDrive->SetCurrentByte((uint8_t)(m_crc >> 8));  // CRC, first byte
             m_rwlen = 1;
             break;
         }
         else if (m_data == 0xf7 && m_rwlen == 1)
         {
-            m_pDrive->SetCurrentByte(0x34);  // Fake CRC, second byte
+            m_pDrive->SetCurrentByte((uint8_t)(m_crc & 0xff));  // CRC, second byte
             m_rwlen = 0;
             m_startcrc = -1;
         }
         else
         {
             m_pDrive->SetCurrentByte(m_data);
+            m_crc = UpdateCrc(m_crc, m_data);
             if (m_startcrc > 0)
             {
                 if (m_startcrc == m_pDrive->dataptr)
-                    m_pDrive->marker[m_pDrive->dataptr] = true;
+                    m_pDrive->SetCurrentMarker(true);
             }
         }
         m_rqs = R_DRQ;
@@ -575,7 +1178,7 @@ void CFloppyController::Periodic()
             if (m_cmd & 0x40) m_direction = (m_cmd & CB_SEEK_DIR) ? -1 : 1;
             m_statenext = S_STEP;
         }
-        m_opercount = 15625;  // 1000 ms
+        m_opercount = GetDelay(15625);  // 1000 ms
         m_state = S_WAIT;
         break;
     case S_STEP:
@@ -590,7 +1193,7 @@ void CFloppyController::Periodic()
             PrepareTrack();
 
             static const int steps[] = { 6, 12, 20, 30 };
-            m_opercount = steps[m_cmd & CB_SEEK_RATE] * 16;
+            m_opercount = GetDelay(steps[m_cmd & CB_SEEK_RATE] * 16);
             m_state = S_WAIT;
             m_statenext = (m_cmd & 0xe0) ? S_VERIFY : S_SEEK;
             break;
@@ -617,9 +1220,9 @@ void CFloppyController::Periodic()
             break;
         }
         // Search for marker
-        if (!m_pDrive->marker[m_pDrive->dataptr] /*&& m_startcrc < 0*/)
+        if (!m_pDrive->IsCurrentMarker() /*&& m_startcrc < 0*/)
             break;  // Wait for a marker
-        if (m_pDrive->marker[m_pDrive->dataptr])  // Marker found
+        if (m_pDrive->IsCurrentMarker())  // Marker found
         {
             m_state = S_FOUND_NEXT_ID;
             break;
@@ -634,14 +1237,62 @@ void CFloppyController::Periodic()
         {
             //TODO: Switch to lower track
         }
-        m_opercount = 94;  // 6ms = 93.75 periodic calls
+        m_opercount = GetDelay(94);  // 6ms = 93.75 periodic calls
         break;
     }
 }
 
+// Turbo: the states where nothing depends on the guest, only the disk rotation
+bool CFloppyController::IsWaitingForDisk() const
+{
+    if (m_pDrive == nullptr || !IsEngineOn())
+        return false;
+    switch (m_state)
+    {
+    case S_CMD_RW:  // Looking for the sector
+    case S_VERIFY:  // Looking for ID marker
+        return true;
+    case S_WRSEC:  // Gap and sync before the data
+    case S_WRTRACK:  // Waiting for the index
+        return (m_rqs & R_DRQ) == 0;  // Only if the guest gave the first byte already
+    default:
+        return false;
+    }
+}
+
+void CFloppyController::SyncRotation(CFloppyDrive* pDrive)
+{
+    uint32_t delta = m_rotation - pDrive->rotation;
+    if (delta == 0)
+        return;
+    uint32_t dataptr = pDrive->dataptr + delta % FLOPPY_RAWTRACKSIZE;
+    if (dataptr >= FLOPPY_RAWTRACKSIZE)
+        dataptr -= FLOPPY_RAWTRACKSIZE;
+    pDrive->dataptr = (uint16_t)dataptr;
+    pDrive->rotation = m_rotation;
+}
+
+void CFloppyController::RotateDisk()
+{
+    m_pDrive->dataptr++;
+    if (m_pDrive->dataptr >= FLOPPY_RAWTRACKSIZE)
+        m_pDrive->dataptr = 0;
+}
+
+// Turbo: the guest read or wrote the data register; move on to the next byte without waiting for Periodic()
+void CFloppyController::ProcessTurboByte()
+{
+    if (m_pDrive == nullptr)
+        return;
+    RotateDisk();
+    ProcessState();
+    if (m_rqs & R_DRQ)
+        m_turbodrq = true;
+}
+
 void CFloppyController::ReadFirstByte()
 {
-    m_crc = 0;//TODO: Init m_crc
+    m_crc = CRC_PRESET;
     m_data = m_pDrive->data[m_pDrive->dataptr];  // Read next byte
     m_rwlen--;
     m_rqs = R_DRQ;
@@ -649,7 +1300,7 @@ void CFloppyController::ReadFirstByte()
     m_state = S_READ;
 }
 
-// Read track data from file and fill m_data
+// Get track data from the track cache or from the file, and fill m_data
 void CFloppyController::PrepareTrack()
 {
     FlushChanges();
@@ -662,18 +1313,16 @@ void CFloppyController::PrepareTrack()
     //NOTE: Not changing m_pDrive->dataptr
     m_pDrive->datatrack = m_track;
 
-    long foffset = m_track * FLOPPY_TRACKSIZE;
-    uint8_t data[FLOPPY_TRACKSIZE];  memset(data, 0, FLOPPY_TRACKSIZE);
-
-    if (m_pDrive->fpFile != nullptr)
+    if (m_pDrive->cache == nullptr)  // No image, empty track
     {
-        ::fseek(m_pDrive->fpFile, foffset, SEEK_SET);
-        size_t count = ::fread(data, 1, FLOPPY_TRACKSIZE, m_pDrive->fpFile);
-        //TODO: Контроль ошибок чтения
+        uint8_t data[FLOPPY_TRACKSIZE];  memset(data, 0, FLOPPY_TRACKSIZE);
+        EncodeTrackData(data, m_pDrive->data, m_pDrive->marker, m_track, m_side);
+        return;
     }
 
-    // Fill m_data array with data
-    EncodeTrackData(data, m_pDrive->data, m_pDrive->marker, m_track, m_side);
+    CFloppyTrackCache* pEntry = GetCachedTrack(m_pDrive, m_track, true);
+    memcpy(m_pDrive->data, pEntry->data, FLOPPY_RAWTRACKSIZE);
+    memcpy(m_pDrive->marker, pEntry->marker, FLOPPY_RAWMARKERSIZE);
 
     //FILE* fpTrack = ::_tfopen(_T("RawTrack.bin"), _T("w+b"));
     //::fwrite(m_pDrive->data, 1, FLOPPY_RAWTRACKSIZE, fpTrack);
@@ -681,8 +1330,8 @@ void CFloppyController::PrepareTrack()
 
 //    //DEBUG: Test DecodeTrackData()
 //    uint8_t data2[FLOPPY_TRACKSIZE];
-//    bool parsed = DecodeTrackData(m_pDrive->data, data2);
-//    ASSERT(parsed);
+//    uint16_t parsed = DecodeTrackData(m_pDrive->data, m_pDrive->marker, data2);
+//    ASSERT(parsed == FLOPPY_SECTORMASK);
 //    bool tested = true;
 //    for (int i = 0; i < FLOPPY_TRACKSIZE; i++)
 //        if (data[i] != data2[i])
@@ -706,39 +1355,88 @@ void CFloppyController::FlushChanges()
     //::fwrite(m_pDrive->data, 1, FLOPPY_RAWTRACKSIZE, fpTrack);
     //::fclose(fpTrack);
 
-    // Decode track data from m_data
-    uint8_t data[FLOPPY_TRACKSIZE];  memset(data, 0, FLOPPY_TRACKSIZE);
-    bool decoded = DecodeTrackData(m_pDrive->data, data);
+    // The file is written later, when the track leaves the cache or the image is detached
+    CFloppyTrackCache* pEntry = GetCachedTrack(m_pDrive, m_pDrive->datatrack, false);
+    memcpy(pEntry->data, m_pDrive->data, FLOPPY_RAWTRACKSIZE);
+    memcpy(pEntry->marker, m_pDrive->marker, FLOPPY_RAWMARKERSIZE);
+    pEntry->dirty = true;
 
-    if (decoded)  // Write to the file only if the track was correctly decoded from raw data
+    m_trackchanged = false;
+}
+
+// Find the track in the drive track cache; on cache miss, replace the least recently used track,
+// and load the track from the file if okLoad
+CFloppyTrackCache* CFloppyController::GetCachedTrack(CFloppyDrive* pDrive, uint16_t track, bool okLoad)
+{
+    CFloppyTrackCache* pEntry = nullptr;
+    for (int i = 0; i < pDrive->cachesize; i++)
     {
-        // Track has 10 sectors, 512 bytes each
-        long foffset = m_pDrive->datatrack * FLOPPY_TRACKSIZE;
+        CFloppyTrackCache* pCurrent = pDrive->cache + i;
+        if (pCurrent->track == track)
+        {
+            pEntry = pCurrent;
+            break;
+        }
+        if (pEntry == nullptr || pCurrent->lastuse < pEntry->lastuse)
+            pEntry = pCurrent;
+    }
+    pEntry->lastuse = ++pDrive->cacheclock;
+    if (pEntry->track == track)
+        return pEntry;
+
+    if (pEntry->dirty)
+        WriteCachedTrack(pDrive, pEntry);
+    pEntry->track = track;
+    if (!okLoad)
+        return pEntry;
+
+    if (m_okTrace) DebugLogFormat(_T("Floppy LOAD track %d\r\n"), (int)track);
+
+    int drive = (int)(pDrive - m_drivedata);
+    uint8_t data[FLOPPY_TRACKSIZE];
+    bool okRead = (m_pWriter != nullptr) ?
+            m_pWriter->ReadTrack(drive, track, pDrive->pImage, data) :  // The file may be not updated yet
+            pDrive->pImage->Read((long)track * FLOPPY_TRACKSIZE, data, FLOPPY_TRACKSIZE);
+    if (!okRead)  // The data not read are zeroes
+        DebugLogFormat(_T("Floppy%d READ FAILED track %d\r\n"), drive, (int)track);
+    memcpy(pEntry->disk, data, FLOPPY_TRACKSIZE);
+
+    EncodeTrackData(data, pEntry->data, pEntry->marker, track, m_side);
+
+    return pEntry;
+}
 
-//        // Check file length
-//        ::fseek(m_pDrive->fpFile, 0, SEEK_END);
-//        uint32_t currentFileSize = ::ftell(m_pDrive->fpFile);
-//        while (currentFileSize < (uint32_t)(foffset + FLOPPY_TRACKSIZE))
-//        {
-//            uint8_t datafill[512];  ::memset(datafill, 0, 512);
-//            uint32_t bytesToWrite = ((uint32_t)(foffset + FLOPPY_TRACKSIZE) - currentFileSize) % 512;
-//            if (bytesToWrite == 0) bytesToWrite = 512;
-//            ::fwrite(datafill, 1, bytesToWrite, m_pDrive->fpFile);
-//            //TODO: Проверка на ошибки записи
-//            currentFileSize += bytesToWrite;
-//        }
+void CFloppyController::WriteCachedTrack(CFloppyDrive* pDrive, CFloppyTrackCache* pEntry)
+{
+    pEntry->dirty = false;
 
-        // Save data into the file
-        ::fseek(m_pDrive->fpFile, foffset, SEEK_SET);
-        size_t dwBytesWritten = ::fwrite(data, 1, FLOPPY_TRACKSIZE, m_pDrive->fpFile);
-        //TODO: Проверка на ошибки записи
-    }
-    else
+    // Decode track data from the raw track; only the correctly decoded sectors go to the file
+    uint8_t data[FLOPPY_TRACKSIZE];  memset(data, 0, FLOPPY_TRACKSIZE);
+    uint16_t decoded = DecodeTrackData(pEntry->data, pEntry->marker, data);
+    if (decoded != FLOPPY_SECTORMASK)
+        DebugLogFormat(_T("Floppy%d FLUSH FAILED track %d sectors %03X\r\n"),
+                (int)(pDrive - m_drivedata), (int)pEntry->track, (int)(FLOPPY_SECTORMASK & ~decoded));
+
+    // Find the sectors that differ from the file
+    uint16_t sectors = 0;
+    for (int sector = 0; sector < FLOPPY_SECTORCOUNT; sector++)
     {
-        if (m_okTrace) DebugLog(_T("Floppy FLUSH FAILED\r\n"));
+        int offset = sector * FLOPPY_SECTORSIZE;
+        if ((decoded & (1 << sector)) != 0 &&
+            memcmp(data + offset, pEntry->disk + offset, FLOPPY_SECTORSIZE) != 0)
+            sectors |= (1 << sector);
     }
+    if (m_okTrace) DebugLogFormat(_T("Floppy WRITE track %d sectors %03X\r\n"), (int)pEntry->track, (int)sectors);
+    if (sectors == 0 || pDrive->okReadOnly || m_pWriter == nullptr)
+        return;
 
-    m_trackchanged = false;
+    for (int sector = 0; sector < FLOPPY_SECTORCOUNT; sector++)
+    {
+        int offset = sector * FLOPPY_SECTORSIZE;
+        if ((sectors & (1 << sector)) != 0)
+            memcpy(pEntry->disk + offset, data + offset, FLOPPY_SECTORSIZE);
+    }
+    m_pWriter->QueueTrack((int)(pDrive - m_drivedata), pEntry->track, sectors, data);
 }
 
 
@@ -766,7 +1464,7 @@ uint16_t CalculateChecksum(const uint8_t* buffer, int length)
 // Fill data array and marker array with marked data
 // pSrc   array length is 5120 == FLOPPY_TRACKSIZE
 // data   array length is 6250 == FLOPPY_RAWTRACKSIZE
-// marker array length is 6250 == FLOPPY_RAWMARKERSIZE
+// marker bitset length is 782 == FLOPPY_RAWMARKERSIZE, bit (ptr & 7) of byte (ptr >> 3) is for data[ptr]
 //-------------------------------------------------
 //     ¦  54        4E
 //     ¦  12        00
@@ -808,98 +1506,99 @@ static void EncodeTrackData(const uint8_t* pSrc, uint8_t* data, uint8_t* marker,
         // sector header
         for (count = 0; count < 8; count++) data[ptr++] = 0x00;
         data[ptr++] = 0xa1;  data[ptr++] = 0xa1;  data[ptr++] = 0xa1;
-        marker[ptr] = true;  data[ptr++] = 0xfe;  // ID marker; start CRC calculus
+        int crcptr = ptr;
+        marker[ptr >> 3] |= (uint8_t)(1 << (ptr & 7));  data[ptr++] = 0xfe;  // ID marker; start CRC calculus
         data[ptr++] = (uint8_t)track;  // Track 0..79
         data[ptr++] = (side != 0);
         data[ptr++] = (uint8_t)sect + 1;  // Sector 1..10
         data[ptr++] = 2; // Assume 512 bytes per sector;
         // crc
-        data[ptr++] = 0x12;  data[ptr++] = 0x34;  //TODO: Calculate CRC
+        uint16_t crc = CalculateCrc(CRC_PRESET, data + crcptr, ptr - crcptr);
+        data[ptr++] = (uint8_t)(crc >> 8);  data[ptr++] = (uint8_t)(crc & 0xff);
         for (count = 0; count < 22; count++) data[ptr++] = 0x4e;
         // data header
         for (count = 0; count < 12; count++) data[ptr++] = 0x00;
         data[ptr++] = 0xa1;  data[ptr++] = 0xa1;  data[ptr++] = 0xa1;
-        marker[ptr] = true;  data[ptr++] = 0xfb;  // Data marker; start CRC calculus
+        crcptr = ptr;
+        marker[ptr >> 3] |= (uint8_t)(1 << (ptr & 7));  data[ptr++] = 0xfb;  // Data marker; start CRC calculus
         // data
-        for (count = 0; count < 512; count++)
-            data[ptr++] = pSrc[(sect * 512) + count];
+        memcpy(data + ptr, pSrc + sect * 512, 512);
+        ptr += 512;
         // crc
-        data[ptr++] = 0x43;  data[ptr++] = 0x21;  //TODO: Calculate CRC
+        crc = CalculateCrc(CRC_PRESET, data + crcptr, ptr - crcptr);
+        data[ptr++] = (uint8_t)(crc >> 8);  data[ptr++] = (uint8_t)(crc & 0xff);
         gap = 44;
     }
     // fill to the end of the track
     while (ptr < FLOPPY_RAWTRACKSIZE) data[ptr++] = 0x4e;
 }
 
-// Decode track data from raw data
+// Find next marker in the bitset, starting from the ptr position; returns -1 if not found
+static int FindNextMarker(const uint8_t* marker, int ptr)
+{
+    if (ptr >= FLOPPY_RAWTRACKSIZE) return -1;
+    int index = ptr >> 3;
+    uint8_t bits = (uint8_t)(marker[index] & (0xff << (ptr & 7)));
+    while (bits == 0)
+    {
+        if (++index >= FLOPPY_RAWMARKERSIZE) return -1;
+        bits = marker[index];
+    }
+    int result = index << 3;
+    while ((bits & 1) == 0) { bits >>= 1;  result++; }
+    return (result < FLOPPY_RAWTRACKSIZE) ? result : -1;
+}
+
+// Decode track data from raw data, going from one marker to another
 // pRaw is array of FLOPPY_RAWTRACKSIZE bytes
+// pMarker is the marker bitset of FLOPPY_RAWMARKERSIZE bytes
 // pDest is array of 5120 bytes = FLOPPY_TRACKSIZE
-// Returns: true - decoded, false - parse error
-static bool DecodeTrackData(const uint8_t* pRaw, uint8_t* pDest)
-{
-    uint16_t dataptr = 0;  // Offset in raw track array
-    uint16_t destptr = 0;  // Offset in data array
-    // Skip gap and sync at the track start
-    while (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0x4e) dataptr++;
-    while (dataptr < FLOPPY_RAWTRACKSIZE && (pRaw[dataptr] == 0x00 || pRaw[dataptr] == 0xC2)) dataptr++;
-    for (;;)
+// Returns: bitmask of the FLOPPY_SECTORSIZE sectors of pDest decoded correctly;
+// a CRC error spoils only the sectors it covers, a parse error stops the decoding
+static uint16_t DecodeTrackData(const uint8_t* pRaw, const uint8_t* pMarker, uint8_t* pDest)
+{
+    uint16_t decoded = 0, failed = 0;
+    int destptr = 0;  // Offset in data array
+    int dataptr = FindNextMarker(pMarker, 0);  // Offset in raw track array
+    while (dataptr >= 0 && destptr < FLOPPY_TRACKSIZE)
     {
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) break;  // End of track or error
-        while (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0x4e) dataptr++;  // Skip sector gap
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) break;  // End of track or error
-        while (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0x00) dataptr++;  // Skip sync
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) return false;  // Something wrong
-
-        if (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0xa1) dataptr++;
-        if (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0xa1) dataptr++;
-        if (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0xa1) dataptr++;
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) return false;  // Something wrong
-        if (pRaw[dataptr++] != 0xfe)
-            return false;  // Marker not found
-
-        uint8_t sectcyl, secthd, sectsec, sectno = 0;
-        if (dataptr < FLOPPY_RAWTRACKSIZE) sectcyl = pRaw[dataptr++];
-        if (dataptr < FLOPPY_RAWTRACKSIZE) secthd = pRaw[dataptr++];
-        if (dataptr < FLOPPY_RAWTRACKSIZE) sectsec = pRaw[dataptr++];
-        if (dataptr < FLOPPY_RAWTRACKSIZE) sectno = pRaw[dataptr++];
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) return false;  // Something wrong
-
+        // Sector header: FE, track, side, sector, size, CRC
+        if (pRaw[dataptr] != 0xfe || dataptr + 7 > FLOPPY_RAWTRACKSIZE)
+            break;  // Something wrong
         int sectorsize;
+        uint8_t sectno = pRaw[dataptr + 4];
         if (sectno == 1) sectorsize = 256;
         else if (sectno == 2) sectorsize = 512;
         else if (sectno == 3) sectorsize = 1024;
-        else return false;  // Something wrong: unknown sector size
-        // crc
-        if (dataptr < FLOPPY_RAWTRACKSIZE) dataptr++;
-        if (dataptr < FLOPPY_RAWTRACKSIZE) dataptr++;
-
-        while (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0x4e) dataptr++;  // Skip GAP2
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) return false;  // Something wrong
-        while (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0x00) dataptr++;  // Skip sync
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) return false;  // Something wrong
-
-        if (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0xa1) dataptr++;
-        if (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0xa1) dataptr++;
-        if (dataptr < FLOPPY_RAWTRACKSIZE && pRaw[dataptr] == 0xa1) dataptr++;
-        if (dataptr >= FLOPPY_RAWTRACKSIZE) return false;  // Something wrong
-        if (pRaw[dataptr++] != 0xfb)
-            return false;  // Marker not found
-
-        for (int count = 0; count < sectorsize; count++)  // Copy sector data
-        {
-            if (destptr >= FLOPPY_TRACKSIZE) break;  // End of track or error
-            pDest[destptr++] = pRaw[dataptr++];
-            if (dataptr >= FLOPPY_RAWTRACKSIZE)
-                return false;  // Something wrong
-        }
-        if (dataptr >= FLOPPY_RAWTRACKSIZE)
-            return false;  // Something wrong
-        // crc
-        if (dataptr < FLOPPY_RAWTRACKSIZE) dataptr++;
-        if (dataptr < FLOPPY_RAWTRACKSIZE) dataptr++;
+        else break;  // Something wrong: unknown sector size
+        bool okCrc = (CalculateCrc(CRC_PRESET, pRaw + dataptr, 5) == ((pRaw[dataptr + 5] << 8) | pRaw[dataptr + 6]));
+
+        // Data field: FB, data, CRC
+        dataptr = FindNextMarker(pMarker, dataptr + 7);
+        if (dataptr < 0 || pRaw[dataptr] != 0xfb)
+            break;  // Marker not found
+        if (dataptr + 1 + sectorsize + 2 > FLOPPY_RAWTRACKSIZE)
+            break;  // Something wrong
+        if (CalculateCrc(CRC_PRESET, pRaw + dataptr, 1 + sectorsize) !=
+            ((pRaw[dataptr + 1 + sectorsize] << 8) | pRaw[dataptr + 1 + sectorsize + 1]))
+            okCrc = false;
+        int copylen = (destptr + sectorsize <= FLOPPY_TRACKSIZE) ? sectorsize : FLOPPY_TRACKSIZE - destptr;
+        uint16_t sectors = 0;  // Sectors of pDest covered by this one
+        for (int sector = destptr / FLOPPY_SECTORSIZE; sector <= (destptr + copylen - 1) / FLOPPY_SECTORSIZE; sector++)
+            sectors |= (1 << sector);
+        if (okCrc)
+        {
+            memcpy(pDest + destptr, pRaw + dataptr + 1, copylen);  // Copy sector data
+            decoded |= sectors;
+        }
+        else
+            failed |= sectors;
+        destptr += copylen;
+
+        dataptr = FindNextMarker(pMarker, dataptr + 1 + sectorsize + 2);
     }
 
-    return true;
+    return decoded & ~failed;
 }
 
 
@@ -0,0 +1,573 @@
+﻿/*  This file is part of MS0515BTL.
+    MS0515BTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    MS0515BTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// FloppyImage.cpp
+// Floppy image file access: memory-mapped image, with stdio files as a fallback;
+// copy-on-write overlay over read-only image
+// See defines in header file Emubase.h
+
+#include "stdafx.h"
+#include "Emubase.h"
+#include <map>
+#include <mutex>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+//////////////////////////////////////////////////////////////////////
+// CFloppyStdioImage
+
+// Image accessed with stdio; reads and writes go through separate file handles,
+// because they come from different threads
+class CFloppyStdioImage : public CFloppyImage
+{
+public:
+    CFloppyStdioImage();
+    virtual ~CFloppyStdioImage();
+    bool Open(LPCTSTR sFileName, bool okReadOnly);
+    virtual bool Read(long offset, uint8_t* pData, int size);
+    virtual bool Write(long offset, const uint8_t* pData, int size);
+    virtual bool Flush();
+
+private:
+    FILE* m_fpRead;
+    FILE* m_fpWrite;
+};
+
+CFloppyStdioImage::CFloppyStdioImage()
+{
+    m_fpRead = m_fpWrite = nullptr;
+}
+
+CFloppyStdioImage::~CFloppyStdioImage()
+{
+    if (m_fpWrite != nullptr)
+        ::fclose(m_fpWrite);
+    if (m_fpRead != nullptr)
+        ::fclose(m_fpRead);
+}
+
+bool CFloppyStdioImage::Open(LPCTSTR sFileName, bool okReadOnly)
+{
+    m_okReadOnly = okReadOnly;
+    if (!m_okReadOnly)
+    {
+        m_fpRead = ::_tfopen(sFileName, _T("r+b"));
+        if (m_fpRead == nullptr)
+            m_okReadOnly = true;
+    }
+    if (m_fpRead == nullptr)
+        m_fpRead = ::_tfopen(sFileName, _T("rb"));
+    if (m_fpRead == nullptr)
+        return false;
+    ::setvbuf(m_fpRead, nullptr, _IONBF, 0);  // Whole tracks are read; no buffer to keep the data older than the file
+
+    if (!m_okReadOnly)
+    {
+        m_fpWrite = ::_tfopen(sFileName, _T("r+b"));
+        if (m_fpWrite == nullptr)
+            m_okReadOnly = true;
+    }
+
+    return true;
+}
+
+bool CFloppyStdioImage::Read(long offset, uint8_t* pData, int size)
+{
+    memset(pData, 0, size);
+    if (::fseek(m_fpRead, offset, SEEK_SET) != 0)
+        return false;
+    size_t count = ::fread(pData, 1, size, m_fpRead);
+    if (count == (size_t)size)
+        return true;
+    memset(pData + count, 0, size - count);
+    bool result = (::ferror(m_fpRead) == 0);  // Short read at the end of file is not an error
+    ::clearerr(m_fpRead);
+    return result;
+}
+
+bool CFloppyStdioImage::Write(long offset, const uint8_t* pData, int size)
+{
+    if (m_fpWrite == nullptr)
+        return false;
+    if (::fseek(m_fpWrite, offset, SEEK_SET) != 0)
+        return false;
+    return ::fwrite(pData, 1, size, m_fpWrite) == (size_t)size;
+}
+
+bool CFloppyStdioImage::Flush()
+{
+    if (m_fpWrite == nullptr)
+        return true;
+    return ::fflush(m_fpWrite) == 0;  // Make the changes visible for reading through m_fpRead
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// CFloppyMappedImage
+
+// Image mapped into memory once on open; reads and writes are just copying.
+// Mapping is of the file size at open time, the rare access past it goes to the file directly.
+class CFloppyMappedImage : public CFloppyImage
+{
+public:
+    CFloppyMappedImage();
+    virtual ~CFloppyMappedImage();
+    bool Open(LPCTSTR sFileName, bool okReadOnly);
+    virtual bool Read(long offset, uint8_t* pData, int size);
+    virtual bool Write(long offset, const uint8_t* pData, int size);
+    virtual bool Flush();
+    virtual bool Sync();
+
+private:
+    bool ReadTail(long offset, uint8_t* pData, int size);  // Read past the mapped part of the file
+    bool WriteTail(long offset, const uint8_t* pData, int size);  // Write past the mapped part of the file
+
+private:
+    uint8_t* m_pView;   // Mapped file
+    long m_viewsize;    // Size of the mapped part of the file
+#ifdef _WIN32
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+#else
+    int m_fd;
+#endif
+};
+
+CFloppyMappedImage::CFloppyMappedImage()
+{
+    m_pView = nullptr;
+    m_viewsize = 0;
+#ifdef _WIN32
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+#else
+    m_fd = -1;
+#endif
+}
+
+#ifdef _WIN32
+
+CFloppyMappedImage::~CFloppyMappedImage()
+{
+    if (m_pView != nullptr)
+        ::UnmapViewOfFile(m_pView);
+    if (m_hMapping != NULL)
+        ::CloseHandle(m_hMapping);
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        ::CloseHandle(m_hFile);
+}
+
+bool CFloppyMappedImage::Open(LPCTSTR sFileName, bool okReadOnly)
+{
+    m_okReadOnly = okReadOnly;
+    if (!m_okReadOnly)
+    {
+        m_hFile = ::CreateFile(sFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            m_okReadOnly = true;
+    }
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        m_hFile = ::CreateFile(sFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER filesize;
+    if (!::GetFileSizeEx(m_hFile, &filesize) || filesize.QuadPart == 0 || filesize.QuadPart > 0x7fffffff)
+        return false;  // Empty file can't be mapped
+
+    m_hMapping = ::CreateFileMapping(m_hFile, NULL, m_okReadOnly ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+    if (m_hMapping == NULL)
+        return false;
+    m_pView = (uint8_t*) ::MapViewOfFile(m_hMapping, m_okReadOnly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0);
+    if (m_pView == nullptr)
+        return false;
+    m_viewsize = (long)filesize.QuadPart;
+
+    return true;
+}
+
+bool CFloppyMappedImage::ReadTail(long offset, uint8_t* pData, int size)
+{
+    OVERLAPPED overlapped;  memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    DWORD dwBytesRead = 0;
+    if (::ReadFile(m_hFile, pData, size, &dwBytesRead, &overlapped))
+        return true;  // Short read at the end of file is not an error
+    bool result = (::GetLastError() == ERROR_HANDLE_EOF);
+    memset(pData, 0, size);
+    return result;
+}
+
+bool CFloppyMappedImage::WriteTail(long offset, const uint8_t* pData, int size)
+{
+    OVERLAPPED overlapped;  memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    DWORD dwBytesWritten = 0;
+    return ::WriteFile(m_hFile, pData, size, &dwBytesWritten, &overlapped) && dwBytesWritten == (DWORD)size;
+}
+
+bool CFloppyMappedImage::Flush()
+{
+    if (m_okReadOnly)
+        return true;
+    return ::FlushViewOfFile(m_pView, 0) != FALSE;  // Start writing the changed pages, without waiting for the disk
+}
+
+bool CFloppyMappedImage::Sync()
+{
+    if (m_okReadOnly)
+        return true;
+    bool result = (::FlushViewOfFile(m_pView, 0) != FALSE);
+    if (!::FlushFileBuffers(m_hFile))  // Wait for the view pages and the tail writes to reach the disk
+        result = false;
+    return result;
+}
+
+#else  // POSIX
+
+CFloppyMappedImage::~CFloppyMappedImage()
+{
+    if (m_pView != nullptr)
+        ::munmap(m_pView, m_viewsize);
+    if (m_fd >= 0)
+        ::close(m_fd);
+}
+
+bool CFloppyMappedImage::Open(LPCTSTR sFileName, bool okReadOnly)
+{
+    m_okReadOnly = okReadOnly;
+    if (!m_okReadOnly)
+    {
+        m_fd = ::open(sFileName, O_RDWR);
+        if (m_fd < 0)
+            m_okReadOnly = true;
+    }
+    if (m_fd < 0)
+        m_fd = ::open(sFileName, O_RDONLY);
+    if (m_fd < 0)
+        return false;
+
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0 || st.st_size == 0 || st.st_size > 0x7fffffff)
+        return false;  // Empty file can't be mapped
+
+    void* pView = ::mmap(nullptr, st.st_size, m_okReadOnly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, m_fd, 0);
+    if (pView == MAP_FAILED)
+        return false;
+    m_pView = (uint8_t*)pView;
+    m_viewsize = (long)st.st_size;
+
+    return true;
+}
+
+bool CFloppyMappedImage::ReadTail(long offset, uint8_t* pData, int size)
+{
+    if (::pread(m_fd, pData, size, offset) >= 0)
+        return true;  // Short read at the end of file is not an error
+    memset(pData, 0, size);
+    return false;
+}
+
+bool CFloppyMappedImage::WriteTail(long offset, const uint8_t* pData, int size)
+{
+    return ::pwrite(m_fd, pData, size, offset) == size;
+}
+
+bool CFloppyMappedImage::Flush()
+{
+    if (m_okReadOnly)
+        return true;
+    return ::msync(m_pView, m_viewsize, MS_ASYNC) == 0;  // Start writing the changed pages, without waiting for the disk
+}
+
+bool CFloppyMappedImage::Sync()
+{
+    if (m_okReadOnly)
+        return true;
+    bool result = (::msync(m_pView, m_viewsize, MS_SYNC) == 0);
+    if (::fsync(m_fd) != 0)  // The tail writes
+        result = false;
+    return result;
+}
+
+#endif
+
+bool CFloppyMappedImage::Read(long offset, uint8_t* pData, int size)
+{
+    memset(pData, 0, size);
+    int mapped = (offset < m_viewsize) ? (int)(m_viewsize - offset) : 0;
+    if (mapped > size) mapped = size;
+    if (mapped > 0)
+        memcpy(pData, m_pView + offset, mapped);
+    if (mapped < size)
+        return ReadTail(offset + mapped, pData + mapped, size - mapped);
+    return true;
+}
+
+bool CFloppyMappedImage::Write(long offset, const uint8_t* pData, int size)
+{
+    if (m_okReadOnly)
+        return false;
+    int mapped = (offset < m_viewsize) ? (int)(m_viewsize - offset) : 0;
+    if (mapped > size) mapped = size;
+    if (mapped > 0)
+        memcpy(m_pView + offset, pData, mapped);
+    if (mapped < size)
+        return WriteTail(offset + mapped, pData + mapped, size - mapped);
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// CFloppyOverlayImage
+
+// Read-only base image plus the overlay of changed sectors.
+// The overlay is kept in memory; with the delta file, every overlay sector is also saved there
+// as a record of 4-byte sector number and the sector data, so the changes survive the emulator restart.
+class CFloppyOverlayImage : public CFloppyImage
+{
+public:
+    CFloppyOverlayImage();
+    virtual ~CFloppyOverlayImage();
+    bool Open(LPCTSTR sFileName, LPCTSTR sDeltaFileName);
+    virtual bool Read(long offset, uint8_t* pData, int size);
+    virtual bool Write(long offset, const uint8_t* pData, int size);
+    virtual bool Flush();
+    virtual bool IsOverlay() const { return true; }
+    virtual bool CommitOverlay();
+    virtual bool DiscardOverlay();
+
+private:
+    struct OverlaySector
+    {
+        long deltaoffset;  // Record offset in the delta file
+        uint8_t data[FLOPPY_SECTORSIZE];
+    };
+    typedef std::map<uint32_t, OverlaySector> SectorMap;  // Key is sector number in the image
+
+    bool ClearOverlay();  // false if the delta file can't be truncated, the overlay is kept then
+
+private:
+    CFloppyImage* m_pBase;
+    TCHAR* m_sFileName;     // Base image file name, to open it for writing on commit
+    TCHAR* m_sDeltaFileName;
+    FILE* m_fpDelta;        // Delta file; NULL for in-memory overlay
+    long m_deltasize;       // Delta file size, the offset for the next record
+    SectorMap m_sectors;
+    std::mutex m_mutex;     // Read() and Write() come from different threads
+};
+
+static TCHAR* DuplicateString(LPCTSTR str)
+{
+    TCHAR* result = (TCHAR*) ::malloc((_tcslen(str) + 1) * sizeof(TCHAR));
+    _tcscpy(result, str);
+    return result;
+}
+
+CFloppyOverlayImage::CFloppyOverlayImage()
+{
+    m_okReadOnly = false;
+    m_pBase = nullptr;
+    m_sFileName = m_sDeltaFileName = nullptr;
+    m_fpDelta = nullptr;
+    m_deltasize = 0;
+}
+
+CFloppyOverlayImage::~CFloppyOverlayImage()
+{
+    if (m_fpDelta != nullptr)
+        ::fclose(m_fpDelta);
+    delete m_pBase;
+    ::free(m_sFileName);
+    ::free(m_sDeltaFileName);
+}
+
+bool CFloppyOverlayImage::Open(LPCTSTR sFileName, LPCTSTR sDeltaFileName)
+{
+    m_pBase = CFloppyImage::Open(sFileName, true);
+    if (m_pBase == nullptr)
+        return false;
+    m_sFileName = DuplicateString(sFileName);
+
+    if (sDeltaFileName == nullptr)
+        return true;
+    m_sDeltaFileName = DuplicateString(sDeltaFileName);
+
+    m_fpDelta = ::_tfopen(sDeltaFileName, _T("r+b"));
+    if (m_fpDelta == nullptr)
+        m_fpDelta = ::_tfopen(sDeltaFileName, _T("w+b"));
+    if (m_fpDelta == nullptr)
+        return false;
+
+    // Load the saved overlay; later records of the same sector are not expected but win
+    for (;;)
+    {
+        uint8_t header[4];
+        OverlaySector sector;
+        if (::fread(header, 1, 4, m_fpDelta) != 4 ||
+            ::fread(sector.data, 1, FLOPPY_SECTORSIZE, m_fpDelta) != FLOPPY_SECTORSIZE)
+            break;
+        uint32_t number = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+        sector.deltaoffset = m_deltasize;
+        m_sectors[number] = sector;
+        m_deltasize += 4 + FLOPPY_SECTORSIZE;
+    }
+
+    return true;
+}
+
+bool CFloppyOverlayImage::Read(long offset, uint8_t* pData, int size)
+{
+    bool result = m_pBase->Read(offset, pData, size);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_sectors.empty())
+        return result;
+    uint32_t first = offset / FLOPPY_SECTORSIZE;
+    uint32_t last = (offset + size - 1) / FLOPPY_SECTORSIZE;
+    SectorMap::const_iterator it = m_sectors.lower_bound(first);
+    for (; it != m_sectors.end() && it->first <= last; ++it)
+    {
+        long start = (long)it->first * FLOPPY_SECTORSIZE;
+        long from = (start > offset) ? start : offset;
+        long to = (start + FLOPPY_SECTORSIZE < offset + size) ? start + FLOPPY_SECTORSIZE : offset + size;
+        memcpy(pData + (from - offset), it->second.data + (from - start), to - from);
+    }
+    return result;
+}
+
+// The floppy writer writes whole sectors only.
+// The overlay in memory gets the sectors even if the delta file write fails, so Read() sees them anyway.
+bool CFloppyOverlayImage::Write(long offset, const uint8_t* pData, int size)
+{
+    ASSERT(offset % FLOPPY_SECTORSIZE == 0 && size % FLOPPY_SECTORSIZE == 0);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    bool result = true;
+    for (; size > 0; offset += FLOPPY_SECTORSIZE, pData += FLOPPY_SECTORSIZE, size -= FLOPPY_SECTORSIZE)
+    {
+        uint32_t number = offset / FLOPPY_SECTORSIZE;
+        SectorMap::iterator it = m_sectors.find(number);
+        if (it == m_sectors.end())
+        {
+            it = m_sectors.insert(SectorMap::value_type(number, OverlaySector())).first;
+            it->second.deltaoffset = m_deltasize;
+            m_deltasize += 4 + FLOPPY_SECTORSIZE;
+        }
+        memcpy(it->second.data, pData, FLOPPY_SECTORSIZE);
+
+        if (m_fpDelta != nullptr)
+        {
+            uint8_t header[4] = { (uint8_t)number, (uint8_t)(number >> 8), (uint8_t)(number >> 16), (uint8_t)(number >> 24) };
+            if (::fseek(m_fpDelta, it->second.deltaoffset, SEEK_SET) != 0 ||
+                ::fwrite(header, 1, 4, m_fpDelta) != 4 ||
+                ::fwrite(pData, 1, FLOPPY_SECTORSIZE, m_fpDelta) != FLOPPY_SECTORSIZE)
+                result = false;
+        }
+    }
+    return result;
+}
+
+bool CFloppyOverlayImage::Flush()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fpDelta == nullptr)
+        return true;
+    return ::fflush(m_fpDelta) == 0;
+}
+
+bool CFloppyOverlayImage::CommitOverlay()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    CFloppyImage* pImage = CFloppyImage::Open(m_sFileName);
+    if (pImage == nullptr)
+        return false;
+    if (pImage->IsReadOnly())
+    {
+        delete pImage;
+        return false;
+    }
+    bool okWritten = true;
+    for (SectorMap::const_iterator it = m_sectors.begin(); it != m_sectors.end() && okWritten; ++it)
+        okWritten = pImage->Write((long)it->first * FLOPPY_SECTORSIZE, it->second.data, FLOPPY_SECTORSIZE);
+    if (!pImage->Sync())
+        okWritten = false;
+    delete pImage;  // The base image sees the changes after that
+    if (!okWritten)
+        return false;  // The base image may be changed in part, the overlay keeps all the changes
+
+    return ClearOverlay();  // The overlay kept on error has the same data as the base image now
+}
+
+bool CFloppyOverlayImage::DiscardOverlay()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return ClearOverlay();
+}
+
+bool CFloppyOverlayImage::ClearOverlay()
+{
+    if (m_fpDelta != nullptr)  // Truncate the delta file; the old handle is closed only when the new one is open
+    {
+        if (::fflush(m_fpDelta) != 0)
+            return false;  // Closing the old handle must not write its buffer into the truncated file
+        FILE* fpDelta = ::_tfopen(m_sDeltaFileName, _T("w+b"));
+        if (fpDelta == nullptr)
+            return false;
+        ::fclose(m_fpDelta);
+        m_fpDelta = fpDelta;
+    }
+    m_sectors.clear();
+    m_deltasize = 0;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// CFloppyImage
+
+CFloppyImage* CFloppyImage::Open(LPCTSTR sFileName, bool okReadOnly)
+{
+    CFloppyMappedImage* pMappedImage = new CFloppyMappedImage();
+    if (pMappedImage->Open(sFileName, okReadOnly))
+        return pMappedImage;
+    delete pMappedImage;
+
+    CFloppyStdioImage* pStdioImage = new CFloppyStdioImage();
+    if (pStdioImage->Open(sFileName, okReadOnly))
+        return pStdioImage;
+    delete pStdioImage;
+
+    return nullptr;
+}
+
+CFloppyImage* CFloppyImage::OpenOverlay(LPCTSTR sFileName, LPCTSTR sDeltaFileName)
+{
+    CFloppyOverlayImage* pOverlayImage = new CFloppyOverlayImage();
+    if (pOverlayImage->Open(sFileName, sDeltaFileName))
+        return pOverlayImage;
+    delete pOverlayImage;
+
+    return nullptr;
+}
+
+
+//////////////////////////////////////////////////////////////////////
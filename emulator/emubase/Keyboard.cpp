@@ -48,6 +48,11 @@ void CKeyboard::Periodic()
         m_nTxCounter--;
 }
 
+bool CKeyboard::IsIdle(bool okCanReceive) const
+{
+    return (m_nTxCounter == 0) && (m_nQueueLength == 0 || !okCanReceive);
+}
+
 void CKeyboard::KeyPressed(uint8_t scan)
 {
     PutByteToQueue(scan);
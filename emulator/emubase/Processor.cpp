@@ -13,6 +13,9 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "stdafx.h"
 #include "Processor.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 
 // Timings ///////////////////////////////////////////////////////////
@@ -55,117 +58,445 @@ const int TIMING_ILLEGAL = 110; //TODO
 //////////////////////////////////////////////////////////////////////
 
 
-CProcessor::ExecuteMethodRef* CProcessor::m_pExecuteMethodMap = nullptr;
-
-void CProcessor::Init()
-{
-    ASSERT(m_pExecuteMethodMap == nullptr);
-    m_pExecuteMethodMap = static_cast<CProcessor::ExecuteMethodRef*>(::calloc(65536, sizeof(CProcessor::ExecuteMethodRef)));
-
-    // Сначала заполняем таблицу ссылками на метод ExecuteUNKNOWN
-    RegisterMethodRef( 0000000, 0177777, &CProcessor::ExecuteUNKNOWN );
-
-    RegisterMethodRef( 0000000, 0000000, &CProcessor::ExecuteHALT );
-    RegisterMethodRef( 0000001, 0000001, &CProcessor::ExecuteWAIT );
-    RegisterMethodRef( 0000002, 0000002, &CProcessor::ExecuteRTI );
-    RegisterMethodRef( 0000003, 0000003, &CProcessor::ExecuteBPT );
-    RegisterMethodRef( 0000004, 0000004, &CProcessor::ExecuteIOT );
-    RegisterMethodRef( 0000005, 0000005, &CProcessor::ExecuteRESET );
-    RegisterMethodRef( 0000006, 0000006, &CProcessor::ExecuteRTT );
-    RegisterMethodRef( 0000007, 0000007, &CProcessor::ExecuteMFPT );
-    // RESERVED:       0000010, 0000077
-    RegisterMethodRef( 0000100, 0000177, &CProcessor::ExecuteJMP );
-    RegisterMethodRef( 0000200, 0000207, &CProcessor::ExecuteRTS );  // RTS / RETURN
-    // RESERVED:       0000210, 0000227
-    // SPL             0000230, 0000237
-    RegisterMethodRef( 0000240, 0000240, &CProcessor::ExecuteNOP );
-    RegisterMethodRef( 0000241, 0000257, &CProcessor::ExecuteCCC );
-    RegisterMethodRef( 0000260, 0000260, &CProcessor::ExecuteNOP );
-    RegisterMethodRef( 0000261, 0000277, &CProcessor::ExecuteSCC );
-    RegisterMethodRef( 0000300, 0000377, &CProcessor::ExecuteSWAB );
-    RegisterMethodRef( 0000400, 0000777, &CProcessor::ExecuteBR );
-    RegisterMethodRef( 0001000, 0001377, &CProcessor::ExecuteBNE );
-    RegisterMethodRef( 0001400, 0001777, &CProcessor::ExecuteBEQ );
-    RegisterMethodRef( 0002000, 0002377, &CProcessor::ExecuteBGE );
-    RegisterMethodRef( 0002400, 0002777, &CProcessor::ExecuteBLT );
-    RegisterMethodRef( 0003000, 0003377, &CProcessor::ExecuteBGT );
-    RegisterMethodRef( 0003400, 0003777, &CProcessor::ExecuteBLE );
-    RegisterMethodRef( 0004000, 0004777, &CProcessor::ExecuteJSR );  // JSR / CALL
-    RegisterMethodRef( 0005000, 0005077, &CProcessor::ExecuteCLR );
-    RegisterMethodRef( 0005100, 0005177, &CProcessor::ExecuteCOM );
-    RegisterMethodRef( 0005200, 0005277, &CProcessor::ExecuteINC );
-    RegisterMethodRef( 0005300, 0005377, &CProcessor::ExecuteDEC );
-    RegisterMethodRef( 0005400, 0005477, &CProcessor::ExecuteNEG );
-    RegisterMethodRef( 0005500, 0005577, &CProcessor::ExecuteADC );
-    RegisterMethodRef( 0005600, 0005677, &CProcessor::ExecuteSBC );
-    RegisterMethodRef( 0005700, 0005777, &CProcessor::ExecuteTST );
-    RegisterMethodRef( 0006000, 0006077, &CProcessor::ExecuteROR );
-    RegisterMethodRef( 0006100, 0006177, &CProcessor::ExecuteROL );
-    RegisterMethodRef( 0006200, 0006277, &CProcessor::ExecuteASR );
-    RegisterMethodRef( 0006300, 0006377, &CProcessor::ExecuteASL );
-    // MARK            0006400, 0006477
-    // MFPI            0006500, 0006577
-    // MTPI            0006600, 0006677
-    RegisterMethodRef( 0006700, 0006777, &CProcessor::ExecuteSXT );
-    // RESERVED:       0007000, 0007777
-    RegisterMethodRef( 0010000, 0017777, &CProcessor::ExecuteMOV );
-    RegisterMethodRef( 0020000, 0027777, &CProcessor::ExecuteCMP );
-    RegisterMethodRef( 0030000, 0037777, &CProcessor::ExecuteBIT );
-    RegisterMethodRef( 0040000, 0047777, &CProcessor::ExecuteBIC );
-    RegisterMethodRef( 0050000, 0057777, &CProcessor::ExecuteBIS );
-    RegisterMethodRef( 0060000, 0067777, &CProcessor::ExecuteADD );
-    // MUL             0070000, 0070777
-    // DIV             0071000, 0071777
-    // ASH             0072000, 0072777
-    // ASHC            0073000, 0073777
-    RegisterMethodRef( 0074000, 0074777, &CProcessor::ExecuteXOR );
-    // FADD etc.       0075000, 0075777
-    // RESERVED:       0076000, 0076777
-    RegisterMethodRef( 0077000, 0077777, &CProcessor::ExecuteSOB );
-    RegisterMethodRef( 0100000, 0100377, &CProcessor::ExecuteBPL );
-    RegisterMethodRef( 0100400, 0100777, &CProcessor::ExecuteBMI );
-    RegisterMethodRef( 0101000, 0101377, &CProcessor::ExecuteBHI );
-    RegisterMethodRef( 0101400, 0101777, &CProcessor::ExecuteBLOS );
-    RegisterMethodRef( 0102000, 0102377, &CProcessor::ExecuteBVC );
-    RegisterMethodRef( 0102400, 0102777, &CProcessor::ExecuteBVS );
-    RegisterMethodRef( 0103000, 0103377, &CProcessor::ExecuteBHIS );  // BCC, BHIS
-    RegisterMethodRef( 0103400, 0103777, &CProcessor::ExecuteBLO );   // BCS, BLO
-    RegisterMethodRef( 0104000, 0104377, &CProcessor::ExecuteEMT );
-    RegisterMethodRef( 0104400, 0104777, &CProcessor::ExecuteTRAP );
-    RegisterMethodRef( 0105000, 0105077, &CProcessor::ExecuteCLR );  // CLRB
-    RegisterMethodRef( 0105100, 0105177, &CProcessor::ExecuteCOM );  // COMB
-    RegisterMethodRef( 0105200, 0105277, &CProcessor::ExecuteINC );  // INCB
-    RegisterMethodRef( 0105300, 0105377, &CProcessor::ExecuteDEC );  // DECB
-    RegisterMethodRef( 0105400, 0105477, &CProcessor::ExecuteNEG );  // NEGB
-    RegisterMethodRef( 0105500, 0105577, &CProcessor::ExecuteADC );  // ADCB
-    RegisterMethodRef( 0105600, 0105677, &CProcessor::ExecuteSBC );  // SBCB
-    RegisterMethodRef( 0105700, 0105777, &CProcessor::ExecuteTSTB );  // TSTB
-    RegisterMethodRef( 0106000, 0106077, &CProcessor::ExecuteROR );  // RORB
-    RegisterMethodRef( 0106100, 0106177, &CProcessor::ExecuteROL );  // ROLB
-    RegisterMethodRef( 0106200, 0106277, &CProcessor::ExecuteASR );  // ASRB
-    RegisterMethodRef( 0106300, 0106377, &CProcessor::ExecuteASL );  // ASLB
-    RegisterMethodRef( 0106400, 0106477, &CProcessor::ExecuteMTPS );
-    // MFPD            0106500, 0106577
-    // MTPD            0106600, 0106677
-    RegisterMethodRef( 0106700, 0106777, &CProcessor::ExecuteMFPS );
-    RegisterMethodRef( 0110000, 0117777, &CProcessor::ExecuteMOVB );  // MOVB
-    RegisterMethodRef( 0120000, 0127777, &CProcessor::ExecuteCMP );  // CMPB
-    RegisterMethodRef( 0130000, 0137777, &CProcessor::ExecuteBIT );  // BITB
-    RegisterMethodRef( 0140000, 0147777, &CProcessor::ExecuteBIC );  // BICB
-    RegisterMethodRef( 0150000, 0157777, &CProcessor::ExecuteBIS );  // BISB
-    RegisterMethodRef( 0160000, 0167777, &CProcessor::ExecuteSUB );
-    // FPP             0170000, 0177777
-}
-
-void CProcessor::Done()
-{
-    ::free(m_pExecuteMethodMap);  m_pExecuteMethodMap = nullptr;
-}
-
-void CProcessor::RegisterMethodRef(uint16_t start, uint16_t end, CProcessor::ExecuteMethodRef methodref)
-{
-    for (size_t opcode = start; opcode <= end; opcode++ )
-        m_pExecuteMethodMap[opcode] = methodref;
+// Opcode classes, index in m_ExecuteMethodTable
+enum OpcodeClass
+{
+    OPCLASS_UNKNOWN,  // Must be zero
+    OPCLASS_HALT,
+    OPCLASS_WAIT,
+    OPCLASS_RTI,
+    OPCLASS_BPT,
+    OPCLASS_IOT,
+    OPCLASS_RESET,
+    OPCLASS_RTT,
+    OPCLASS_MFPT,
+    OPCLASS_JMP,
+    OPCLASS_RTS,
+    OPCLASS_NOP,
+    OPCLASS_CCC,
+    OPCLASS_SCC,
+    OPCLASS_SWAB,
+    OPCLASS_BR,
+    OPCLASS_BNE,
+    OPCLASS_BEQ,
+    OPCLASS_BGE,
+    OPCLASS_BLT,
+    OPCLASS_BGT,
+    OPCLASS_BLE,
+    OPCLASS_JSR,
+    OPCLASS_CLR,
+    OPCLASS_COM,
+    OPCLASS_INC,
+    OPCLASS_DEC,
+    OPCLASS_NEG,
+    OPCLASS_ADC,
+    OPCLASS_SBC,
+    OPCLASS_TST,
+    OPCLASS_ROR,
+    OPCLASS_ROL,
+    OPCLASS_ASR,
+    OPCLASS_ASL,
+    OPCLASS_SXT,
+    OPCLASS_MOV,
+    OPCLASS_CMP,
+    OPCLASS_BIT,
+    OPCLASS_BIC,
+    OPCLASS_BIS,
+    OPCLASS_ADD,
+    OPCLASS_XOR,
+    OPCLASS_SOB,
+    OPCLASS_BPL,
+    OPCLASS_BMI,
+    OPCLASS_BHI,
+    OPCLASS_BLOS,
+    OPCLASS_BVC,
+    OPCLASS_BVS,
+    OPCLASS_BHIS,
+    OPCLASS_BLO,
+    OPCLASS_EMT,
+    OPCLASS_TRAP,
+    OPCLASS_TSTB,
+    OPCLASS_MTPS,
+    OPCLASS_MFPS,
+    OPCLASS_MOVB,
+    OPCLASS_SUB,
+    OPCLASS_COUNT,
+    OPCLASS_GROUP0000 = 0200,  // 0000000-0000077, see OpcodeClassSubMap[0]
+    OPCLASS_GROUP0002 = 0201,  // 0000200-0000277, see OpcodeClassSubMap[1]
+};
+
+#define OPC4(c)   OPCLASS_##c, OPCLASS_##c, OPCLASS_##c, OPCLASS_##c
+#define OPC8(c)   OPC4(c), OPC4(c)
+#define OPC16(c)  OPC8(c), OPC8(c)
+#define OPC32(c)  OPC16(c), OPC16(c)
+#define OPC64(c)  OPC32(c), OPC32(c)
+
+// Opcode class by opcode bits 6..15; 0000000-0000077 and 0000200-0000277 need sub-table
+static const uint8_t OpcodeClassMap[1024] =
+{
+    OPCLASS_GROUP0000,                          // 0000000 - 0000077
+    OPCLASS_JMP,                                // 0000100 - 0000177
+    OPCLASS_GROUP0002,                          // 0000200 - 0000277  RTS / RETURN
+    OPCLASS_SWAB,                               // 0000300 - 0000377
+    OPC4(BR),                                   // 0000400 - 0000777
+    OPC4(BNE),                                  // 0001000 - 0001377
+    OPC4(BEQ),                                  // 0001400 - 0001777
+    OPC4(BGE),                                  // 0002000 - 0002377
+    OPC4(BLT),                                  // 0002400 - 0002777
+    OPC4(BGT),                                  // 0003000 - 0003377
+    OPC4(BLE),                                  // 0003400 - 0003777
+    OPC8(JSR),                                  // 0004000 - 0004777  JSR / CALL
+    OPCLASS_CLR,                                // 0005000 - 0005077
+    OPCLASS_COM,                                // 0005100 - 0005177
+    OPCLASS_INC,                                // 0005200 - 0005277
+    OPCLASS_DEC,                                // 0005300 - 0005377
+    OPCLASS_NEG,                                // 0005400 - 0005477
+    OPCLASS_ADC,                                // 0005500 - 0005577
+    OPCLASS_SBC,                                // 0005600 - 0005677
+    OPCLASS_TST,                                // 0005700 - 0005777
+    OPCLASS_ROR,                                // 0006000 - 0006077
+    OPCLASS_ROL,                                // 0006100 - 0006177
+    OPCLASS_ASR,                                // 0006200 - 0006277
+    OPCLASS_ASL,                                // 0006300 - 0006377
+    OPCLASS_UNKNOWN, OPCLASS_UNKNOWN, OPCLASS_UNKNOWN,  // 0006400 - 0006677  MARK, MFPI, MTPI
+    OPCLASS_SXT,                                // 0006700 - 0006777
+    OPC8(UNKNOWN),                              // 0007000 - 0007777  RESERVED
+    OPC64(MOV),                                 // 0010000 - 0017777
+    OPC64(CMP),                                 // 0020000 - 0027777
+    OPC64(BIT),                                 // 0030000 - 0037777
+    OPC64(BIC),                                 // 0040000 - 0047777
+    OPC64(BIS),                                 // 0050000 - 0057777
+    OPC64(ADD),                                 // 0060000 - 0067777
+    OPC32(UNKNOWN),                             // 0070000 - 0073777  MUL, DIV, ASH, ASHC
+    OPC8(XOR),                                  // 0074000 - 0074777
+    OPC16(UNKNOWN),                             // 0075000 - 0076777  FADD etc., RESERVED
+    OPC8(SOB),                                  // 0077000 - 0077777
+    OPC4(BPL),                                  // 0100000 - 0100377
+    OPC4(BMI),                                  // 0100400 - 0100777
+    OPC4(BHI),                                  // 0101000 - 0101377
+    OPC4(BLOS),                                 // 0101400 - 0101777
+    OPC4(BVC),                                  // 0102000 - 0102377
+    OPC4(BVS),                                  // 0102400 - 0102777
+    OPC4(BHIS),                                 // 0103000 - 0103377  BCC, BHIS
+    OPC4(BLO),                                  // 0103400 - 0103777  BCS, BLO
+    OPC4(EMT),                                  // 0104000 - 0104377
+    OPC4(TRAP),                                 // 0104400 - 0104777
+    OPCLASS_CLR,                                // 0105000 - 0105077  CLRB
+    OPCLASS_COM,                                // 0105100 - 0105177  COMB
+    OPCLASS_INC,                                // 0105200 - 0105277  INCB
+    OPCLASS_DEC,                                // 0105300 - 0105377  DECB
+    OPCLASS_NEG,                                // 0105400 - 0105477  NEGB
+    OPCLASS_ADC,                                // 0105500 - 0105577  ADCB
+    OPCLASS_SBC,                                // 0105600 - 0105677  SBCB
+    OPCLASS_TSTB,                               // 0105700 - 0105777
+    OPCLASS_ROR,                                // 0106000 - 0106077  RORB
+    OPCLASS_ROL,                                // 0106100 - 0106177  ROLB
+    OPCLASS_ASR,                                // 0106200 - 0106277  ASRB
+    OPCLASS_ASL,                                // 0106300 - 0106377  ASLB
+    OPCLASS_MTPS,                               // 0106400 - 0106477
+    OPCLASS_UNKNOWN, OPCLASS_UNKNOWN,           // 0106500 - 0106677  MFPD, MTPD
+    OPCLASS_MFPS,                               // 0106700 - 0106777
+    OPC8(UNKNOWN),                              // 0107000 - 0107777  RESERVED
+    OPC64(MOVB),                                // 0110000 - 0117777
+    OPC64(CMP),                                 // 0120000 - 0127777  CMPB
+    OPC64(BIT),                                 // 0130000 - 0137777  BITB
+    OPC64(BIC),                                 // 0140000 - 0147777  BICB
+    OPC64(BIS),                                 // 0150000 - 0157777  BISB
+    OPC64(SUB),                                 // 0160000 - 0167777
+    OPC64(UNKNOWN),                             // 0170000 - 0177777  FPP
+};
+static_assert(sizeof(OpcodeClassMap) == 1024, "Wrong OpcodeClassMap size");
+
+// Opcode class by opcode bits 0..5, for opcodes 0000000-0000077 and 0000200-0000277
+static const uint8_t OpcodeClassSubMap[2][64] =
+{
+    {
+        OPCLASS_HALT,                           // 0000000
+        OPCLASS_WAIT,                           // 0000001
+        OPCLASS_RTI,                            // 0000002
+        OPCLASS_BPT,                            // 0000003
+        OPCLASS_IOT,                            // 0000004
+        OPCLASS_RESET,                          // 0000005
+        OPCLASS_RTT,                            // 0000006
+        OPCLASS_MFPT,                           // 0000007
+        OPC32(UNKNOWN), OPC16(UNKNOWN), OPC8(UNKNOWN),  // 0000010 - 0000077  RESERVED
+    },
+    {
+        OPC8(RTS),                              // 0000200 - 0000207  RTS / RETURN
+        OPC16(UNKNOWN), OPC8(UNKNOWN),          // 0000210 - 0000237  RESERVED, SPL
+        OPCLASS_NOP,                            // 0000240
+        OPC8(CCC), OPC4(CCC), OPCLASS_CCC, OPCLASS_CCC, OPCLASS_CCC,  // 0000241 - 0000257
+        OPCLASS_NOP,                            // 0000260
+        OPC8(SCC), OPC4(SCC), OPCLASS_SCC, OPCLASS_SCC, OPCLASS_SCC,  // 0000261 - 0000277
+    },
+};
+
+#undef OPC4
+#undef OPC8
+#undef OPC16
+#undef OPC32
+#undef OPC64
+
+// Find opcode class for the instruction, see OpcodeClass enum
+static inline uint8_t GetOpcodeClass(uint16_t instruction)
+{
+    uint8_t opclass = OpcodeClassMap[instruction >> 6];
+    if (opclass & 0200)
+        opclass = OpcodeClassSubMap[opclass & 1][instruction & 077];
+    return opclass;
+}
+
+// Operations for ExecuteDoubleOperand() and ExecuteSingleOperand()
+enum DoubleOperandOp
+{
+    DOUBLEOP_MOV, DOUBLEOP_CMP, DOUBLEOP_BIT, DOUBLEOP_BIC, DOUBLEOP_BIS, DOUBLEOP_ADD, DOUBLEOP_SUB,
+};
+enum SingleOperandOp
+{
+    SINGLEOP_CLR, SINGLEOP_INC, SINGLEOP_DEC, SINGLEOP_TST, SINGLEOP_XOR,
+};
+
+// Rows of the specialized variants in m_ExecuteMethodTable, in the table order
+enum DoubleOperandRow
+{
+    DOUBLEROW_MOV, DOUBLEROW_MOVB, DOUBLEROW_CMP, DOUBLEROW_CMPB, DOUBLEROW_BIT, DOUBLEROW_BITB,
+    DOUBLEROW_BIC, DOUBLEROW_BICB, DOUBLEROW_BIS, DOUBLEROW_BISB, DOUBLEROW_ADD, DOUBLEROW_SUB,
+    DOUBLEROW_COUNT,
+};
+enum SingleOperandRow
+{
+    SINGLEROW_CLR, SINGLEROW_CLRB, SINGLEROW_INC, SINGLEROW_INCB, SINGLEROW_DEC, SINGLEROW_DECB,
+    SINGLEROW_TST, SINGLEROW_TSTB, SINGLEROW_XOR,
+    SINGLEROW_COUNT,
+};
+
+// Index in m_ExecuteMethodTable: opcode class, or the variant specialized by address modes
+enum ExecuteMethodIndex
+{
+    EXECMETHOD_DOUBLEOP = OPCLASS_COUNT,  // Row by DoubleOperandRow, 64 variants by source mode * 8 + destination mode
+    EXECMETHOD_SINGLEOP = EXECMETHOD_DOUBLEOP + DOUBLEROW_COUNT * 64,  // Row by SingleOperandRow, 8 variants by destination mode
+    EXECMETHOD_COUNT = EXECMETHOD_SINGLEOP + SINGLEROW_COUNT * 8,
+};
+
+// Find implementation for the instruction, see ExecuteMethodIndex
+static uint16_t GetExecuteMethod(uint16_t instruction, uint8_t opclass)
+{
+    bool isbyte = (instruction & 0100000) != 0;
+    int row = -1;
+    switch (opclass)
+    {
+    case OPCLASS_MOV:   row = DOUBLEROW_MOV;  break;
+    case OPCLASS_MOVB:  row = DOUBLEROW_MOVB;  break;
+    case OPCLASS_CMP:   row = isbyte ? DOUBLEROW_CMPB : DOUBLEROW_CMP;  break;
+    case OPCLASS_BIT:   row = isbyte ? DOUBLEROW_BITB : DOUBLEROW_BIT;  break;
+    case OPCLASS_BIC:   row = isbyte ? DOUBLEROW_BICB : DOUBLEROW_BIC;  break;
+    case OPCLASS_BIS:   row = isbyte ? DOUBLEROW_BISB : DOUBLEROW_BIS;  break;
+    case OPCLASS_ADD:   row = DOUBLEROW_ADD;  break;
+    case OPCLASS_SUB:   row = DOUBLEROW_SUB;  break;
+    }
+    if (row >= 0)
+        return (uint16_t)(EXECMETHOD_DOUBLEOP + row * 64 + (((instruction >> 6) & 070) | ((instruction >> 3) & 07)));
+
+    switch (opclass)
+    {
+    case OPCLASS_CLR:   row = isbyte ? SINGLEROW_CLRB : SINGLEROW_CLR;  break;
+    case OPCLASS_INC:   row = isbyte ? SINGLEROW_INCB : SINGLEROW_INC;  break;
+    case OPCLASS_DEC:   row = isbyte ? SINGLEROW_DECB : SINGLEROW_DEC;  break;
+    case OPCLASS_TST:   row = SINGLEROW_TST;  break;
+    case OPCLASS_TSTB:  row = SINGLEROW_TSTB;  break;
+    case OPCLASS_XOR:   row = SINGLEROW_XOR;  break;
+    }
+    if (row >= 0)
+        return (uint16_t)(EXECMETHOD_SINGLEOP + row * 8 + ((instruction >> 3) & 07));
+
+    return opclass;
+}
+
+// Length of the instruction in bytes, for the instructions that may be inside a translated block
+static uint16_t GetInstructionLength(uint16_t instruction, uint8_t opclass)
+{
+    // Extra word for index in modes 6, 7 and for immediate or absolute address in modes 2, 3 with PC
+    static const uint16_t OperandLength[64] =
+    {
+        0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 2,  0, 0, 0, 0, 0, 0, 0, 2,
+        0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,
+        2, 2, 2, 2, 2, 2, 2, 2,  2, 2, 2, 2, 2, 2, 2, 2,
+    };
+    switch (opclass)
+    {
+    case OPCLASS_NOP: case OPCLASS_CCC: case OPCLASS_SCC:
+        return 2;
+    case OPCLASS_MOV: case OPCLASS_CMP: case OPCLASS_BIT: case OPCLASS_BIC: case OPCLASS_BIS:
+    case OPCLASS_ADD: case OPCLASS_MOVB: case OPCLASS_SUB:
+        return 2 + OperandLength[(instruction >> 6) & 077] + OperandLength[instruction & 077];
+    default:  // One operand instructions, XOR
+        return 2 + OperandLength[instruction & 077];
+    }
+}
+
+// The translated block ends after the instruction that may jump, trap, wait or change PSW priority
+static bool IsBlockEnd(uint16_t instruction, uint8_t opclass)
+{
+    switch (opclass)
+    {
+    case OPCLASS_NOP: case OPCLASS_CCC: case OPCLASS_SCC:
+        return false;
+    case OPCLASS_SWAB: case OPCLASS_CLR: case OPCLASS_COM: case OPCLASS_INC: case OPCLASS_DEC:
+    case OPCLASS_NEG: case OPCLASS_ADC: case OPCLASS_SBC: case OPCLASS_TST: case OPCLASS_ROR:
+    case OPCLASS_ROL: case OPCLASS_ASR: case OPCLASS_ASL: case OPCLASS_SXT: case OPCLASS_TSTB:
+    case OPCLASS_MFPS: case OPCLASS_MOV: case OPCLASS_CMP: case OPCLASS_BIT: case OPCLASS_BIC:
+    case OPCLASS_BIS: case OPCLASS_ADD: case OPCLASS_XOR: case OPCLASS_MOVB: case OPCLASS_SUB:
+        return (instruction & 077) == 007;  // Destination is PC
+    default:  // Branches, JMP, JSR, RTS, SOB, traps, HALT, WAIT, RESET, RTI, RTT, MTPS, unknown
+        return true;
+    }
+}
+
+#define EXEC_DOUBLEOP_SRC(op, isbyte, s) \
+    &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 0>, &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 1>, \
+    &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 2>, &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 3>, \
+    &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 4>, &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 5>, \
+    &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 6>, &CProcessor::ExecuteDoubleOperand<op, isbyte, s, 7>
+#define EXEC_DOUBLEOP(op, isbyte) \
+    EXEC_DOUBLEOP_SRC(op, isbyte, 0), EXEC_DOUBLEOP_SRC(op, isbyte, 1), EXEC_DOUBLEOP_SRC(op, isbyte, 2), \
+    EXEC_DOUBLEOP_SRC(op, isbyte, 3), EXEC_DOUBLEOP_SRC(op, isbyte, 4), EXEC_DOUBLEOP_SRC(op, isbyte, 5), \
+    EXEC_DOUBLEOP_SRC(op, isbyte, 6), EXEC_DOUBLEOP_SRC(op, isbyte, 7)
+#define EXEC_SINGLEOP(op, isbyte) \
+    &CProcessor::ExecuteSingleOperand<op, isbyte, 0>, &CProcessor::ExecuteSingleOperand<op, isbyte, 1>, \
+    &CProcessor::ExecuteSingleOperand<op, isbyte, 2>, &CProcessor::ExecuteSingleOperand<op, isbyte, 3>, \
+    &CProcessor::ExecuteSingleOperand<op, isbyte, 4>, &CProcessor::ExecuteSingleOperand<op, isbyte, 5>, \
+    &CProcessor::ExecuteSingleOperand<op, isbyte, 6>, &CProcessor::ExecuteSingleOperand<op, isbyte, 7>
+
+// Command implementation methods, see ExecuteMethodIndex
+const CProcessor::ExecuteMethodRef CProcessor::m_ExecuteMethodTable[] =
+{
+    &CProcessor::ExecuteUNKNOWN,
+    &CProcessor::ExecuteHALT,
+    &CProcessor::ExecuteWAIT,
+    &CProcessor::ExecuteRTI,
+    &CProcessor::ExecuteBPT,
+    &CProcessor::ExecuteIOT,
+    &CProcessor::ExecuteRESET,
+    &CProcessor::ExecuteRTT,
+    &CProcessor::ExecuteMFPT,
+    &CProcessor::ExecuteJMP,
+    &CProcessor::ExecuteRTS,
+    &CProcessor::ExecuteNOP,
+    &CProcessor::ExecuteCCC,
+    &CProcessor::ExecuteSCC,
+    &CProcessor::ExecuteSWAB,
+    &CProcessor::ExecuteBR,
+    &CProcessor::ExecuteBNE,
+    &CProcessor::ExecuteBEQ,
+    &CProcessor::ExecuteBGE,
+    &CProcessor::ExecuteBLT,
+    &CProcessor::ExecuteBGT,
+    &CProcessor::ExecuteBLE,
+    &CProcessor::ExecuteJSR,
+    &CProcessor::ExecuteUNKNOWN,  // CLR, see ExecuteMethodIndex
+    &CProcessor::ExecuteCOM,
+    &CProcessor::ExecuteUNKNOWN,  // INC, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // DEC, see ExecuteMethodIndex
+    &CProcessor::ExecuteNEG,
+    &CProcessor::ExecuteADC,
+    &CProcessor::ExecuteSBC,
+    &CProcessor::ExecuteUNKNOWN,  // TST, see ExecuteMethodIndex
+    &CProcessor::ExecuteROR,
+    &CProcessor::ExecuteROL,
+    &CProcessor::ExecuteASR,
+    &CProcessor::ExecuteASL,
+    &CProcessor::ExecuteSXT,
+    &CProcessor::ExecuteUNKNOWN,  // MOV, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // CMP, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // BIT, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // BIC, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // BIS, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // ADD, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // XOR, see ExecuteMethodIndex
+    &CProcessor::ExecuteSOB,
+    &CProcessor::ExecuteBPL,
+    &CProcessor::ExecuteBMI,
+    &CProcessor::ExecuteBHI,
+    &CProcessor::ExecuteBLOS,
+    &CProcessor::ExecuteBVC,
+    &CProcessor::ExecuteBVS,
+    &CProcessor::ExecuteBHIS,
+    &CProcessor::ExecuteBLO,
+    &CProcessor::ExecuteEMT,
+    &CProcessor::ExecuteTRAP,
+    &CProcessor::ExecuteUNKNOWN,  // TSTB, see ExecuteMethodIndex
+    &CProcessor::ExecuteMTPS,
+    &CProcessor::ExecuteMFPS,
+    &CProcessor::ExecuteUNKNOWN,  // MOVB, see ExecuteMethodIndex
+    &CProcessor::ExecuteUNKNOWN,  // SUB, see ExecuteMethodIndex
+    // EXECMETHOD_DOUBLEOP, by DoubleOperandRow
+    EXEC_DOUBLEOP(DOUBLEOP_MOV, false),
+    EXEC_DOUBLEOP(DOUBLEOP_MOV, true),
+    EXEC_DOUBLEOP(DOUBLEOP_CMP, false),
+    EXEC_DOUBLEOP(DOUBLEOP_CMP, true),
+    EXEC_DOUBLEOP(DOUBLEOP_BIT, false),
+    EXEC_DOUBLEOP(DOUBLEOP_BIT, true),
+    EXEC_DOUBLEOP(DOUBLEOP_BIC, false),
+    EXEC_DOUBLEOP(DOUBLEOP_BIC, true),
+    EXEC_DOUBLEOP(DOUBLEOP_BIS, false),
+    EXEC_DOUBLEOP(DOUBLEOP_BIS, true),
+    EXEC_DOUBLEOP(DOUBLEOP_ADD, false),
+    EXEC_DOUBLEOP(DOUBLEOP_SUB, false),
+    // EXECMETHOD_SINGLEOP, by SingleOperandRow
+    EXEC_SINGLEOP(SINGLEOP_CLR, false),
+    EXEC_SINGLEOP(SINGLEOP_CLR, true),
+    EXEC_SINGLEOP(SINGLEOP_INC, false),
+    EXEC_SINGLEOP(SINGLEOP_INC, true),
+    EXEC_SINGLEOP(SINGLEOP_DEC, false),
+    EXEC_SINGLEOP(SINGLEOP_DEC, true),
+    EXEC_SINGLEOP(SINGLEOP_TST, false),
+    EXEC_SINGLEOP(SINGLEOP_TST, true),
+    EXEC_SINGLEOP(SINGLEOP_XOR, false),
+};
+
+#undef EXEC_DOUBLEOP_SRC
+#undef EXEC_DOUBLEOP
+#undef EXEC_SINGLEOP
+
+// Interrupt requests allowed by PSW priority: keyboard below 5, vblank and VIRQ below 4, timer below 6
+const uint16_t CProcessor::m_intrqPriorityMask[8] =
+{
+    0x1fff, 0x1fff, 0x1fff, 0x1fff,  // 0..3: all requests
+    0x0bff,  // 4: no vblank, no VIRQ
+    0x09ff,  // 5: no keyboard
+    0x01ff,  // 6: no timer
+    0x01ff,  // 7: traps only
+};
+
+// Interrupt vectors by INTRQ_XXX bit number; HALT and VIRQ are processed separately
+const uint16_t CProcessor::m_intrqVector[13] =
+{
+    0,        // HALT
+    0000014,  // BPT
+    0000020,  // IOT
+    0000030,  // EMT
+    0000034,  // TRAP
+    0000000,  // Hangup
+    0000010,  // Reserved instruction: JMP / JSR wrong mode
+    0000010,  // Reserved instruction
+    0000014,  // T-bit
+    0000130,  // Keyboard 7004, IRQ5
+    0000064,  // Vblank, IRQ2
+    0000100,  // Timer, IRQ11
+    0,        // VIRQ
+};
+
+// Number of the lowest set bit, value must be non-zero
+static inline int CountTrailingZeros(uint32_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int)index;
+#else
+    return __builtin_ctz(value);
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -177,19 +508,34 @@ CProcessor::CProcessor(CMotherboard* pBoard)
     m_pBoard = pBoard;
     ::memset(m_R, 0, sizeof(m_R));
     m_psw = 0340;
+    m_flagsop = FLAGS_PSW;
+    m_flagssign = m_flagsres = m_flagsa = m_flagsb = 0;
     m_okStopped = true;
     m_internalTick = 0;
+    m_cyclesLeft = 0;
     m_waitmode = false;
     m_stepmode = false;
-    m_RPLYrq = m_RSVDrq = m_RSVD4rq = m_TBITrq = m_HALTrq = m_RPL2rq = m_IRQ5rq = m_IRQ2rq = m_IRQ11rq = false;
-    m_BPT_rq = m_IOT_rq = m_EMT_rq = m_TRAPrq = false;
+    m_okTranslation = true;
+    m_okLockstep = m_okDiverged = m_okLockstepLog = false;
+    m_lockstepwritecount = 0;
+    m_intrq = 0;
 
     m_instruction = m_instructionpc = 0;
     m_regsrc = m_methsrc = 0;
     m_regdest = m_methdest = 0;
     m_addrsrc = m_addrdest = 0;
-    m_virqrq = 0;
+    m_method = 0;
+    m_virqmask = 0;
     memset(m_virq, 0, sizeof(m_virq));
+
+    m_blockgeneration = 0;
+    m_codeversion = 0;
+    for (int i = 0; i < BLOCKCACHE_SIZE; i++)
+        m_blockcache[i].address = 0177777;
+    for (int window = 0; window < 8; window++)
+        m_codewindow[window] = window << 13;
+    memset(m_pagegeneration, 0, sizeof(m_pagegeneration));
+    memset(m_codemap, 0, sizeof(m_codemap));
 }
 
 void CProcessor::Start()
@@ -197,9 +543,8 @@ void CProcessor::Start()
     m_okStopped = false;
     m_stepmode = false;
     m_waitmode = false;
-    m_RPLYrq = m_RSVDrq = m_RSVD4rq = m_TBITrq = m_HALTrq = m_RPL2rq = m_IRQ5rq = m_IRQ2rq = m_IRQ11rq = false;
-    m_BPT_rq = m_IOT_rq = m_EMT_rq = m_TRAPrq = false;
-    m_virqrq = 0;  memset(m_virq, 0, sizeof(m_virq));
+    m_intrq = 0;
+    m_virqmask = 0;  memset(m_virq, 0, sizeof(m_virq));
 
     // "Turn On" interrupt processing
     uint16_t pc = 0172000;
@@ -214,11 +559,10 @@ void CProcessor::Stop()
 
     m_stepmode = false;
     m_waitmode = false;
-    m_psw = 0340;
+    SetPSW(0340);
     m_internalTick = 0;
-    m_RPLYrq = m_RSVDrq = m_RSVD4rq = m_TBITrq = m_HALTrq = m_RPL2rq = m_IRQ5rq = m_IRQ2rq = m_IRQ11rq = false;
-    m_BPT_rq = m_IOT_rq = m_EMT_rq = m_TRAPrq = false;
-    m_virqrq = 0;  memset(m_virq, 0, sizeof(m_virq));
+    m_intrq = 0;
+    m_virqmask = 0;  memset(m_virq, 0, sizeof(m_virq));
 }
 
 void CProcessor::Execute()
@@ -230,46 +574,189 @@ void CProcessor::Execute()
         m_internalTick--;
         return;
     }
+
+    ExecuteInstruction();
+}
+
+// Execute the given number of CPU ticks; same as calling Execute() that many times.
+// Returns number of ticks the last started instruction still needs to finish.
+int CProcessor::ExecuteCycles(int cycles)
+{
+    if (m_okStopped) return 0;  // Processor is stopped - nothing to do
+
+    m_cyclesLeft = cycles;
+    for (;;)
+    {
+        if (m_internalTick >= m_cyclesLeft)
+        {
+            m_internalTick -= m_cyclesLeft;
+            m_cyclesLeft = 0;
+            return m_internalTick;
+        }
+
+        m_cyclesLeft -= m_internalTick + 1;  // Ticks of the previous instruction plus the first tick of the next one
+        if (m_okTranslation)
+            ExecuteBlock();
+        else
+            ExecuteInstruction();
+
+        if (m_okDiverged)  // Lockstep check failed: stop right after the instruction, m_cyclesLeft ticks left
+            return m_internalTick;
+    }
+}
+
+void CProcessor::FlushDecodeCache()
+{
+    m_codeversion++;
+    m_blockgeneration++;
+    if (m_blockgeneration == 0)  // Generation counter wrapped, have to clear all the entries
+    {
+        for (int i = 0; i < BLOCKCACHE_SIZE; i++)
+            m_blockcache[i].address = 0177777;
+    }
+    memset(m_codemap, 0, sizeof(m_codemap));
+}
+
+void CProcessor::InvalidateCodePage(uint32_t codeaddress)
+{
+    m_codeversion++;
+    m_pagegeneration[codeaddress >> 8]++;
+    if (m_pagegeneration[codeaddress >> 8] == 0)  // Generation counter wrapped, old blocks could look valid again
+        FlushDecodeCache();
+}
+
+void CProcessor::ExecuteInstruction()
+{
     m_internalTick = TIMING_ILLEGAL;  // ANYTHING UNKNOWN
 
-    m_RPLYrq = false;
+    m_intrq &= ~INTRQ_RPLY;
 
     if (!m_waitmode)
     {
         m_instructionpc = m_R[7];  // Store address of the current instruction
         FetchInstruction();  // Read next instruction from memory
-        if (!m_RPLYrq)
+        if ((m_intrq & INTRQ_RPLY) == 0)
         {
             TranslateInstruction();  // Execute next instruction
             if (m_internalTick > 0) m_internalTick--;  // Count current tick too
         }
     }
 
+    ProcessInterrupts();
+}
+
+// Same as ExecuteInstruction() but goes on with the next instructions of the translated block, and then
+// with the next translated blocks, while there are cycles left and nothing to do between the instructions
+void CProcessor::ExecuteBlock()
+{
+    Block* pBlock = ((m_R[7] & 1) == 0 && !m_waitmode) ? FindBlock(m_R[7]) : nullptr;
+    if (pBlock == nullptr)
+    {
+        ExecuteInstruction();  // Translates the block for the next time
+        return;
+    }
+
+    if (m_okLockstep)
+        LockstepBegin();  // Before RPLY reset, the interpreter does it for every instruction
+    m_intrq &= ~INTRQ_RPLY;
+
+    uint32_t codeversion = m_codeversion;
+    const BlockInstruction* pInstr = pBlock->instructions;
+    const BlockInstruction* pEnd = pInstr + pBlock->length;
+    for (;;)
+    {
+        if (m_okLockstepLog && !CheckBlockInstruction(*pInstr))
+        {
+            m_okLockstepLog = false;
+            FlushDecodeCache();
+            ExecuteInstruction();  // The interpreter is the reference
+            return;
+        }
+
+        m_internalTick = TIMING_ILLEGAL;  // ANYTHING UNKNOWN
+
+        m_instructionpc = pInstr->address;
+        m_instruction = pInstr->instruction;
+        m_method = pInstr->method;
+        m_regdest = pInstr->regdest;  m_methdest = pInstr->methdest;
+        m_regsrc = pInstr->regsrc;  m_methsrc = pInstr->methsrc;
+        SetPC(pInstr->address + 2);
+
+        ExecuteMethodRef methodref = m_ExecuteMethodTable[m_method];
+        (this->*methodref)();  // Call command implementation method
+        if (m_internalTick > 0) m_internalTick--;  // Count current tick too
+
+        if (m_internalTick >= m_cyclesLeft)
+            break;
+        // Interrupt processing should have nothing to do
+        if (m_stepmode || m_waitmode || (m_psw & PSW_T) != 0 ||
+            (m_intrq & m_intrqPriorityMask[(m_psw & 0340) >> 5]) != 0)
+            break;
+        ++pInstr;
+        bool okValid = true;
+        if (m_codeversion != codeversion)  // Code written or remapped, the rest of the block may be outdated
+        {
+            codeversion = m_codeversion;
+            okValid = IsBlockValid(*pBlock);
+        }
+        if (!okValid || pInstr == pEnd || m_R[7] != pInstr->address)
+        {
+            // Jump or the code changed: go on with the block at the new PC if it's translated already;
+            // a loop back to the start of the valid block goes on with the same block
+            if (!okValid || m_R[7] != pBlock->address)
+            {
+                pBlock = ((m_R[7] & 1) == 0) ? FindBlock(m_R[7]) : nullptr;
+                if (pBlock == nullptr)
+                    break;
+            }
+            pInstr = pBlock->instructions;
+            pEnd = pInstr + pBlock->length;
+        }
+
+        m_cyclesLeft -= m_internalTick + 1;  // Same as in ExecuteCycles()
+
+        if (m_okLockstepLog)  // Interrupt processing skipped, ticks counted, the next instruction found: check all that
+        {
+            if (!LockstepCheck(true))
+                return;
+            LockstepBegin();
+        }
+    }
+
+    ProcessInterrupts();
+    if (m_okLockstepLog)
+        LockstepCheck(false);
+}
+
+void CProcessor::ProcessInterrupts()
+{
     if (m_stepmode)
         m_stepmode = false;
     else if (m_instruction == PI_RTT && (GetPSW() & PSW_T))
     {
         // Skip interrupt processing for RTT with T bit set
     }
-    else  // Processing interrupts
+    else if ((m_intrq | (m_psw & PSW_T)) != 0)  // Processing interrupts
     {
         for (;;)
         {
-            m_TBITrq = (m_psw & 020) != 0;  // T-bit
+            // Find the first unmasked request according to priority
+            uint16_t pending = m_intrq & m_intrqPriorityMask[(m_psw & 0340) >> 5];
+            if ((m_psw & PSW_T) && !m_waitmode)
+                pending |= INTRQ_TBIT;
+            if (pending == 0)
+                break;  // No more unmasked interrupts
+            int request = CountTrailingZeros(pending);
+            m_intrq &= ~(1 << request);
 
-            // Calculate interrupt vector and mode according to priority
-            uint16_t intrVector = 0;
-            int priority = (m_psw & 0340) >> 5;  // Priority: 0..7
-            if (m_HALTrq)  // HALT command
+            if (request == INTRQ_HALT_BIT)  // HALT command
             {
                 //intrVector = 0172004;  intrMode = true;
-                m_HALTrq = false;
-
                 DebugLogFormat(_T("HALT interrupt at PC=%06o\r\n"), m_instructionpc);
 
                 // Save PC/PSW to stack
                 SetSP(GetSP() - 2);
-                SetWord(GetSP(), m_psw);
+                SetWord(GetSP(), GetPSW());
                 SetSP(GetSP() - 2);
                 SetWord(GetSP(), GetPC());
                 // Restart
@@ -277,63 +764,16 @@ void CProcessor::Execute()
                 SetPSW(0340);
                 break;
             }
-            else if (m_BPT_rq)  // BPT command
-            {
-                intrVector = 0000014;  m_BPT_rq = false;
-            }
-            else if (m_IOT_rq)  // IOT command
-            {
-                intrVector = 0000020;  m_IOT_rq = false;
-            }
-            else if (m_EMT_rq)  // EMT command
-            {
-                intrVector = 0000030;  m_EMT_rq = false;
-            }
-            else if (m_TRAPrq)  // TRAP command
-            {
-                intrVector = 0000034;  m_TRAPrq = false;
-            }
-            else if (m_RPLYrq)  // Зависание
-            {
-                intrVector = 000000;  m_RPLYrq = false;
-            }
-            else if (m_RSVD4rq)  // Reserved instruction trap: JMP / JSR wrong mode
-            {
-                intrVector = 000010;  m_RSVD4rq = false;
-            }
-            else if (m_RSVDrq)  // Reserved instruction trap: illegal and reserved instruction
-            {
-                intrVector = 000010;  m_RSVDrq = false;
-            }
-            else if (m_TBITrq && (!m_waitmode))  // T-bit
-            {
-                intrVector = 000014;  m_TBITrq = false;
-            }
-            else if (m_IRQ5rq && priority < 5)  // Keyboard 7004 interrupt, priority 5
-            {
-                intrVector = 000130;  m_IRQ5rq = false;
-            }
-            else if (m_IRQ2rq && priority < 4)  // Vblank interrupt, priority 4
-            {
-                intrVector = 000064;  m_IRQ2rq = false;
-            }
-            else if (m_IRQ11rq && priority < 6)  // Timer interrupt, priority 6
-            {
-                intrVector = 000100;  m_IRQ11rq = false;
-            }
-            else if (m_virqrq > 0 && (m_psw & 0200) != 0200)  // VIRQ
+
+            uint16_t intrVector = m_intrqVector[request];  // Zero for hangup: the request is just dropped
+            if (request == INTRQ_VIRQ_BIT)  // VIRQ, the lowest entry first
             {
-                for (int irq = 0; irq <= 15; irq++)
-                {
-                    if (m_virq[irq] != 0)
-                    {
-                        intrVector = m_virq[irq];
-                        m_virq[irq] = 0;
-                        m_virqrq--;
-                        break;
-                    }
-                }
-                if (intrVector == 0) m_virqrq = 0;
+                int irq = CountTrailingZeros(m_virqmask);
+                intrVector = m_virq[irq];
+                m_virq[irq] = 0;
+                m_virqmask &= ~(1 << irq);
+                if (m_virqmask != 0)
+                    m_intrq |= INTRQ_VIRQ;
             }
 
             if (intrVector == 0)
@@ -341,7 +781,7 @@ void CProcessor::Execute()
 
             m_waitmode = false;
 
-            uint16_t oldpsw = m_psw;
+            uint16_t oldpsw = GetPSW();
 
             // Save PC/PSW to stack
             SetSP(GetSP() - 2);
@@ -350,7 +790,7 @@ void CProcessor::Execute()
             SetWord(GetSP(), GetPC());
 
             SetPC(GetWord(intrVector));
-            m_psw = GetWord(intrVector + 2) & 0377;
+            SetPSW(GetWord(intrVector + 2) & 0377);
         }  // end while
     }
 }
@@ -362,13 +802,20 @@ void CProcessor::InterruptVIRQ(int que, uint16_t interrupt)
     // {
     //  DebugPrintFormat(_T("Lost VIRQ %d %d\r\n"), m_virq, interrupt);
     // }
-    m_virqrq += 1;
     m_virq[que] = interrupt;
+    if (interrupt != 0)
+        m_virqmask |= (1 << que);
+    else
+        m_virqmask &= ~(1 << que);
+    if (m_virqmask != 0)
+        m_intrq |= INTRQ_VIRQ;
+    else
+        m_intrq &= ~INTRQ_VIRQ;
 }
 
 void CProcessor::MemoryError()
 {
-    m_RPLYrq = true;
+    m_intrq |= INTRQ_RPLY;
 }
 
 
@@ -381,7 +828,20 @@ void CProcessor::FetchInstruction()
     uint16_t pc = GetPC();
     pc = pc & ~1;
 
-    m_instruction = GetWordExec(pc);
+    Block* pBlock = m_okTranslation ? FindBlock(pc) : nullptr;
+    if (pBlock == nullptr)
+    {
+        m_instruction = GetWordExec(pc);
+        if (m_okTranslation && pc < 0177400 && (m_intrq & INTRQ_RPLY) == 0)  // Cache RAM and ROM only, not I/O ports
+            pBlock = TranslateBlock(pc, m_instruction);
+    }
+    if (pBlock != nullptr)
+    {
+        m_instruction = pBlock->instructions[0].instruction;
+        m_method = pBlock->instructions[0].method;
+    }
+    else
+        m_method = GetExecuteMethod(m_instruction, GetOpcodeClass(m_instruction));
     SetPC(GetPC() + 2);
 
 //#if !defined(PRODUCT)
@@ -401,6 +861,185 @@ void CProcessor::FetchInstruction()
 //#endif
 }
 
+// Decode the code at the address up to the instruction that may jump; instruction is the word at the address.
+// The block stays within the 256-byte page, so it's RAM or ROM same as the first word, in the same window.
+CProcessor::Block* CProcessor::TranslateBlock(uint16_t address, uint16_t instruction)
+{
+    uint32_t codeaddress = GetCodeAddress(address);
+    Block& block = m_blockcache[(codeaddress >> 1) & (BLOCKCACHE_SIZE - 1)];
+    block.address = address;
+    block.generation = m_blockgeneration;
+    block.codeaddress = codeaddress;
+    block.pagegeneration = m_pagegeneration[codeaddress >> 8];
+    block.length = 0;
+    for (;;)
+    {
+        uint8_t opclass = GetOpcodeClass(instruction);
+        BlockInstruction& instr = block.instructions[block.length++];
+        instr.address = address;
+        instr.instruction = instruction;
+        instr.method = GetExecuteMethod(instruction, opclass);
+        instr.regdest  = GetDigit(instruction, 0);
+        instr.methdest = GetDigit(instruction, 1);
+        instr.regsrc   = GetDigit(instruction, 2);
+        instr.methsrc  = GetDigit(instruction, 3);
+        codeaddress = block.codeaddress + (address - block.address);
+        m_codemap[codeaddress >> 4] |= (uint8_t)(1 << ((codeaddress >> 1) & 7));
+
+        if (block.length == BLOCK_MAXLENGTH || IsBlockEnd(instruction, opclass))
+            break;
+        uint16_t next = address + GetInstructionLength(instruction, opclass);
+        if ((next >> 8) != (block.address >> 8))
+            break;  // Next page
+
+        address = next;
+        instruction = GetWordExec(address);
+    }
+
+    return &block;
+}
+
+// Compare the translated instruction with the memory and the decoder, as the interpreter would see it
+bool CProcessor::CheckBlockInstruction(const BlockInstruction& instr)
+{
+    uint16_t instruction = GetWordExec(instr.address);
+    if ((m_intrq & INTRQ_RPLY) == 0 && m_R[7] == instr.address && instruction == instr.instruction &&
+        instr.method == GetExecuteMethod(instruction, GetOpcodeClass(instruction)) &&
+        instr.regdest == GetDigit(instruction, 0) && instr.methdest == GetDigit(instruction, 1) &&
+        instr.regsrc == GetDigit(instruction, 2) && instr.methsrc == GetDigit(instruction, 3))
+        return true;
+
+    DebugLogFormat(_T("CPU: Lockstep divergence at PC=%06o: translated %06o at %06o, memory %06o\r\n"),
+                   m_R[7], instr.instruction, instr.address, instruction);
+    m_okDiverged = true;
+    return false;
+}
+
+void CProcessor::GetLockstepState(LockstepState& state) const
+{
+    memcpy(state.R, m_R, sizeof(state.R));
+    state.psw = GetPSW();
+    state.intrq = m_intrq;
+    state.internalTick = m_internalTick;
+    state.waitmode = m_waitmode;
+    state.stepmode = m_stepmode;
+    state.cyclesLeft = m_cyclesLeft;
+    state.slowaccesses = m_pBoard->GetSlowAccessCount();
+}
+
+void CProcessor::SetLockstepState(const LockstepState& state)
+{
+    memcpy(m_R, state.R, sizeof(m_R));
+    SetPSW(state.psw);
+    m_intrq = state.intrq;
+    m_internalTick = state.internalTick;
+    m_waitmode = state.waitmode;
+    m_stepmode = state.stepmode;
+    m_cyclesLeft = state.cyclesLeft;
+}
+
+void CProcessor::LockstepBegin()
+{
+    GetLockstepState(m_lockstepstate);
+    m_lockstepwritecount = 0;
+    m_okLockstepLog = true;
+}
+
+void CProcessor::LogLockstepWrite(uint16_t address, uint16_t value, bool okByte)
+{
+    if (m_lockstepwritecount < LOCKSTEP_MAXWRITES)
+    {
+        LockstepWrite& write = m_lockstepwrites[m_lockstepwritecount];
+        write.address = address;
+        write.value = value;
+        write.okByte = okByte;
+        // Reading a port is not safe; the port write is slow access, the instruction is not checked anyway
+        write.oldvalue = 0;
+        if (address < 0177400)
+            write.oldvalue = okByte ? m_pBoard->GetByte(address) : m_pBoard->GetWord(address);
+    }
+    m_lockstepwritecount++;
+}
+
+void CProcessor::LogLockstepState(LPCTSTR title, const LockstepState& state, const LockstepWrite* writes, int writecount)
+{
+    DebugLogFormat(_T("  %s R0=%06o R1=%06o R2=%06o R3=%06o R4=%06o R5=%06o SP=%06o PC=%06o PSW=%06o INTRQ=%06o tick=%d left=%d%s%s\r\n"),
+                   title, state.R[0], state.R[1], state.R[2], state.R[3], state.R[4], state.R[5], state.R[6], state.R[7],
+                   state.psw, state.intrq, state.internalTick, state.cyclesLeft, state.waitmode ? _T(" WAIT") : _T(""), state.stepmode ? _T(" STEP") : _T(""));
+    for (int i = 0; i < writecount; i++)
+    {
+        DebugLogFormat(writes[i].okByte ? _T("    byte %06o <- %03o\r\n") : _T("    word %06o <- %06o\r\n"),
+                       writes[i].address, writes[i].value);
+    }
+}
+
+// Called after ExecuteBlock() ran the instruction: undo it, run it by the interpreter, compare the results.
+//   okContinue - true: ExecuteBlock() goes on with the next instruction, false: returns to ExecuteCycles()
+bool CProcessor::LockstepCheck(bool okContinue)
+{
+    m_okLockstepLog = false;
+    if (m_pBoard->GetSlowAccessCount() != m_lockstepstate.slowaccesses ||  // I/O ports can't be run twice
+        m_instruction == PI_RESET ||  // Devices reset
+        m_lockstepwritecount > LOCKSTEP_MAXWRITES)
+        return true;
+
+    LockstepState blockstate;
+    GetLockstepState(blockstate);
+    LockstepWrite blockwrites[LOCKSTEP_MAXWRITES];
+    int blockwritecount = m_lockstepwritecount;
+    memcpy(blockwrites, m_lockstepwrites, sizeof(LockstepWrite) * blockwritecount);
+
+    for (int i = blockwritecount - 1; i >= 0; i--)  // Undo in reverse order
+    {
+        if (blockwrites[i].okByte)
+            m_pBoard->SetByte(blockwrites[i].address, (uint8_t)blockwrites[i].oldvalue);
+        else
+            m_pBoard->SetWord(blockwrites[i].address, blockwrites[i].oldvalue);
+    }
+    SetLockstepState(m_lockstepstate);
+
+    m_lockstepwritecount = 0;
+    m_okLockstepLog = true;
+    m_okTranslation = false;  // Fetch and decode from memory
+    ExecuteInstruction();
+    m_okTranslation = true;
+    m_okLockstepLog = false;
+
+    // ExecuteCycles() would go on with the next instruction only if ticks left, counting the ticks the same way
+    LockstepState state;
+    GetLockstepState(state);
+    bool okTicksLeft = m_internalTick < m_cyclesLeft;
+    if (okContinue)
+        state.cyclesLeft -= m_internalTick + 1;
+    bool okSame = (okTicksLeft || !okContinue) &&
+                  memcmp(state.R, blockstate.R, sizeof(state.R)) == 0 &&
+                  state.psw == blockstate.psw && state.intrq == blockstate.intrq &&
+                  state.internalTick == blockstate.internalTick &&
+                  state.waitmode == blockstate.waitmode && state.stepmode == blockstate.stepmode &&
+                  state.cyclesLeft == blockstate.cyclesLeft &&
+                  state.slowaccesses == blockstate.slowaccesses &&
+                  m_lockstepwritecount == blockwritecount;
+    for (int i = 0; okSame && i < blockwritecount; i++)
+    {
+        okSame = m_lockstepwrites[i].address == blockwrites[i].address &&
+                 m_lockstepwrites[i].value == blockwrites[i].value && m_lockstepwrites[i].okByte == blockwrites[i].okByte;
+    }
+    if (okSame)
+    {
+        m_cyclesLeft = state.cyclesLeft;
+        return true;
+    }
+
+    DebugLogFormat(_T("CPU: Lockstep divergence at PC=%06o, instruction %06o\r\n"),
+                   m_lockstepstate.R[7], m_instruction);
+    LogLockstepState(_T("before:     "), m_lockstepstate, nullptr, 0);
+    LogLockstepState(_T("translated: "), blockstate, blockwrites, blockwritecount);
+    int writecount = m_lockstepwritecount < LOCKSTEP_MAXWRITES ? m_lockstepwritecount : LOCKSTEP_MAXWRITES;
+    LogLockstepState(_T("interpreter:"), state, m_lockstepwrites, writecount);
+    m_okDiverged = true;
+    return false;
+}
+
 void CProcessor::TranslateInstruction()
 {
     // Prepare values to help decode the command
@@ -409,8 +1048,11 @@ void CProcessor::TranslateInstruction()
     m_regsrc   = GetDigit(m_instruction, 2);
     m_methsrc  = GetDigit(m_instruction, 3);
 
-    // Find command implementation using the command map
-    ExecuteMethodRef methodref = m_pExecuteMethodMap[m_instruction];
+    static_assert(sizeof(m_ExecuteMethodTable) / sizeof(m_ExecuteMethodTable[0]) == EXECMETHOD_COUNT,
+                  "Wrong m_ExecuteMethodTable size");
+
+    // Find command implementation found on decoding
+    ExecuteMethodRef methodref = m_ExecuteMethodTable[m_method];
     (this->*methodref)();  // Call command implementation method
 }
 
@@ -418,7 +1060,7 @@ void CProcessor::ExecuteUNKNOWN()  // Нет такой инструкции - 
 {
     DebugLogFormat(_T("CPU: Invalid OPCODE %06o at PC=%06o\r\n"), m_instruction, m_instructionpc);
 
-    m_RSVDrq = true;
+    m_intrq |= INTRQ_RSVD;
 }
 
 
@@ -433,7 +1075,7 @@ void CProcessor::ExecuteWAIT()  // WAIT - Wait for an interrupt
 
 void CProcessor::ExecuteHALT()  // HALT - Останов
 {
-    m_HALTrq = true;
+    m_intrq |= INTRQ_HALT;
 
     m_internalTick = TIMING_HALT;
 }
@@ -452,13 +1094,13 @@ void CProcessor::ExecuteRTI()  // RTI - Возврат из прерывания
 
 void CProcessor::ExecuteBPT()  // BPT - Breakpoint
 {
-    m_BPT_rq = true;
+    m_intrq |= INTRQ_BPT;
     m_internalTick = TIMING_EMT;
 }
 
 void CProcessor::ExecuteIOT()  // IOT - I/O trap
 {
-    m_IOT_rq = true;
+    m_intrq |= INTRQ_IOT;
     m_internalTick = TIMING_EMT;
 }
 
@@ -524,7 +1166,7 @@ void CProcessor::ExecuteJMP()  // JMP - jump: PC = &d (a-mode > 0)
 {
     if (m_methdest == 0)  // Неправильный метод адресации
     {
-        m_RSVD4rq = true;
+        m_intrq |= INTRQ_RSVD4;
 
         m_internalTick = TIMING_EMT;
     }
@@ -557,38 +1199,6 @@ void CProcessor::ExecuteSWAB()
     m_internalTick = TIMING_ONE[m_methdest];
 }
 
-void CProcessor::ExecuteCLR()
-{
-    if (m_instruction & 0100000)
-    {
-        SetN(false);
-        SetZ(true);
-        SetV(false);
-        SetC(false);
-
-        if (m_methdest)
-            SetByte(GetByteAddr(m_methdest, m_regdest), 0);
-        else
-            SetReg(m_regdest, (GetReg(m_regdest) & 0177400));
-
-        m_internalTick = TIMING_ONE[m_methdest];
-    }
-    else
-    {
-        SetN(false);
-        SetZ(true);
-        SetV(false);
-        SetC(false);
-
-        if (m_methdest)
-            SetWord(GetWordAddr(m_methdest, m_regdest), 0);
-        else
-            SetReg(m_regdest, 0);
-
-        m_internalTick = TIMING_ONE[m_methdest];
-    }
-}
-
 void CProcessor::ExecuteCOM()
 {
     uint16_t ea = 0;
@@ -631,86 +1241,6 @@ void CProcessor::ExecuteCOM()
     }
 }
 
-void CProcessor::ExecuteINC()  // INC - Инкремент
-{
-    uint16_t ea = 0;
-
-    if (m_instruction & 0100000)
-    {
-        uint8_t dst = m_methdest ? GetByte(ea = GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
-
-        dst = dst + 1;
-
-        SetN((dst >> 7) != 0);
-        SetZ(!dst);
-        SetV(dst == 0200);
-
-        if (m_methdest)
-            SetByte(ea, dst);
-        else
-            SetReg(m_regdest, (GetReg(m_regdest) & 0177400) | dst);
-
-        m_internalTick = TIMING_ONE[m_methdest];
-    }
-    else
-    {
-        uint16_t dst = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-        dst = dst + 1;
-
-        SetN((dst >> 15) != 0);
-        SetZ(!dst);
-        SetV(dst == 0100000);
-
-        if (m_methdest)
-            SetWord(ea, dst);
-        else
-            SetReg(m_regdest, dst);
-
-        m_internalTick = TIMING_ONE[m_methdest];
-    }
-}
-
-void CProcessor::ExecuteDEC()  // DEC - Декремент
-{
-    uint16_t ea = 0;
-
-    if (m_instruction & 0100000)
-    {
-        uint8_t dst = m_methdest ? GetByte(ea = GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
-
-        dst = dst - 1;
-
-        SetN((dst >> 7) != 0);
-        SetZ(!dst);
-        SetV(dst == 0177);
-
-        if (m_methdest)
-            SetByte(ea, dst);
-        else
-            SetReg(m_regdest, (GetReg(m_regdest) & 0177400) | dst);
-
-        m_internalTick = TIMING_ONE[m_methdest];
-    }
-    else
-    {
-        uint16_t dst = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-        dst = dst - 1;
-
-        SetN((dst >> 15) != 0);
-        SetZ(!dst);
-        SetV(dst == 077777);
-
-        if (m_methdest)
-            SetWord(ea, dst);
-        else
-            SetReg(m_regdest, dst);
-
-        m_internalTick = TIMING_ONE[m_methdest];
-    }
-}
-
 void CProcessor::ExecuteNEG()
 {
     uint16_t ea = 0;
@@ -837,30 +1367,6 @@ void CProcessor::ExecuteSBC()  // SBC{B}
     }
 }
 
-void CProcessor::ExecuteTST()  // TST - test
-{
-    uint16_t dst = m_methdest ? GetWord(GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-    SetN((dst >> 15) != 0);
-    SetZ(!dst);
-    SetV(false);
-    SetC(false);
-
-    m_internalTick = TIMING_TST[m_methdest];
-}
-
-void CProcessor::ExecuteTSTB()  // TSTB - test
-{
-    uint8_t dst = m_methdest ? GetByte(GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
-
-    SetN((dst >> 7) != 0);
-    SetZ(!dst);
-    SetV(false);
-    SetC(false);
-
-    m_internalTick = TIMING_TST[m_methdest];
-}
-
 void CProcessor::ExecuteROR()  // ROR{B}
 {
     uint16_t ea = 0;
@@ -1194,26 +1700,6 @@ void CProcessor::ExecuteBLO()
     m_internalTick = TIMING_BRANCH;
 }
 
-void CProcessor::ExecuteXOR()  // XOR
-{
-    uint16_t ea = 0;
-
-    uint16_t dst = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-    dst = dst ^ GetReg(m_regsrc);
-
-    SetN((dst >> 15) != 0);
-    SetZ(!dst);
-    SetV(false);
-
-    if (m_methdest)
-        SetWord(ea, dst);
-    else
-        SetReg(m_regdest, dst);
-
-    m_internalTick = TIMING_ONE[m_methdest];
-}
-
 void CProcessor::ExecuteSOB()  // SOB - subtract one: R = R - 1 ; if R != 0 : PC = PC - 2*nn
 {
     uint16_t dst = GetReg(m_regsrc);
@@ -1227,234 +1713,121 @@ void CProcessor::ExecuteSOB()  // SOB - subtract one: R = R - 1 ; if R != 0 : PC
     m_internalTick = TIMING_SOB;
 }
 
-void CProcessor::ExecuteMOV()
-{
-    uint16_t dst = m_methsrc ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-
-    SetN((dst >> 15) != 0);
-    SetZ(!dst);
-    SetV(false);
-
-    if (m_methdest)
-        SetWord(GetWordAddr(m_methdest, m_regdest), dst);
-    else
-        SetReg(m_regdest, dst);
-
-    m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
-}
-
-void CProcessor::ExecuteMOVB()
+// MOV{B}, CMP{B}, BIT{B}, BIC{B}, BIS{B}, ADD, SUB
+template<int op, bool isbyte, int methsrc, int methdest>
+void CProcessor::ExecuteDoubleOperand()
 {
-    uint8_t dst = m_methsrc ? GetByte(GetByteAddr(m_methsrc, m_regsrc)) : GetLReg(m_regsrc);
-
-    SetN((dst >> 7) != 0);
-    SetZ(!dst);
-    SetV(false);
-
-    if (m_methdest)
-        SetByte(GetByteAddr(m_methdest, m_regdest), dst);
-    else
-        SetReg(m_regdest, (dst & 0200) ? (0177400 | dst) : dst);
+    const uint16_t sign = isbyte ? 0200 : 0100000;
+    const uint16_t mask = isbyte ? 0377 : 0177777;
+    uint16_t ea = 0;
 
-    m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
-}
+    uint16_t src = GetOperand<isbyte, methsrc>(m_regsrc, ea);
 
-void CProcessor::ExecuteCMP()
-{
-    if (m_instruction & 0100000)
+    if (op == DOUBLEOP_MOV)  // Destination is not read
     {
-        uint8_t src = m_methsrc ? GetByte(GetByteAddr(m_methsrc, m_regsrc)) : GetLReg(m_regsrc);
-        uint8_t src2 = m_methdest ? GetByte(GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
+        SetLazyFlags(FLAGS_MOV, sign, src);
 
-        SetN( CheckForNegative(static_cast<uint8_t>(src - src2)) );
-        SetZ( CheckForZero(static_cast<uint8_t>(src - src2)) );
-        SetV( CheckSubForOverflow (src, src2) );
-        SetC( CheckSubForCarry (src, src2) );
+        if (methdest != 0)
+            SetOperand<isbyte, methdest>(m_regdest, GetOperandAddr<isbyte, methdest>(m_regdest), src);
+        else if (isbyte)  // MOVB to register extends the sign
+            SetReg(m_regdest, (src & 0200) ? (0177400 | src) : src);
+        else
+            SetReg(m_regdest, src);
 
-        m_internalTick = TIMING_CMP(m_methsrc, m_methdest);
+        m_internalTick = TIMING_MOV(methsrc, methdest);
+        return;
     }
-    else
-    {
-        uint16_t src = m_methsrc ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-        uint16_t src2 = m_methdest ? GetWord(GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
 
-        SetN( CheckForNegative (static_cast<uint16_t>(src - src2)) );
-        SetZ( CheckForZero (static_cast<uint16_t>(src - src2)) );
-        SetV( CheckSubForOverflow (src, src2) );
-        SetC( CheckSubForCarry (src, src2) );
+    uint16_t src2 = GetOperand<isbyte, methdest>(m_regdest, ea);
 
-        m_internalTick = TIMING_CMP(m_methsrc, m_methdest);
-    }
-}
-
-void CProcessor::ExecuteBIT()  // BIT{B} - bit test
-{
-    uint16_t ea;
-    if (m_instruction & 0100000)
+    uint16_t dst;
+    switch (op)
     {
-        uint8_t src = m_methsrc ? GetByte(GetByteAddr(m_methsrc, m_regsrc)) : GetLReg(m_regsrc);
-        uint8_t src2 = m_methdest ? GetByte(ea = GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
-
-        uint8_t dst = src2 & src;
-
-        SetN((dst >> 7) != 0);
-        SetZ(!dst);
-        SetV(false);
-
-        m_internalTick = TIMING_CMP(m_methsrc, m_methdest);
+    case DOUBLEOP_CMP:
+        SetLazyFlags(FLAGS_SUB, sign, (src - src2) & mask, src, src2);
+        m_internalTick = TIMING_CMP(methsrc, methdest);
+        return;
+    case DOUBLEOP_BIT:
+        SetLazyFlags(FLAGS_MOV, sign, src2 & src);
+        m_internalTick = TIMING_CMP(methsrc, methdest);
+        return;
+    case DOUBLEOP_BIC:
+        dst = src2 & ~src & mask;
+        SetLazyFlags(FLAGS_MOV, sign, dst);
+        break;
+    case DOUBLEOP_BIS:
+        dst = src2 | src;
+        SetLazyFlags(FLAGS_MOV, sign, dst);
+        break;
+    case DOUBLEOP_ADD:
+        dst = src2 + src;
+        SetLazyFlags(FLAGS_ADD, sign, dst, src2, src);
+        break;
+    default:  // DOUBLEOP_SUB
+        dst = src2 - src;
+        SetLazyFlags(FLAGS_SUB, sign, dst, src2, src);
+        break;
     }
-    else
-    {
-        uint16_t src  = m_methsrc  ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-        uint16_t src2 = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
 
-        uint16_t dst = src2 & src;
+    SetOperand<isbyte, methdest>(m_regdest, ea, dst);
 
-        SetN((dst >> 15) != 0);
-        SetZ(!dst);
-        SetV(false);
-
-        m_internalTick = TIMING_CMP(m_methsrc, m_methdest);
-    }
+    m_internalTick = TIMING_MOV(methsrc, methdest);
 }
 
-void CProcessor::ExecuteBIC()  // BIC{B} - bit clear
+// CLR{B}, INC{B}, DEC{B}, TST{B}, XOR
+template<int op, bool isbyte, int methdest>
+void CProcessor::ExecuteSingleOperand()
 {
+    const uint16_t sign = isbyte ? 0200 : 0100000;
+    const uint16_t mask = isbyte ? 0377 : 0177777;
     uint16_t ea = 0;
 
-    if (m_instruction & 0100000)
-    {
-        uint8_t src = m_methsrc ? GetByte(GetByteAddr(m_methsrc, m_regsrc)) : GetLReg(m_regsrc);
-        uint8_t src2 = m_methdest ? GetByte(ea = GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
-
-        uint8_t dst = src2 & (~src);
-
-        SetN((dst >> 7) != 0);
-        SetZ(!dst);
-        SetV(false);
-
-        if (m_methdest)
-            SetByte(ea, dst);
-        else
-            SetReg(m_regdest, (GetReg(m_regdest) & 0177400) | dst);
-
-        m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
-    }
-    else
+    if (op == SINGLEOP_CLR)  // Destination is not read
     {
-        uint16_t src = m_methsrc ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-        uint16_t src2 = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
+        SetLazyFlags(FLAGS_TST, sign, 0);
 
-        uint16_t dst = src2 & (~src);
+        SetOperand<isbyte, methdest>(m_regdest, GetOperandAddr<isbyte, methdest>(m_regdest), 0);
 
-        SetN((dst >> 15) != 0);
-        SetZ(!dst);
-        SetV(false);
-
-        if (m_methdest)
-            SetWord(ea, dst);
-        else
-            SetReg(m_regdest, dst);
-
-        m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
+        m_internalTick = TIMING_ONE[methdest];
+        return;
     }
-}
-
-void CProcessor::ExecuteBIS()  // BIS{B} - bit set
-{
-    uint16_t ea = 0;
 
-    if (m_instruction & 0100000)
-    {
-        uint8_t src = m_methsrc ? GetByte(GetByteAddr(m_methsrc, m_regsrc)) : GetLReg(m_regsrc);
-        uint8_t src2 = m_methdest ? GetByte(ea = GetByteAddr(m_methdest, m_regdest)) : GetLReg(m_regdest);
-
-        uint8_t dst = src2 | src;
-
-        SetN((dst >> 7) != 0);
-        SetZ(!dst);
-        SetV(false);
+    uint16_t dst = GetOperand<isbyte, methdest>(m_regdest, ea);
 
-        if (m_methdest)
-            SetByte(ea, dst);
-        else
-            SetReg(m_regdest, (GetReg(m_regdest) & 0177400) | dst);
-
-        m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
-    }
-    else
+    switch (op)
     {
-        uint16_t src = m_methsrc ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-        uint16_t src2 = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-        uint16_t dst = src2 | src;
-
-        SetN((dst >> 15) != 0);
-        SetZ(!dst);
-        SetV(false);
-
-        if (m_methdest)
-            SetWord(ea, dst);
-        else
-            SetReg(m_regdest, dst);
-
-        m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
+    case SINGLEOP_TST:
+        SetLazyFlags(FLAGS_TST, sign, dst);
+        m_internalTick = TIMING_TST[methdest];
+        return;
+    case SINGLEOP_INC:
+        dst = (dst + 1) & mask;
+        SetLazyFlags(FLAGS_INC, sign, dst);
+        break;
+    case SINGLEOP_DEC:
+        dst = (dst - 1) & mask;
+        SetLazyFlags(FLAGS_DEC, sign, dst);
+        break;
+    default:  // SINGLEOP_XOR
+        dst = dst ^ GetReg(m_regsrc);
+        SetLazyFlags(FLAGS_MOV, sign, dst);
+        break;
     }
-}
-
-void CProcessor::ExecuteADD()  // ADD
-{
-    uint16_t ea = 0;
-
-    uint16_t src = m_methsrc ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-    uint16_t src2 = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-    SetN(CheckForNegative (static_cast<uint16_t>(src2 + src)));
-    SetZ(CheckForZero (static_cast<uint16_t>(src2 + src)));
-    SetV(CheckAddForOverflow (src2, src));
-    SetC(CheckAddForCarry (src2, src));
-
-    signed short dst = src2 + src;
-
-    if (m_methdest)
-        SetWord(ea, dst);
-    else
-        SetReg(m_regdest, dst);
-
-    m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
-}
-
-void CProcessor::ExecuteSUB()
-{
-    uint16_t ea = 0;
-
-    uint16_t src = m_methsrc ? GetWord(GetWordAddr(m_methsrc, m_regsrc)) : GetReg(m_regsrc);
-    uint16_t src2 = m_methdest ? GetWord(ea = GetWordAddr(m_methdest, m_regdest)) : GetReg(m_regdest);
-
-    SetN(CheckForNegative (static_cast<uint16_t>(src2 - src)));
-    SetZ(CheckForZero (static_cast<uint16_t>(src2 - src)));
-    SetV(CheckSubForOverflow (src2, src));
-    SetC(CheckSubForCarry (src2, src));
-
-    uint16_t dst = src2 - src;
 
-    if (m_methdest)
-        SetWord(ea, dst);
-    else
-        SetReg(m_regdest, dst);
+    SetOperand<isbyte, methdest>(m_regdest, ea, dst);
 
-    m_internalTick = TIMING_MOV(m_methsrc, m_methdest);
+    m_internalTick = TIMING_ONE[methdest];
 }
 
 void CProcessor::ExecuteEMT()  // EMT - emulator trap
 {
-    m_EMT_rq = true;
+    m_intrq |= INTRQ_EMT;
     m_internalTick = TIMING_EMT;
 }
 
 void CProcessor::ExecuteTRAP()
 {
-    m_TRAPrq = true;
+    m_intrq |= INTRQ_TRAP;
     m_internalTick = TIMING_EMT;
 }
 
@@ -1463,7 +1836,7 @@ void CProcessor::ExecuteJSR()  // JSR - Jump subroutine: *--SP = R; R = PC; PC =
     if (m_methdest == 0)
     {
         // Неправильный метод адресации
-        m_RSVD4rq = true;
+        m_intrq |= INTRQ_RSVD4;
         m_internalTick = TIMING_EMT;
     }
     else
@@ -1494,7 +1867,7 @@ void CProcessor::SaveToImage(uint8_t* pImage)
 {
     uint16_t* pwImage = reinterpret_cast<uint16_t*>(pImage);
     // PSW
-    *pwImage++ = m_psw;
+    *pwImage++ = GetPSW();
     // Registers R0..R7
     ::memcpy(pwImage, m_R, 2 * 8);
     pwImage += 2 * 8;
@@ -1528,7 +1901,8 @@ void CProcessor::LoadFromImage(const uint8_t* pImage)
     //pwImage++;
 }
 
-uint16_t CProcessor::GetWordAddr (uint8_t meth, uint8_t reg)
+template<bool isbyte, int meth>
+inline uint16_t CProcessor::GetOperandAddr(uint8_t reg)
 {
     uint16_t addr = 0;
 
@@ -1539,7 +1913,7 @@ uint16_t CProcessor::GetWordAddr (uint8_t meth, uint8_t reg)
         break;
     case 2:   //(R)+
         addr = GetReg(reg);
-        SetReg(reg, addr + 2);
+        SetReg(reg, addr + ((isbyte && reg < 6) ? 1 : 2));
         break;
     case 3:  //@(R)+
         addr = GetReg(reg);
@@ -1547,7 +1921,7 @@ uint16_t CProcessor::GetWordAddr (uint8_t meth, uint8_t reg)
         addr = GetWord(addr);
         break;
     case 4: //-(R)
-        SetReg(reg, GetReg(reg) - 2);
+        SetReg(reg, GetReg(reg) - ((isbyte && reg < 6) ? 1 : 2));
         addr = GetReg(reg);
         break;
     case 5: //@-(R)
@@ -1570,50 +1944,57 @@ uint16_t CProcessor::GetWordAddr (uint8_t meth, uint8_t reg)
     return addr;
 }
 
-uint16_t CProcessor::GetByteAddr (uint8_t meth, uint8_t reg)
+// Read the operand, ea gets the operand address for modes 1..7
+template<bool isbyte, int meth>
+inline uint16_t CProcessor::GetOperand(uint8_t reg, uint16_t& ea)
 {
-    uint16_t addr = 0, delta;
+    if (meth == 0)
+        return isbyte ? GetLReg(reg) : GetReg(reg);
+
+    ea = GetOperandAddr<isbyte, meth>(reg);
+    return isbyte ? GetByte(ea) : GetWord(ea);
+}
+
+// Write the operand at address ea; byte write to a register keeps the high byte
+template<bool isbyte, int meth>
+inline void CProcessor::SetOperand(uint8_t reg, uint16_t ea, uint16_t value)
+{
+    if (meth == 0)
+        SetReg(reg, isbyte ? ((GetReg(reg) & 0177400) | (value & 0377)) : value);
+    else if (isbyte)
+        SetByte(ea, static_cast<uint8_t>(value));
+    else
+        SetWord(ea, value);
+}
 
+uint16_t CProcessor::GetWordAddr (uint8_t meth, uint8_t reg)
+{
     switch (meth)
     {
-    case 1:
-        addr = GetReg(reg);
-        break;
-    case 2:
-        delta = 1 + (reg >= 6);
-        addr = GetReg(reg);
-        SetReg(reg, addr + delta);
-        break;
-    case 3:
-        addr = GetReg(reg);
-        SetReg(reg, addr + 2);
-        addr = GetWord(addr);
-        break;
-    case 4:
-        delta = 1 + (reg >= 6);
-        SetReg(reg, GetReg(reg) - delta);
-        addr = GetReg(reg);
-        break;
-    case 5:
-        SetReg(reg, GetReg(reg) - 2);
-        addr = GetReg(reg);
-        addr = GetWord(addr);
-        break;
-    case 6: //d(R)
-        addr = GetWord(GetPC());
-        SetPC(GetPC() + 2);
-        addr = GetReg(reg) + addr;
-        break;
-    case 7: //@d(r)
-        addr = GetWord(GetPC());
-        SetPC(GetPC() + 2);
-        addr = GetReg(reg) + addr;
-        addr = GetWord(addr);
-        break;
+    case 1: return GetOperandAddr<false, 1>(reg);
+    case 2: return GetOperandAddr<false, 2>(reg);
+    case 3: return GetOperandAddr<false, 3>(reg);
+    case 4: return GetOperandAddr<false, 4>(reg);
+    case 5: return GetOperandAddr<false, 5>(reg);
+    case 6: return GetOperandAddr<false, 6>(reg);
+    case 7: return GetOperandAddr<false, 7>(reg);
     }
-
-    return addr;
+    return 0;
 }
 
+uint16_t CProcessor::GetByteAddr (uint8_t meth, uint8_t reg)
+{
+    switch (meth)
+    {
+    case 1: return GetOperandAddr<true, 1>(reg);
+    case 2: return GetOperandAddr<true, 2>(reg);
+    case 3: return GetOperandAddr<true, 3>(reg);
+    case 4: return GetOperandAddr<true, 4>(reg);
+    case 5: return GetOperandAddr<true, 5>(reg);
+    case 6: return GetOperandAddr<true, 6>(reg);
+    case 7: return GetOperandAddr<true, 7>(reg);
+    }
+    return 0;
+}
 
 //////////////////////////////////////////////////////////////////////
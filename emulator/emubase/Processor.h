@@ -24,26 +24,44 @@ class CProcessor  // KR1807VM1 processor
 {
 public:  // Constructor / initialization
     CProcessor(CMotherboard* pBoard);
-    void        FireHALT() { m_HALTrq = true; }  // Fire HALT interrupt request, same as HALT command
+    void        FireHALT() { m_intrq |= INTRQ_HALT; }  // Fire HALT interrupt request, same as HALT command
     void        MemoryError();
     int         GetInternalTick() const { return m_internalTick; }
     void        ClearInternalTick() { m_internalTick = 0; }
 
-public:  // Statics
-    static void Init();  // Initialize static tables
-    static void Done();  // Release memory used for static tables
 protected:  // Statics
     typedef void ( CProcessor::*ExecuteMethodRef )();
-    static ExecuteMethodRef* m_pExecuteMethodMap;
-    static void RegisterMethodRef(uint16_t start, uint16_t end, CProcessor::ExecuteMethodRef methodref);
+    static const ExecuteMethodRef m_ExecuteMethodTable[];  // Command implementations by opcode class
 
 protected:  // Processor state
     int         m_internalTick;     // How many ticks waiting to the end of current instruction
-    uint16_t    m_psw;              // Processor Status Word (PSW)
+    int         m_cyclesLeft;       // Ticks left to execute in ExecuteCycles() call
+    uint16_t    m_psw;              // Processor Status Word (PSW); N/Z/V/C bits are valid only for FLAGS_PSW
     uint16_t    m_R[8];             // Registers (R0..R5, R6=SP, R7=PC)
     bool        m_okStopped;        // "Processor stopped" flag
     bool        m_stepmode;         // Read true if it's step mode
     bool        m_waitmode;         // WAIT
+    bool        m_okTranslation;    // Execute translated blocks; false means the interpreter only
+    bool        m_okLockstep;       // Check translated instructions against the interpreter
+    bool        m_okDiverged;       // Lockstep check found a difference
+    bool        m_okLockstepLog;    // Lockstep check: instruction is running, log memory writes
+
+protected:  // Lazy condition codes: the last instruction that set the flags is recorded, N/Z/V/C are calculated on demand
+    enum  // Values for m_flagsop
+    {
+        FLAGS_PSW = 0,      // N, Z, V, C are in m_psw
+        FLAGS_TST,          // N, Z by result; V = 0, C = 0
+        FLAGS_ADD,          // N, Z by result; V, C by CheckAddForXxx(a, b)
+        FLAGS_SUB,          // N, Z by result; V, C by CheckSubForXxx(a, b)
+        FLAGS_MOV,          // N, Z by result; V = 0; this and the next kinds keep C in m_psw
+        FLAGS_INC,          // N, Z by result; V = (result == sign)
+        FLAGS_DEC,          // N, Z by result; V = (result == sign - 1)
+    };
+    uint8_t     m_flagsop;          // Kind of the recorded instruction, FLAGS_XXX
+    uint16_t    m_flagssign;        // Sign bit: 0200 for byte instruction, 0100000 for word instruction
+    uint16_t    m_flagsres;         // Result of the instruction
+    uint16_t    m_flagsa;           // Operands for FLAGS_ADD and FLAGS_SUB
+    uint16_t    m_flagsb;
 
 protected:  // Current instruction processing
     uint16_t    m_instruction;      // Curent instruction
@@ -54,33 +72,70 @@ protected:  // Current instruction processing
     uint8_t     m_regdest;          // Destination register number
     uint8_t     m_methdest;         // Destination address mode
     uint16_t    m_addrdest;         // Destination address
+    uint16_t    m_method;           // Implementation of the current instruction, index in m_ExecuteMethodTable
+
+protected:  // Translated blocks: decoded straight-line code up to a jump, cached by physical start address
+    struct BlockInstruction
+    {
+        uint16_t    address;        // Instruction address
+        uint16_t    instruction;    // Instruction word
+        uint16_t    method;         // Implementation, index in m_ExecuteMethodTable
+        uint8_t     regdest, methdest, regsrc, methsrc;  // Instruction fields
+    };
+    static const int BLOCK_MAXLENGTH = 16;  // Instructions in a block
+    struct Block
+    {
+        uint16_t    address;        // Start address, odd value means empty entry
+        uint16_t    generation;     // Block is valid only when equal to m_blockgeneration,
+        uint32_t    codeaddress;    // when the address is still mapped to this physical address,
+        uint16_t    pagegeneration; // and when equal to m_pagegeneration for the block physical page
+        uint16_t    length;         // Number of instructions; a block never crosses 256-byte page boundary
+        BlockInstruction instructions[BLOCK_MAXLENGTH];
+    };
+    static const int BLOCKCACHE_SIZE = 1024;  // Must be power of 2
+    static const uint32_t CODEMEMORY_SIZE = 01000000;  // Physical memory for translated code, 256 KB
+    Block       m_blockcache[BLOCKCACHE_SIZE];  // Direct-mapped by physical start address
+    uint16_t    m_blockgeneration;  // Incremented on every flush
+    uint32_t    m_codeversion;      // Incremented on every flush, translated code write and window remap
+    uint32_t    m_codewindow[8];    // Physical address for every 8 KB window, see SetCodeWindow()
+    uint16_t    m_pagegeneration[CODEMEMORY_SIZE / 256];  // Incremented when translated code in the 256-byte page is written
+    uint8_t     m_codemap[CODEMEMORY_SIZE / 16];  // Bit for every memory word holding a translated instruction
 
 protected:  // Interrupt processing
-    bool        m_RPLYrq;           // Hangup interrupt pending
-    bool        m_RSVDrq;           // Reserved instruction interrupt pending
-    bool        m_RSVD4rq;          // Reserved instruction: JMP / JSR wrong mode
-    bool        m_TBITrq;           // T-bit interrupt pending
-    bool        m_HALTrq;           // HALT command or HALT signal
-    bool        m_RPL2rq;           // Double hangup interrupt pending
-    bool        m_IRQ5rq;           // Keyboard 7004 interrupt pending
-    bool        m_IRQ2rq;           // Vblank interrupt pending
-    bool        m_IRQ11rq;          // Timer interrupt pending
-    bool        m_BPT_rq;           // BPT command interrupt pending
-    bool        m_IOT_rq;           // IOT command interrupt pending
-    bool        m_EMT_rq;           // EMT command interrupt pending
-    bool        m_TRAPrq;           // TRAP command interrupt pending
-    int         m_virqrq;           // VIRQ pending
+    enum  // Interrupt request bits for m_intrq, lower bit is processed first
+    {
+        INTRQ_HALT  = 0x0001,       // HALT command or HALT signal
+        INTRQ_BPT   = 0x0002,       // BPT command interrupt pending
+        INTRQ_IOT   = 0x0004,       // IOT command interrupt pending
+        INTRQ_EMT   = 0x0008,       // EMT command interrupt pending
+        INTRQ_TRAP  = 0x0010,       // TRAP command interrupt pending
+        INTRQ_RPLY  = 0x0020,       // Hangup interrupt pending
+        INTRQ_RSVD4 = 0x0040,       // Reserved instruction: JMP / JSR wrong mode
+        INTRQ_RSVD  = 0x0080,       // Reserved instruction interrupt pending
+        INTRQ_TBIT  = 0x0100,       // T-bit interrupt; not kept in m_intrq, taken from PSW
+        INTRQ_IRQ5  = 0x0200,       // Keyboard 7004 interrupt pending, priority 5
+        INTRQ_IRQ2  = 0x0400,       // Vblank interrupt pending, priority 4
+        INTRQ_IRQ11 = 0x0800,       // Timer interrupt pending, priority 6
+        INTRQ_VIRQ  = 0x1000,       // VIRQ pending, see m_virqmask
+        INTRQ_HALT_BIT = 0,         // Bit numbers for the requests processed in a special way
+        INTRQ_VIRQ_BIT = 12,
+    };
+    static const uint16_t m_intrqPriorityMask[8];  // Interrupt requests allowed for every PSW priority 0..7
+    static const uint16_t m_intrqVector[13];  // Interrupt vectors by request bit number
+    uint16_t    m_intrq;            // Pending interrupt requests, INTRQ_XXX bits
+    uint16_t    m_virqmask;         // VIRQ pending, bit for every non-zero m_virq entry
     uint16_t    m_virq[16];         // VIRQ vector
 protected:
     CMotherboard* m_pBoard;
 
 public:  // Register control
-    uint16_t    GetPSW() const { return m_psw; }
-    uint8_t     GetLPSW() const { return LOBYTE(m_psw); }
-    void        SetPSW(uint16_t word) { m_psw = word; }
+    uint16_t    GetPSW() const;
+    uint8_t     GetLPSW() const { return LOBYTE(GetPSW()); }
+    void        SetPSW(uint16_t word) { m_psw = word;  m_flagsop = FLAGS_PSW; }
     void        SetLPSW(uint8_t byte)
     {
         m_psw = (m_psw & 0xFF00) | (uint16_t)byte;
+        m_flagsop = FLAGS_PSW;
     }
     uint16_t    GetReg(int regno) const { return m_R[regno]; }
     void        SetReg(int regno, uint16_t word) { m_R[regno] = word; }
@@ -93,13 +148,16 @@ public:  // Register control
 
 public:  // PSW bits control
     void        SetC(bool bFlag);
-    uint16_t    GetC() const { return (m_psw & PSW_C) != 0; }
+    uint16_t    GetC() const;
     void        SetV(bool bFlag);
-    uint16_t    GetV() const { return (m_psw & PSW_V) != 0; }
+    uint16_t    GetV() const;
     void        SetN(bool bFlag);
-    uint16_t    GetN() const { return (m_psw & PSW_N) != 0; }
+    uint16_t    GetN() const;
     void        SetZ(bool bFlag);
-    uint16_t    GetZ() const { return (m_psw & PSW_Z) != 0; }
+    uint16_t    GetZ() const;
+protected:
+    void        SetLazyFlags(uint8_t op, uint16_t sign, uint16_t result, uint16_t a = 0, uint16_t b = 0);
+    void        UpdatePSWFlags();  // Put the recorded flags into m_psw
 
 public:  // Processor state
     // "Processor stopped" flag
@@ -107,25 +165,112 @@ public:  // Processor state
 public:  // Processor control
     void        Start();     // Start processor
     void        Stop();      // Stop processor
-    void        FireIRQ5() { m_IRQ5rq = true; }
-    void        FireIRQ2() { m_IRQ2rq = true; }
-    void        FireIRQ11() { m_IRQ11rq = true; }
+    void        FireIRQ5() { m_intrq |= INTRQ_IRQ5; }
+    void        FireIRQ2() { m_intrq |= INTRQ_IRQ2; }
+    void        FireIRQ11() { m_intrq |= INTRQ_IRQ11; }
     void        InterruptVIRQ(int que, uint16_t interrupt);  // External interrupt via VIRQ signal
-    void        Execute();   // Execute one instruction - for debugger only
+    void        Execute();   // Execute one CPU tick - for debugger only
+    int         ExecuteCycles(int cycles);  // Execute CPU ticks, returns ticks left to finish the last instruction
+    int         GetCyclesLeft() const { return m_cyclesLeft; }  // Ticks left in the running ExecuteCycles() call
+    void        ReduceCyclesLeft(int cycles) { m_cyclesLeft -= cycles; }  // Make the running ExecuteCycles() call end earlier
+    void        FlushDecodeCache();  // Forget translated code, call when memory changed not by the CPU
+    // Physical address of the 8 KB window, below CODEMEMORY_SIZE; call when the memory map changed.
+    // Translated code is kept by physical address, so it survives the window remapped away and back.
+    void        SetCodeWindow(int window, uint32_t codeaddress) { m_codewindow[window] = codeaddress;  m_codeversion++; }
+
+public:  // Execution engine: translated blocks, or the interpreter alone as the reference
+    void        SetTranslation(bool okTranslation) { m_okTranslation = okTranslation;  FlushDecodeCache(); }
+    bool        IsTranslation() const { return m_okTranslation; }
+    // Lockstep check: every instruction run by ExecuteBlock() is run once again by the interpreter on the state saved
+    // before it, with memory writes undone; registers, PSW, interrupt requests, ticks and memory writes must be the same,
+    // and ExecuteBlock() must go on with the next instruction only when ExecuteCycles() would do so.
+    // Instructions accessing I/O ports, RESET and instructions with a stale decode are run by the interpreter alone.
+    // On the first difference the interpreter result stays and ExecuteCycles() stops right after the instruction.
+    void        SetLockstep(bool okLockstep) { m_okLockstep = okLockstep; }
+    bool        IsLockstep() const { return m_okLockstep; }
+    bool        IsDiverged() const { return m_okDiverged; }  // ExecuteCycles() stopped, GetCyclesLeft() ticks were not executed
+    void        ClearDiverged() { m_okDiverged = false;  m_cyclesLeft = 0; }
 
 public:  // Saving/loading emulator status (pImage addresses up to 32 bytes)
     void        SaveToImage(uint8_t* pImage);
     void        LoadFromImage(const uint8_t* pImage);
 
 protected:  // Implementation
+    void        ExecuteInstruction();    // Execute one instruction and process interrupts
+    void        ExecuteBlock();          // Execute instructions of the translated block while possible, process interrupts
+    void        ProcessInterrupts();     // Interrupt processing after the instruction
     void        FetchInstruction();      // Read next instruction
     void        TranslateInstruction();  // Execute the instruction
+    Block*      FindBlock(uint16_t address)
+    {
+        uint32_t codeaddress = GetCodeAddress(address);
+        Block& block = m_blockcache[(codeaddress >> 1) & (BLOCKCACHE_SIZE - 1)];
+        if (block.address == address && block.codeaddress == codeaddress && block.generation == m_blockgeneration &&
+            block.pagegeneration == m_pagegeneration[codeaddress >> 8])
+            return &block;
+        return nullptr;
+    }
+    Block*      TranslateBlock(uint16_t address, uint16_t instruction);
+    bool        CheckBlockInstruction(const BlockInstruction& instr);  // Lockstep check
+    void        LockstepBegin();  // Save the state before the instruction, start logging memory writes
+    bool        LockstepCheck(bool okContinue);  // Run the instruction by the interpreter and compare; false means divergence
+    bool        IsBlockValid(const Block& block) const
+    {
+        return block.generation == m_blockgeneration && block.codeaddress == GetCodeAddress(block.address) &&
+               block.pagegeneration == m_pagegeneration[block.codeaddress >> 8];
+    }
+    uint32_t    GetCodeAddress(uint16_t address) const { return m_codewindow[address >> 13] + (address & 017777); }
 protected:  // Implementation - memory access
     uint16_t    GetWordExec(uint16_t address) { return m_pBoard->GetWordExec(address); }
     uint16_t    GetWord(uint16_t address) { return m_pBoard->GetWord(address); }
-    void        SetWord(uint16_t address, uint16_t word) { m_pBoard->SetWord(address, word); }
+    void        SetWord(uint16_t address, uint16_t word)
+    {
+        InvalidateCode(address);
+        if (m_okLockstepLog) LogLockstepWrite(address, word, false);
+        m_pBoard->SetWord(address, word);
+    }
     uint8_t     GetByte(uint16_t address) { return m_pBoard->GetByte(address); }
-    void        SetByte(uint16_t address, uint8_t byte) { m_pBoard->SetByte(address, byte); }
+    void        SetByte(uint16_t address, uint8_t byte)
+    {
+        InvalidateCode(address);
+        if (m_okLockstepLog) LogLockstepWrite(address, byte, true);
+        m_pBoard->SetByte(address, byte);
+    }
+    void        InvalidateCode(uint16_t address)
+    {
+        uint32_t codeaddress = GetCodeAddress(address);
+        if (m_codemap[codeaddress >> 4] & (1 << ((codeaddress >> 1) & 7)))
+            InvalidateCodePage(codeaddress);
+    }
+    void        InvalidateCodePage(uint32_t codeaddress);  // Forget translated blocks of the 256-byte physical page
+
+protected:  // Lockstep check, see SetLockstep()
+    struct LockstepState
+    {
+        uint16_t    R[8];
+        uint16_t    psw;
+        uint16_t    intrq;
+        int         internalTick;
+        bool        waitmode;
+        bool        stepmode;
+        int         cyclesLeft;
+        uint32_t    slowaccesses;  // Board slow access count, changed means I/O ports access
+    };
+    struct LockstepWrite
+    {
+        uint16_t    address;
+        uint16_t    value;
+        uint16_t    oldvalue;  // To undo the write before the interpreter runs the instruction
+        bool        okByte;
+    };
+    enum { LOCKSTEP_MAXWRITES = 8 };
+    LockstepState m_lockstepstate;  // State before the instruction
+    LockstepWrite m_lockstepwrites[LOCKSTEP_MAXWRITES];
+    int         m_lockstepwritecount;  // Above LOCKSTEP_MAXWRITES means the instruction can't be checked
+    void        GetLockstepState(LockstepState& state) const;
+    void        SetLockstepState(const LockstepState& state);
+    void        LogLockstepWrite(uint16_t address, uint16_t value, bool okByte);
+    void        LogLockstepState(LPCTSTR title, const LockstepState& state, const LockstepWrite* writes, int writecount);
 
 protected:  // PSW bits calculations
     bool static CheckForNegative(uint8_t byte) { return (byte & 0200) != 0; }
@@ -144,18 +289,21 @@ protected:  // PSW bits calculations
 protected:
     uint16_t    GetWordAddr (uint8_t meth, uint8_t reg);
     uint16_t    GetByteAddr (uint8_t meth, uint8_t reg);
+    // Address mode known at compile time: for the instruction variants specialized by address modes
+    template<bool isbyte, int meth> uint16_t GetOperandAddr(uint8_t reg);
+    template<bool isbyte, int meth> uint16_t GetOperand(uint8_t reg, uint16_t& ea);
+    template<bool isbyte, int meth> void SetOperand(uint8_t reg, uint16_t ea, uint16_t value);
 
 protected:  // Implementation - instruction execution
     void        ExecuteUNKNOWN ();  // There is no such instruction -- just call TRAP 10
 
+    // Variants specialized by operation, byte/word and address modes, see m_ExecuteMethodTable
+    template<int op, bool isbyte, int methsrc, int methdest> void ExecuteDoubleOperand();
+    template<int op, bool isbyte, int methdest> void ExecuteSingleOperand();
+
     // One field
-    void        ExecuteCLR ();
     void        ExecuteCOM ();
-    void        ExecuteINC ();
-    void        ExecuteDEC ();
     void        ExecuteNEG ();
-    void        ExecuteTST ();
-    void        ExecuteTSTB();
     void        ExecuteASR ();
     void        ExecuteASL ();
     void        ExecuteROR ();
@@ -166,16 +314,6 @@ protected:  // Implementation - instruction execution
     void        ExecuteSWAB();
     void        ExecuteMTPS();
     void        ExecuteMFPS();
-    // Two fields
-    void        ExecuteMOV ();
-    void        ExecuteMOVB();
-    void        ExecuteCMP ();
-    void        ExecuteADD ();
-    void        ExecuteSUB ();
-    void        ExecuteBIT ();
-    void        ExecuteBIC ();
-    void        ExecuteBIS ();
-    void        ExecuteXOR ();
     // Branching
     void        ExecuteBR  ();
     void        ExecuteBNE ();
@@ -217,20 +355,92 @@ protected:  // Implementation - instruction execution
 // PSW bits control - implementation
 inline void CProcessor::SetC (bool bFlag)
 {
+    if (m_flagsop != FLAGS_PSW) UpdatePSWFlags();
     if (bFlag) m_psw |= PSW_C; else m_psw &= ~PSW_C;
 }
 inline void CProcessor::SetV (bool bFlag)
 {
+    if (m_flagsop != FLAGS_PSW) UpdatePSWFlags();
     if (bFlag) m_psw |= PSW_V; else m_psw &= ~PSW_V;
 }
 inline void CProcessor::SetN (bool bFlag)
 {
+    if (m_flagsop != FLAGS_PSW) UpdatePSWFlags();
     if (bFlag) m_psw |= PSW_N; else m_psw &= ~PSW_N;
 }
 inline void CProcessor::SetZ (bool bFlag)
 {
+    if (m_flagsop != FLAGS_PSW) UpdatePSWFlags();
     if (bFlag) m_psw |= PSW_Z; else m_psw &= ~PSW_Z;
 }
+inline uint16_t CProcessor::GetN() const
+{
+    if (m_flagsop == FLAGS_PSW) return (m_psw & PSW_N) != 0;
+    return (m_flagsres & m_flagssign) != 0;
+}
+inline uint16_t CProcessor::GetZ() const
+{
+    if (m_flagsop == FLAGS_PSW) return (m_psw & PSW_Z) != 0;
+    return m_flagsres == 0;
+}
+inline uint16_t CProcessor::GetV() const
+{
+    switch (m_flagsop)
+    {
+    case FLAGS_ADD:
+        if (m_flagssign == 0200) return CheckAddForOverflow((uint8_t)m_flagsa, (uint8_t)m_flagsb);
+        return CheckAddForOverflow(m_flagsa, m_flagsb);
+    case FLAGS_SUB:
+        if (m_flagssign == 0200) return CheckSubForOverflow((uint8_t)m_flagsa, (uint8_t)m_flagsb);
+        return CheckSubForOverflow(m_flagsa, m_flagsb);
+    case FLAGS_TST:
+    case FLAGS_MOV:
+        return 0;
+    case FLAGS_INC:
+        return m_flagsres == m_flagssign;
+    case FLAGS_DEC:
+        return m_flagsres == m_flagssign - 1;
+    default:
+        return (m_psw & PSW_V) != 0;
+    }
+}
+inline uint16_t CProcessor::GetC() const
+{
+    switch (m_flagsop)
+    {
+    case FLAGS_ADD:
+        if (m_flagssign == 0200) return CheckAddForCarry((uint8_t)m_flagsa, (uint8_t)m_flagsb);
+        return CheckAddForCarry(m_flagsa, m_flagsb);
+    case FLAGS_SUB:
+        if (m_flagssign == 0200) return CheckSubForCarry((uint8_t)m_flagsa, (uint8_t)m_flagsb);
+        return CheckSubForCarry(m_flagsa, m_flagsb);
+    case FLAGS_TST:
+        return 0;
+    default:
+        return (m_psw & PSW_C) != 0;
+    }
+}
+inline uint16_t CProcessor::GetPSW() const
+{
+    if (m_flagsop == FLAGS_PSW) return m_psw;
+    return (m_psw & ~(PSW_N | PSW_Z | PSW_V | PSW_C)) |
+           (GetN() ? PSW_N : 0) | (GetZ() ? PSW_Z : 0) | (GetV() ? PSW_V : 0) | (GetC() ? PSW_C : 0);
+}
+inline void CProcessor::UpdatePSWFlags()
+{
+    m_psw = GetPSW();
+    m_flagsop = FLAGS_PSW;
+}
+// Record the instruction result instead of setting the flags; result is a byte value for byte instruction
+inline void CProcessor::SetLazyFlags(uint8_t op, uint16_t sign, uint16_t result, uint16_t a, uint16_t b)
+{
+    if (op >= FLAGS_MOV && m_flagsop != FLAGS_PSW && m_flagsop < FLAGS_MOV)  // C is kept, take it from the previous record
+    {
+        if (GetC()) m_psw |= PSW_C; else m_psw &= ~PSW_C;
+    }
+    m_flagsop = op;  m_flagssign = sign;  m_flagsres = result;
+    m_flagsa = a;  m_flagsb = b;
+}
 
 // PSW bits calculations - implementation
 inline bool CProcessor::CheckAddForOverflow (uint8_t a, uint8_t b)
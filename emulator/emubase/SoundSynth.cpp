@@ -0,0 +1,177 @@
+﻿/*  This file is part of MS0515BTL.
+    MS0515BTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    MS0515BTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// SoundSynth.cpp
+//
+// Every step of the input signal is added to the buffer as a band-limited impulse,
+// taken from the table for the nearest of SOUNDSYNTH_PHASES positions between two samples.
+// Reading integrates the impulses into steps, and removes DC with a simple high-pass filter.
+// See also:
+// * http://www.slack.net/~ant/bl-synth/ -- Band-Limited Sound Synthesis
+// * http://www.cs.cmu.edu/~eli/papers/icmc01-hardsync.pdf -- Hard Sync Without Aliasing
+
+#include "stdafx.h"
+#include "Emubase.h"
+#include <math.h>
+
+//////////////////////////////////////////////////////////////////////
+
+const int SOUNDSYNTH_KERNELBITS = 15;  // Kernel sum is 1 << SOUNDSYNTH_KERNELBITS
+const double SOUNDSYNTH_CUTOFF = 0.9;  // Low-pass cutoff, part of Nyquist frequency
+const double SOUNDSYNTH_PI = 3.14159265358979323846;
+
+
+CSoundSynth::CSoundSynth()
+{
+    m_nClockRate = m_nSampleRate = 0;
+    m_factor = m_offset = 0;
+    m_pBuffer = nullptr;
+    m_nBufferSize = m_nAvail = 0;
+    m_integrator = m_dc = 0;
+
+    // Windowed sinc for every edge position; the edge goes SOUNDSYNTH_WIDTH / 2 samples before the impulse center
+    for (int phase = 0; phase < SOUNDSYNTH_PHASES; phase++)
+    {
+        double kernel[SOUNDSYNTH_WIDTH];
+        double sum = 0.0;
+        for (int i = 0; i < SOUNDSYNTH_WIDTH; i++)
+        {
+            double x = i - SOUNDSYNTH_WIDTH / 2 + 1 - (double)phase / SOUNDSYNTH_PHASES;
+            double sinc = (x == 0.0) ? 1.0 : sin(SOUNDSYNTH_PI * SOUNDSYNTH_CUTOFF * x) / (SOUNDSYNTH_PI * SOUNDSYNTH_CUTOFF * x);
+            double w = 2.0 * SOUNDSYNTH_PI * x / SOUNDSYNTH_WIDTH;  // Blackman window
+            double window = 0.42 + 0.5 * cos(w) + 0.08 * cos(2.0 * w);
+            kernel[i] = sinc * window;
+            sum += kernel[i];
+        }
+        // Normalize so that every impulse makes a step of exactly the given size
+        int total = 0, center = SOUNDSYNTH_WIDTH / 2 - 1;
+        for (int i = 0; i < SOUNDSYNTH_WIDTH; i++)
+        {
+            m_kernel[phase][i] = (int16_t)floor(kernel[i] / sum * (1 << SOUNDSYNTH_KERNELBITS) + 0.5);
+            total += m_kernel[phase][i];
+        }
+        m_kernel[phase][center] = (int16_t)(m_kernel[phase][center] + (1 << SOUNDSYNTH_KERNELBITS) - total);
+    }
+}
+
+CSoundSynth::~CSoundSynth()
+{
+    ::free(m_pBuffer);
+}
+
+void CSoundSynth::SetRates(int clockrate, int samplerate, int frameclocks)
+{
+    ::free(m_pBuffer);
+    m_pBuffer = nullptr;
+    m_nClockRate = clockrate;
+    m_nSampleRate = samplerate;
+    m_nBufferSize = 0;
+    if (clockrate <= 0 || samplerate <= 0)
+    {
+        m_nSampleRate = 0;
+        return;
+    }
+
+    m_factor = ((uint64_t)samplerate << 32) / (uint64_t)clockrate;
+
+    // Room for two frames of samples, so the reader may lag by one frame
+    int framesamples = (int)(((uint64_t)frameclocks * m_factor) >> 32) + 1;
+    m_nBufferSize = framesamples * 2 + SOUNDSYNTH_WIDTH;
+    m_pBuffer = (int32_t*) ::calloc(m_nBufferSize, sizeof(int32_t));
+
+    Clear();
+}
+
+void CSoundSynth::Clear()
+{
+    m_offset = 0;
+    m_nAvail = 0;
+    m_integrator = m_dc = 0;
+    if (m_pBuffer != nullptr)
+        memset(m_pBuffer, 0, m_nBufferSize * sizeof(int32_t));
+}
+
+void CSoundSynth::AddDelta(uint32_t time, int delta)
+{
+    if (m_pBuffer == nullptr)
+        return;
+
+    uint64_t position = m_offset + time * m_factor;
+    int index = m_nAvail + (int)(position >> 32);
+    if (index + SOUNDSYNTH_WIDTH > m_nBufferSize)
+        return;  // Too far from the frame start
+
+    int phase = (int)(((position & 0xffffffffULL) * SOUNDSYNTH_PHASES) >> 32);
+    const int16_t* kernel = m_kernel[phase];
+    int32_t* buffer = m_pBuffer + index;
+    for (int i = 0; i < SOUNDSYNTH_WIDTH; i++)
+        buffer[i] += kernel[i] * delta;
+}
+
+void CSoundSynth::EndFrame(uint32_t time)
+{
+    if (m_pBuffer == nullptr)
+        return;
+
+    m_offset += time * m_factor;
+    int count = (int)(m_offset >> 32);
+    m_offset &= 0xffffffffULL;
+
+    // Drop the oldest samples if nobody reads them
+    int maxavail = m_nBufferSize - SOUNDSYNTH_WIDTH;
+    if (count > maxavail)
+        count = maxavail;
+    if (m_nAvail + count > maxavail)
+    {
+        int drop = m_nAvail + count - maxavail;
+        for (int i = 0; i < drop; i++)
+            m_integrator += m_pBuffer[i];
+        RemoveSamples(drop);
+    }
+    m_nAvail += count;
+}
+
+int CSoundSynth::ReadSamples(int16_t* pBuffer, int count)
+{
+    if (count > m_nAvail)
+        count = m_nAvail;
+    if (count <= 0)
+        return 0;
+
+    int32_t integrator = m_integrator;
+    int32_t dc = m_dc;
+    for (int i = 0; i < count; i++)
+    {
+        integrator += m_pBuffer[i];
+        int32_t sample = integrator >> SOUNDSYNTH_KERNELBITS;
+        dc += ((sample << 8) - dc) >> 8;  // High-pass with time constant of 256 samples
+        sample -= dc >> 8;
+        if (sample > 32767) sample = 32767;
+        else if (sample < -32768) sample = -32768;
+        pBuffer[i] = (int16_t)sample;
+    }
+
+    m_integrator = integrator;
+    m_dc = dc;
+    RemoveSamples(count);
+    return count;
+}
+
+void CSoundSynth::RemoveSamples(int count)
+{
+    // Keep the rest of the available samples and the tails of the last impulses
+    int remain = m_nAvail - count + SOUNDSYNTH_WIDTH;
+    memmove(m_pBuffer, m_pBuffer + count, remain * sizeof(int32_t));
+    memset(m_pBuffer + remain, 0, count * sizeof(int32_t));
+    m_nAvail -= count;
+}
+
+
+//////////////////////////////////////////////////////////////////////
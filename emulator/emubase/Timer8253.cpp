@@ -19,6 +19,8 @@ MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
 
 void simulate(CTimerChannel* timer);
 void decrease_counter_value(CTimerChannel* timer);
+void subtract_counter_value(CTimerChannel* timer, uint64_t count);
+uint32_t counter_weight(CTimerChannel* timer);
 uint16_t masked_value(CTimerChannel* timer);
 void load_count(CTimerChannel* timer, uint16_t newcount);
 void load_counter_value(CTimerChannel* timer);
@@ -33,8 +35,11 @@ void set_output(CTimerChannel* timer, int output);
 CTimer8253::CTimer8253()
 {
     ::memset(m_timers, 0, sizeof(m_timers));
+    m_clock = 0;
     for (int i = 0; i < 3; i++)
     {
+        m_OutputCallback[i] = nullptr;
+        m_OutputCallbackParam[i] = nullptr;
         m_timers[i].control = m_timers[i].status = 0x30;
         m_timers[i].gate = 1;
     }
@@ -60,6 +65,20 @@ void CTimer8253::Reset()
 {
 }
 
+void CTimer8253::SetOutputCallback(int channel, TIMEROUTPUTCALLBACK callback, void* param)
+{
+    if (channel < 0 || channel > 2)
+        return;
+    m_OutputCallback[channel] = callback;
+    m_OutputCallbackParam[channel] = param;
+}
+
+void CTimer8253::FireOutputCallback(int channel, uint64_t clock)
+{
+    if (m_OutputCallback[channel] != nullptr)
+        (*m_OutputCallback[channel])(m_OutputCallbackParam[channel], channel, clock, m_timers[channel].output != 0);
+}
+
 void CTimer8253::WriteCommand(uint8_t data)
 {
     int channel = (data >> 6) & 3;
@@ -77,7 +96,10 @@ void CTimer8253::WriteCommand(uint8_t data)
         timer->wmsb = timer->rmsb = 0;
         // Phase 0 is always the phase after a mode control write
         timer->phase = 0;
+        int output = timer->output;
         set_output(timer, CTRL_MODE(timer->control) ? 1 : 0);
+        if (timer->output != output)
+            FireOutputCallback(channel, m_clock);
     }
 }
 
@@ -163,7 +185,10 @@ void CTimer8253::Write(int channel, uint8_t data)
             if (CTRL_MODE(timer->control) == 0)
             {
                 timer->phase = 0;
+                int output = timer->output;
                 set_output(timer, 0);
+                if (timer->output != output)
+                    FireOutputCallback(channel, m_clock);
             }
         }
         timer->wmsb = 1 - timer->wmsb;
@@ -171,12 +196,78 @@ void CTimer8253::Write(int channel, uint8_t data)
     }
 }
 
-void CTimer8253::ClockTick()
+void CTimer8253::Advance(uint64_t clock)
 {
+    if (clock <= m_clock)
+        return;
+
+    uint64_t clocks = clock - m_clock;
     for (int i = 0; i < 3; i++)
+        AdvanceChannel(i, clocks);
+    m_clock = clock;
+}
+
+// Same as calling simulate() the given number of times, but skips the plain countdown
+void CTimer8253::AdvanceChannel(int channel, uint64_t clocks)
+{
+    CTimerChannel* timer = m_timers + channel;
+    uint64_t clockend = m_clock + clocks;  // Number of the last clock tick to simulate
+    bool okSkipPeriods = (m_OutputCallback[channel] == nullptr);  // Can skip periods if nobody needs the output changes
+    uint64_t cyclestart = 0;  // Clocks left at the start of the last square wave period
+    CTimerChannel cyclestate;  // Channel state at the start of the last square wave period
+    while (clocks > 0)
     {
-        CTimerChannel* timer = m_timers + i;
-        simulate(timer);
+        int mode = CTRL_MODE(timer->control);
+        if (mode == 3 && timer->gate != 0 && timer->phase != 0)
+        {
+            if (timer->value != 0)  // Counting down by two per clock
+            {
+                uint64_t tozero = (counter_weight(timer) + 1) / 2;
+                if (clocks < tozero)
+                {
+                    subtract_counter_value(timer, clocks * 2);
+                    return;
+                }
+                timer->value = 0;
+                clocks -= tozero;
+                continue;
+            }
+            if (timer->phase == 3)  // Output goes high now, square wave period starts
+            {
+                if (okSkipPeriods && cyclestart != 0 && memcmp(&cyclestate, timer, sizeof(CTimerChannel)) == 0)
+                    clocks %= cyclestart - clocks;  // Same state as one period ago, skip whole periods
+                cyclestart = clocks;
+                memcpy(&cyclestate, timer, sizeof(CTimerChannel));
+                if (clocks == 0)
+                    return;
+            }
+            int output = timer->output;
+            simulate(timer);
+            if (timer->output != output)
+                FireOutputCallback(channel, clockend - clocks + 1);
+            clocks--;
+        }
+        else if (mode == 0 && timer->phase == 3)  // Counting down with no output change
+        {
+            subtract_counter_value(timer, clocks);
+            return;
+        }
+        else if (mode == 0 && timer->phase != 0)
+        {
+            int output = timer->output;
+            simulate(timer);
+            if (timer->output != output)
+                FireOutputCallback(channel, clockend - clocks + 1);
+            clocks--;
+        }
+        else  // Nothing changes after the first clock
+        {
+            int output = timer->output;
+            simulate(timer);
+            if (timer->output != output)
+                FireOutputCallback(channel, clockend - clocks + 1);
+            return;
+        }
     }
 }
 
@@ -276,6 +367,44 @@ void decrease_counter_value(CTimerChannel* timer)
     timer->value = (thousands << 12) | (hundreds << 8) | (tens << 4) | units;
 }
 
+// Same as calling decrease_counter_value() the given number of times
+void subtract_counter_value(CTimerChannel* timer, uint64_t count)
+{
+    if (CTRL_BCD(timer->control) == 0)
+    {
+        timer->value = (uint16_t)(timer->value - count);
+        return;
+    }
+
+    // BCD: every digit counts down to 0 then goes to 9 and borrows from the next digit
+    uint16_t value = 0;
+    for (int shift = 0; shift < 16; shift += 4)
+    {
+        uint64_t digit = (timer->value >> shift) & 0xf;
+        if (count <= digit)
+        {
+            value |= (uint16_t)((digit - count) << shift);
+            count = 0;
+        }
+        else
+        {
+            value |= (uint16_t)((9 - (count - digit - 1) % 10) << shift);
+            count = 1 + (count - digit - 1) / 10;  // Borrows from the next digit
+        }
+    }
+    timer->value = value;
+}
+
+// Number of decrements to get the counter value down to zero
+uint32_t counter_weight(CTimerChannel* timer)
+{
+    if (CTRL_BCD(timer->control) == 0)
+        return timer->value;
+
+    uint16_t value = timer->value;
+    return (value & 0xf) + ((value >> 4) & 0xf) * 10 + ((value >> 8) & 0xf) * 100 + ((value >> 12) & 0xf) * 1000;
+}
+
 uint16_t masked_value(CTimerChannel* timer)
 {
     if ((CTRL_MODE(timer->control) == 3) /*&& (m_type != FE2010)*/)
@@ -325,8 +454,6 @@ void set_output(CTimerChannel* timer, int output)
         return;
 
     timer->output = output;
-
-    //TODO: fire events
 }
 
 
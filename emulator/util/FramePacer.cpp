@@ -0,0 +1,111 @@
+﻿/*  This file is part of MS0515BTL.
+    MS0515BTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    MS0515BTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// FramePacer.cpp
+
+#include "stdafx.h"
+#include "FramePacer.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+
+const double FRAMEPACER_MAXADJUST = 0.005;  // Speed correction limit, +-0.5% is not audible
+const double FRAMEPACER_GAIN = 0.002;  // Speed correction for the relative fill level error
+const double FRAMEPACER_INTEGRALGAIN = 0.00005;  // Speed correction per frame for the relative fill level error
+const int FRAMEPACER_MAXLAG = 4;  // Frames; do not try to catch up if we are late more than that
+
+
+CFramePacer::CFramePacer(int64_t frameperiod)
+{
+    m_nFramePeriod = frameperiod;
+    m_nSpeedPercent = 100;
+    m_nNextFrameTime = -1;
+    m_dRateAdjust = 1.0;
+    m_dFillAverage = -1.0;
+    m_dFillIntegral = 0.0;
+}
+
+void CFramePacer::SetSpeed(int speedpercent)
+{
+    if (speedpercent < 0)
+        speedpercent = 0;
+    if (m_nSpeedPercent == speedpercent)
+        return;
+
+    m_nSpeedPercent = speedpercent;
+    Reset();
+}
+
+void CFramePacer::Reset()
+{
+    m_nNextFrameTime = -1;
+    m_dRateAdjust = 1.0;
+    m_dFillAverage = -1.0;
+    m_dFillIntegral = 0.0;
+}
+
+void CFramePacer::SetSoundFillLevel(int fill, int target)
+{
+    if (target <= 0)
+        return;
+
+    // The fill level jumps by a whole block when the audio thread takes one, so smooth it
+    if (m_dFillAverage < 0.0)
+        m_dFillAverage = fill;
+    else
+        m_dFillAverage += (fill - m_dFillAverage) * 0.05;
+
+    // Ring filling up means we produce samples faster than the device plays them, so slow down a bit
+    double error = (m_dFillAverage - target) / target;
+    if (error > 1.0) error = 1.0;
+    else if (error < -1.0) error = -1.0;
+    m_dFillIntegral += error * FRAMEPACER_INTEGRALGAIN;
+    if (m_dFillIntegral > FRAMEPACER_MAXADJUST) m_dFillIntegral = FRAMEPACER_MAXADJUST;
+    else if (m_dFillIntegral < -FRAMEPACER_MAXADJUST) m_dFillIntegral = -FRAMEPACER_MAXADJUST;
+    double adjust = error * FRAMEPACER_GAIN + m_dFillIntegral;
+    if (adjust > FRAMEPACER_MAXADJUST) adjust = FRAMEPACER_MAXADJUST;
+    else if (adjust < -FRAMEPACER_MAXADJUST) adjust = -FRAMEPACER_MAXADJUST;
+    m_dRateAdjust = 1.0 - adjust;
+}
+
+int64_t CFramePacer::FrameDone(int64_t now)
+{
+    if (m_nSpeedPercent == 0)
+    {
+        m_nNextFrameTime = -1;
+        return 0;
+    }
+
+    int64_t period = (int64_t)(m_nFramePeriod * 100.0 / m_nSpeedPercent / m_dRateAdjust);
+    if (m_nNextFrameTime < 0 || now - m_nNextFrameTime > period * FRAMEPACER_MAXLAG)
+        m_nNextFrameTime = now;  // Start over from now
+    m_nNextFrameTime += period;
+
+    // Schedule is absolute, so wait errors do not accumulate
+    return (m_nNextFrameTime > now) ? m_nNextFrameTime - now : 0;
+}
+
+int64_t FramePacer_GetTime()
+{
+    static LONGLONG nFreq = 0;
+    if (nFreq == 0)
+    {
+        LARGE_INTEGER nPerformanceFrequency;
+        ::QueryPerformanceFrequency(&nPerformanceFrequency);
+        nFreq = nPerformanceFrequency.QuadPart;
+    }
+    LARGE_INTEGER nCounter;
+    ::QueryPerformanceCounter(&nCounter);
+    return nCounter.QuadPart / nFreq * 1000000 + nCounter.QuadPart % nFreq * 1000000 / nFreq;
+}
+
+
+//////////////////////////////////////////////////////////////////////
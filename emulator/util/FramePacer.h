@@ -0,0 +1,43 @@
+﻿/*  This file is part of MS0515BTL.
+    MS0515BTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    MS0515BTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// FramePacer.h  Keeps the emulator frame rate, tuned by the sound ring fill level
+
+#pragma once
+
+//////////////////////////////////////////////////////////////////////
+
+
+class CFramePacer
+{
+private:
+    int64_t     m_nFramePeriod;    // Frame length at 100% speed, microseconds
+    int         m_nSpeedPercent;   // 0 = no pacing, run as fast as possible
+    int64_t     m_nNextFrameTime;  // Start time of the next frame, microseconds; -1 = not started yet
+    double      m_dRateAdjust;     // Speed correction from the sound ring fill level, around 1.0
+    double      m_dFillAverage;    // Smoothed sound ring fill level, samples
+    double      m_dFillIntegral;   // Accumulated fill level error, removes the steady offset
+public:
+    CFramePacer(int64_t frameperiod);
+    void        SetSpeed(int speedpercent);  // Any percentage; 0 means no pacing
+    int         GetSpeed() const { return m_nSpeedPercent; }
+    double      GetRateAdjust() const { return m_dRateAdjust; }
+    void        Reset();  // Start the schedule anew, e.g. after a pause
+    // Tune the speed to keep the sound ring at the target fill level; call once per frame while sound is on
+    void        SetSoundFillLevel(int fill, int target);
+    // Frame finished at the given time; returns microseconds to wait before the next frame
+    int64_t     FrameDone(int64_t now);
+};
+
+// Current time for CFramePacer, microseconds; QueryPerformanceCounter based
+int64_t FramePacer_GetTime();
+
+
+//////////////////////////////////////////////////////////////////////
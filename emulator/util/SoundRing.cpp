@@ -0,0 +1,203 @@
+﻿/*  This file is part of MS0515BTL.
+    MS0515BTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    MS0515BTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// SoundRing.cpp
+
+#include "stdafx.h"
+#include "SoundRing.h"
+
+
+//////////////////////////////////////////////////////////////////////
+// CSoundRing
+
+CSoundRing::CSoundRing(int capacity)
+{
+    m_nSize = 1;
+    while (m_nSize < (uint32_t)capacity)
+        m_nSize <<= 1;
+    m_pBuffer = (int16_t*) ::calloc(m_nSize, sizeof(int16_t));
+    m_nReadPos = m_nWritePos = 0;
+    m_nUnderruns = m_nOverruns = 0;
+    m_lastSample = 0;
+}
+
+CSoundRing::~CSoundRing()
+{
+    ::free(m_pBuffer);
+}
+
+int CSoundRing::GetFillLevel() const
+{
+    return (int)(m_nWritePos.load(std::memory_order_acquire) - m_nReadPos.load(std::memory_order_acquire));
+}
+
+int CSoundRing::Write(const int16_t* pSamples, int count)
+{
+    uint32_t writepos = m_nWritePos.load(std::memory_order_relaxed);
+    uint32_t readpos = m_nReadPos.load(std::memory_order_acquire);
+    uint32_t room = m_nSize - (writepos - readpos);
+    if ((uint32_t)count > room)
+    {
+        m_nOverruns++;
+        count = (int)room;
+    }
+
+    for (int i = 0; i < count; i++)
+        m_pBuffer[(writepos + i) & (m_nSize - 1)] = pSamples[i];
+
+    m_nWritePos.store(writepos + count, std::memory_order_release);
+    return count;
+}
+
+int CSoundRing::Read(int16_t* pSamples, int count)
+{
+    uint32_t readpos = m_nReadPos.load(std::memory_order_relaxed);
+    uint32_t writepos = m_nWritePos.load(std::memory_order_acquire);
+    int avail = (int)(writepos - readpos);
+    int done = (count < avail) ? count : avail;
+
+    for (int i = 0; i < done; i++)
+        pSamples[i] = m_pBuffer[(readpos + i) & (m_nSize - 1)];
+    if (done > 0)
+        m_lastSample = pSamples[done - 1];
+    if (done < count)
+    {
+        m_nUnderruns++;
+        for (int i = done; i < count; i++)
+            pSamples[i] = m_lastSample;
+    }
+
+    m_nReadPos.store(readpos + done, std::memory_order_release);
+    return done;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// CSoundFileSink
+
+CSoundFileSink::CSoundFileSink(int samplerate, int blocksize, LPCTSTR sFileName)
+{
+    m_nSampleRate = samplerate;
+    m_nBlockSize = blocksize;
+    m_nDataSize = 0;
+    m_fpFile = nullptr;
+    if (sFileName != nullptr)
+    {
+        m_fpFile = ::_tfopen(sFileName, _T("w+b"));
+        if (m_fpFile != nullptr)
+        {
+            uint8_t header[44];  // Fixed in destructor
+            memset(header, 0, sizeof(header));
+            ::fwrite(header, 1, sizeof(header), m_fpFile);
+        }
+    }
+    m_nextBlockTime = std::chrono::steady_clock::now();
+}
+
+CSoundFileSink::~CSoundFileSink()
+{
+    if (m_fpFile == nullptr)
+        return;
+
+    // RIFF WAVE header, PCM 16-bit mono
+    uint8_t header[44];
+    uint32_t values[11] =
+    {
+        0x46464952, 36 + m_nDataSize, 0x45564157,  // "RIFF", size, "WAVE"
+        0x20746d66, 16, 0x00010001,  // "fmt ", size, PCM + 1 channel
+        (uint32_t)m_nSampleRate, (uint32_t)m_nSampleRate * 2, 0x00100002,  // rate, bytes per second, block align + bits
+        0x61746164, m_nDataSize  // "data", size
+    };
+    for (int i = 0; i < 11; i++)
+    {
+        header[i * 4 + 0] = (uint8_t)(values[i]);
+        header[i * 4 + 1] = (uint8_t)(values[i] >> 8);
+        header[i * 4 + 2] = (uint8_t)(values[i] >> 16);
+        header[i * 4 + 3] = (uint8_t)(values[i] >> 24);
+    }
+    ::fseek(m_fpFile, 0, SEEK_SET);
+    ::fwrite(header, 1, sizeof(header), m_fpFile);
+    ::fclose(m_fpFile);
+}
+
+int CSoundFileSink::WaitBlock(int timeoutms)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < m_nextBlockTime)
+    {
+        std::chrono::steady_clock::duration wait = m_nextBlockTime - now;
+        if (wait > std::chrono::milliseconds(timeoutms))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutms));
+            return 0;
+        }
+        std::this_thread::sleep_for(wait);
+    }
+    else if (now - m_nextBlockTime > std::chrono::seconds(1))
+        m_nextBlockTime = now;  // Do not try to catch up after a long delay
+
+    m_nextBlockTime += std::chrono::microseconds((int64_t)m_nBlockSize * 1000000 / m_nSampleRate);
+    return m_nBlockSize;
+}
+
+void CSoundFileSink::WriteBlock(const int16_t* pSamples, int count)
+{
+    if (m_fpFile == nullptr)
+        return;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t bytes[2] = { (uint8_t)pSamples[i], (uint8_t)((uint16_t)pSamples[i] >> 8) };
+        ::fwrite(bytes, 1, 2, m_fpFile);
+    }
+    m_nDataSize += count * 2;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// CSoundPlayer
+
+CSoundPlayer::CSoundPlayer(CSoundRing* pRing, CSoundSink* pSink)
+{
+    m_pRing = pRing;
+    m_pSink = pSink;
+    m_okStop = false;
+    m_thread = std::thread(&CSoundPlayer::Run, this);
+}
+
+CSoundPlayer::~CSoundPlayer()
+{
+    m_okStop = true;
+    m_thread.join();
+}
+
+void CSoundPlayer::Run()
+{
+    int16_t* pBlock = nullptr;
+    int blocksize = 0;
+    while (!m_okStop)
+    {
+        int count = m_pSink->WaitBlock(20);
+        if (count <= 0)
+            continue;
+        if (count > blocksize)
+        {
+            ::free(pBlock);
+            pBlock = (int16_t*) ::malloc(count * sizeof(int16_t));
+            blocksize = count;
+        }
+        m_pRing->Read(pBlock, count);
+        m_pSink->WriteBlock(pBlock, count);
+    }
+    ::free(pBlock);
+}
+
+
+//////////////////////////////////////////////////////////////////////
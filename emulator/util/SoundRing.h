@@ -0,0 +1,89 @@
+﻿/*  This file is part of MS0515BTL.
+    MS0515BTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    MS0515BTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+MS0515BTL. If not, see <http://www.gnu.org/licenses/>. */
+
+// SoundRing.h  Sound sample queue between the emulator and the audio output thread
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+//////////////////////////////////////////////////////////////////////
+
+
+// Lock-free ring of 16-bit mono samples, for one writer thread and one reader thread
+class CSoundRing
+{
+private:
+    int16_t*    m_pBuffer;
+    uint32_t    m_nSize;  // Power of two
+    std::atomic<uint32_t> m_nReadPos;   // Free-running counter, changed by the reader only
+    std::atomic<uint32_t> m_nWritePos;  // Free-running counter, changed by the writer only
+    std::atomic<uint32_t> m_nUnderruns;  // Reads that found not enough samples
+    std::atomic<uint32_t> m_nOverruns;   // Writes that found not enough room
+    int16_t     m_lastSample;  // Last sample read, used for padding
+public:
+    CSoundRing(int capacity);  // Capacity is rounded up to a power of two
+    ~CSoundRing();
+    int         GetCapacity() const { return (int)m_nSize; }
+    int         GetFillLevel() const;  // Number of samples ready to read
+    uint32_t    GetUnderrunCount() const { return m_nUnderruns.load(); }
+    uint32_t    GetOverrunCount() const { return m_nOverruns.load(); }
+public:  // Writer side; never waits, drops the samples that do not fit
+    int         Write(const int16_t* pSamples, int count);
+public:  // Reader side; never waits, pads the missing samples with the last value
+    int         Read(int16_t* pSamples, int count);
+};
+
+
+// Audio device for the audio output thread
+class CSoundSink
+{
+public:
+    virtual ~CSoundSink() {}
+    // Wait up to the given time for the device to take a block; returns block size in samples, 0 = not ready yet
+    virtual int WaitBlock(int timeoutms) = 0;
+    virtual void WriteBlock(const int16_t* pSamples, int count) = 0;
+};
+
+// Device that takes samples in real time and throws them away or saves them to WAV file
+class CSoundFileSink : public CSoundSink
+{
+private:
+    int         m_nSampleRate;
+    int         m_nBlockSize;
+    FILE*       m_fpFile;
+    uint32_t    m_nDataSize;  // Bytes written to the file
+    std::chrono::steady_clock::time_point m_nextBlockTime;
+public:
+    CSoundFileSink(int samplerate, int blocksize, LPCTSTR sFileName);  // sFileName == nullptr means null device
+    virtual ~CSoundFileSink();
+    virtual int WaitBlock(int timeoutms);
+    virtual void WriteBlock(const int16_t* pSamples, int count);
+};
+
+// Audio output thread: moves samples from the ring to the sink
+class CSoundPlayer
+{
+private:
+    CSoundRing* m_pRing;
+    CSoundSink* m_pSink;
+    std::thread m_thread;
+    std::atomic<bool> m_okStop;
+public:
+    CSoundPlayer(CSoundRing* pRing, CSoundSink* pSink);
+    ~CSoundPlayer();  // Stops the thread
+private:
+    void        Run();
+};
+
+
+//////////////////////////////////////////////////////////////////////